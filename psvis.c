@@ -2,38 +2,203 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/list.h>
+#include <linux/list_sort.h>
 #include <linux/types.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
+#include <linux/sched/cputime.h>
+#include <linux/mm.h>
 #include <linux/time.h>
+#include <linux/version.h>
 
 static int PID = -50;
-int **tree_pid, **tree_time;
+static char *sort_by = "pid";
+static int top_n = 0;
 
 module_param(PID, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 MODULE_PARM_DESC(myint, "Entered PID: \n");
+module_param_named(sort, sort_by, charp, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(sort, "Order of children: pid, cpu, rss or threads (subtree totals, largest first)");
+module_param_named(top, top_n, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(top, "Keep only the first N children of every process after sorting, 0 keeps all");
 
-void DFS(struct task_struct *task, int **tree_pid, int **tree_time, int depth)
-{   
+enum sort_key
+{
+    SORT_PID,
+    SORT_CPU,
+    SORT_RSS,
+    SORT_THREADS
+};
+
+static enum sort_key sort_key = SORT_PID;
+
+// resources of one process and of the subtree below it
+struct psvis_usage
+{
+    u64 cpu_ns; // utime + stime
+    unsigned long rss_kb;
+    int threads;
+};
+
+struct psvis_node
+{
+    pid_t pid;
+    u64 start_time;
+    u64 utime, stime;
+    struct psvis_usage own, subtree;
+    int pruned;                   // children dropped by top, summed into pruned_usage
+    struct psvis_usage pruned_usage;
+    struct list_head children;
+    struct list_head sibling;
+};
+
+static void add_usage(struct psvis_usage *total, const struct psvis_usage *usage)
+{
+    total->cpu_ns += usage->cpu_ns;
+    total->rss_kb += usage->rss_kb;
+    total->threads += usage->threads;
+}
+
+// cpu time of all threads of the process, including the ones that already exited
+static void process_cputime(struct task_struct *task, u64 *utime, u64 *stime)
+{
+    struct task_struct *thread;
+    *utime = task->signal->utime;
+    *stime = task->signal->stime;
+    for_each_thread(task, thread)
+    {
+        *utime += thread->utime;
+        *stime += thread->stime;
+    }
+}
+
+static unsigned long process_rss_kb(struct task_struct *task)
+{
+    unsigned long rss = 0;
+    task_lock(task);
+    if (task->mm)
+        rss = get_mm_rss(task->mm) << (PAGE_SHIFT - 10);
+    task_unlock(task);
+    return rss;
+}
+
+static u64 usage_key(const struct psvis_node *node)
+{
+    switch (sort_key)
+    {
+    case SORT_CPU:
+        return node->subtree.cpu_ns;
+    case SORT_RSS:
+        return node->subtree.rss_kb;
+    case SORT_THREADS:
+        return node->subtree.threads;
+    default:
+        return 0;
+    }
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0)
+static int compare_nodes(void *priv, const struct list_head *a, const struct list_head *b)
+#else
+static int compare_nodes(void *priv, struct list_head *a, struct list_head *b)
+#endif
+{
+    struct psvis_node *x = list_entry(a, struct psvis_node, sibling);
+    struct psvis_node *y = list_entry(b, struct psvis_node, sibling);
+    u64 key_x = usage_key(x), key_y = usage_key(y);
+    if (key_x != key_y)
+        return key_x < key_y ? 1 : -1; // largest first
+    return x->pid - y->pid;
+}
+
+static void free_node(struct psvis_node *node)
+{
+    struct psvis_node *child, *next;
+    list_for_each_entry_safe(child, next, &node->children, sibling)
+    {
+        list_del(&child->sibling);
+        free_node(child);
+    }
+    kfree(node);
+}
+
+/**
+ * Collects a task and its descendants in a single post-order pass: the
+ * subtree totals of a node are complete once all of its children returned.
+ * Children are then sorted by the chosen key and cut down to the top ones
+ * Called under rcu_read_lock, so allocations must not sleep
+ */
+static struct psvis_node *DFS(struct task_struct *task)
+{
     struct task_struct *child;
-    struct list_head *list;
-    int i = 0;
-    int j = 0;
-    for(; i<depth; i++) {
-        printk(KERN_CONT "-");
+    struct psvis_node *node = kzalloc(sizeof(struct psvis_node), GFP_ATOMIC);
+    if (node == NULL)
+        return NULL;
+    INIT_LIST_HEAD(&node->children);
+    node->pid = task->pid;
+    node->start_time = task->start_time;
+    process_cputime(task, &node->utime, &node->stime);
+    node->own.cpu_ns = node->utime + node->stime;
+    node->own.rss_kb = process_rss_kb(task);
+    node->own.threads = get_nr_threads(task);
+    node->subtree = node->own;
+
+    list_for_each_entry(child, &task->children, sibling)
+    {
+        struct psvis_node *child_node = DFS(child);
+        if (child_node == NULL)
+            continue;
+        add_usage(&node->subtree, &child_node->subtree);
+        list_add_tail(&child_node->sibling, &node->children);
     }
-    
-    printk(KERN_CONT "PID: %d, Creation Time: %d\n", task->pid, task->start_time);
-    list_for_each(list, &task->children) {
-        child = list_entry(list, struct task_struct, sibling);
-        tree_pid[depth+1][j] = (int) child->pid;
-        tree_time[depth+1][j] = (int) child->start_time;
-        DFS(child, tree_pid, tree_time, depth+1);
-        j++;
+
+    if (sort_key != SORT_PID)
+        list_sort(NULL, &node->children, compare_nodes);
+    if (top_n > 0)
+    {
+        struct psvis_node *child_node, *next;
+        int kept = 0;
+        list_for_each_entry_safe(child_node, next, &node->children, sibling)
+        {
+            if (++kept <= top_n)
+                continue;
+            node->pruned++;
+            add_usage(&node->pruned_usage, &child_node->subtree);
+            list_del(&child_node->sibling);
+            free_node(child_node);
+        }
     }
+    return node;
 }
 
+// prints the collected tree, one line per process, depth shown with dashes
+static void print_tree(struct psvis_node *node, int depth)
+{
+    struct psvis_node *child;
+    int i;
+    for (i = 0; i < depth; i++)
+    {
+        printk(KERN_CONT "-");
+    }
+    printk(KERN_CONT "PID: %d, Creation Time: %llu, User: %llu ms, System: %llu ms, RSS: %lu KB, Threads: %d, "
+                     "Subtree CPU: %llu ms, Subtree RSS: %lu KB, Subtree Threads: %d\n",
+           node->pid, node->start_time, node->utime / NSEC_PER_MSEC, node->stime / NSEC_PER_MSEC, node->own.rss_kb,
+           node->own.threads, node->subtree.cpu_ns / NSEC_PER_MSEC, node->subtree.rss_kb, node->subtree.threads);
+    list_for_each_entry(child, &node->children, sibling)
+    {
+        print_tree(child, depth + 1);
+    }
+    if (node->pruned)
+    {
+        for (i = 0; i <= depth; i++)
+        {
+            printk(KERN_CONT "-");
+        }
+        printk(KERN_CONT "... %d more, Subtree CPU: %llu ms, Subtree RSS: %lu KB, Subtree Threads: %d\n", node->pruned,
+               node->pruned_usage.cpu_ns / NSEC_PER_MSEC, node->pruned_usage.rss_kb, node->pruned_usage.threads);
+    }
+}
 
 /* This function is called when the module is loaded. */
 int proc_init(void)
@@ -48,23 +213,29 @@ int proc_init(void)
     else // valid PID
     {
         struct task_struct *task;
-        tree_pid = kmalloc(100 * sizeof(int*), GFP_KERNEL);
-        tree_time = kmalloc(100 * sizeof(int*), GFP_KERNEL);
-        int i;
-        for (i = 0; i < 100; i++) {
-            tree_pid[i] = kmalloc(100 * sizeof(int), GFP_KERNEL);
-            tree_time[i] = kmalloc(100 * sizeof(int), GFP_KERNEL);
-        }
-        // finding the task with given PID
+        struct psvis_node *root = NULL;
+
+        if (strcmp(sort_by, "cpu") == 0)
+            sort_key = SORT_CPU;
+        else if (strcmp(sort_by, "rss") == 0)
+            sort_key = SORT_RSS;
+        else if (strcmp(sort_by, "threads") == 0)
+            sort_key = SORT_THREADS;
+
+        // the task list may change under us, walk it under RCU
+        rcu_read_lock();
         task = pid_task(find_vpid((pid_t)PID), PIDTYPE_PID);
-        if (task != NULL) {
-            tree_pid[0][0] = (int) task->pid;
-            tree_time[0][0] = (int) task->start_time;
-            DFS(task,tree_pid,tree_time,0);
+        if (task != NULL)
+            root = DFS(task);
+        rcu_read_unlock();
+
+        if (root != NULL) {
+            print_tree(root, 0);
+            free_node(root);
         } else {
             printk(KERN_ALERT "Process with PID %d is not found.",PID);
         }
-        
+
     }
 
     return 0;
@@ -73,13 +244,6 @@ int proc_init(void)
 /* This function is called when the module is removed. */
 void proc_exit(void)
 {
-    int i;
-    for (i = 0; i < 100; i++) {
-        kfree(tree_pid[i]);
-        kfree(tree_time[i]);
-    }
-    kfree(tree_pid);
-    kfree(tree_time);
     printk(KERN_INFO "Removing PSVIS Module\n");
 }
 /* Macros for registering module entry and exit points. */
@@ -88,4 +252,4 @@ module_exit(proc_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("PSVIS Module");
-MODULE_AUTHOR("Ahmet Uysal & Furkan Sahbaz");
\ No newline at end of file
+MODULE_AUTHOR("Ahmet Uysal & Furkan Sahbaz");
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <sys/wait.h>
 #include <stdio.h>
@@ -7,6 +8,29 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <dirent.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <malloc.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+#include <linux/sched.h> // clone_args, CLONE_INTO_CGROUP
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include <openssl/ssl.h>
 
 // ansi color codes
 // TODO: sahbaz https://bluesock.org/~willkg/dev/ansi.html
@@ -24,32 +48,378 @@ enum return_codes
     INVALID = 3
 };
 
+enum redirect_type
+{
+    REDIRECT_FILE,  // open path as fd
+    REDIRECT_DUP,   // make fd a copy of source_fd
+    REDIRECT_CLOSE, // close fd
+    REDIRECT_HEREDOC,   // <<delimiter, body read from the following input lines
+    REDIRECT_HERESTRING, // <<<word, body is the word and a newline
+    REDIRECT_AMBIGUOUS   // <&word or n>&word with a word that is no fd, the stage is not started
+};
+
+// one [n]<file, [n]>file, [n]>>file, [n]<>file, [n]>&m, [n]>&-, &>file, [n]<<word or [n]<<<word
+struct redirect
+{
+    enum redirect_type type;
+    int fd;
+    int flags;  // open flags of REDIRECT_FILE
+    char *path; // file name, or the delimiter of a here-document
+    int source_fd;
+    struct redirect *next;
+    bool strip_tabs; // <<- removes leading tabs from the body and delimiter lines
+    char *body;      // here-document or here-string contents, kept in memory
+    size_t body_length;
+};
+
+// resource usage of a finished foreground stage, filled by wait4
+struct command_stats
+{
+    bool collected;
+    pid_t pid;
+    int status;
+    double wall_seconds;
+    struct rusage usage;
+};
+
+enum placement_mode
+{
+    PLACEMENT_NONE,
+    PLACEMENT_CPUS,  // every stage may run on any cpu of the set
+    PLACEMENT_SPREAD // each stage gets its own cpu of the set, in pipeline order
+};
+
+// cpu affinity and NUMA memory binding applied to a stage right after fork
+struct placement
+{
+    enum placement_mode mode;
+    cpu_set_t cpus;
+    int node; // memory is bound to this node, -1 leaves the policy alone
+};
+
+// cgroup v2 group of a job started with limit, shared by the stages of its pipeline
+struct job_cgroup
+{
+    char *path;
+    int fd; // directory fd for clone3(CLONE_INTO_CGROUP)
+    int references;
+};
+
 struct command_t
 {
     char *name;
     bool background;
+    bool timed; // started with the time prefix
     int arg_count;
     char **args;
-    char *redirects[3];     // in/out redirection
+    struct redirect *redirects; // fd redirections, applied in order
+    struct command_stats stats;
+    struct placement placement;
+    struct job_cgroup *cgroup; // NULL unless started with limit
+    int *substitution_fds; // /dev/fd/N ends of <(cmd) and >(cmd), closed with the command
+    int substitution_fd_count;
+    struct script_node *script; // compiled for, while or if block, run instead of the command
     struct command_t *next; // for piping
 };
 
 struct autocomplete_match
 {
     int match_count;
-    char **matches;
+    int prefix_count;    // matches starting with the input, ranked first
+    char **matches;      // best match first
+    char **descriptions; // optional, shown next to the matches in the menu
+};
+
+// what an argument of a command completes to
+enum completion_kind
+{
+    COMPLETE_NONE,
+    COMPLETE_FILE,
+    COMPLETE_DIRECTORY,
+    COMPLETE_COMMAND,
+    COMPLETE_PID,
+    COMPLETE_TIME
+};
+
+#define COMPLETION_SPEC_MAX_ARGS 4
+
+// per-command completion spec, arguments past the listed ones complete as the last kind
+struct completion_spec
+{
+    const char *command;
+    int arg_kind_count;
+    enum completion_kind arg_kinds[COMPLETION_SPEC_MAX_ARGS];
+};
+
+struct completion_spec completion_specs[] = {
+    {"cd", 1, {COMPLETE_DIRECTORY}},
+    {"myfg", 1, {COMPLETE_PID}},
+    {"mybg", 1, {COMPLETE_PID}},
+    {"pause", 1, {COMPLETE_PID}},
+    {"kill", 1, {COMPLETE_PID}},
+    {"psvis", 4, {COMPLETE_PID, COMPLETE_FILE, COMPLETE_NONE, COMPLETE_NONE}},
+    {"alarm", 2, {COMPLETE_TIME, COMPLETE_FILE}},
+    {"hwtim", 1, {COMPLETE_NONE}},
+    {"myjobs", 1, {COMPLETE_NONE}},
+    {"corona", 1, {COMPLETE_NONE}},
+    {"shellstats", 1, {COMPLETE_NONE}},
+    {"shellmem", 1, {COMPLETE_NONE}},
+    {"out", 1, {COMPLETE_NONE}},
+    {"pin", 3, {COMPLETE_NONE, COMPLETE_COMMAND, COMPLETE_FILE}},
+    {"jobs", 1, {COMPLETE_NONE}},
+    {"monitor", 2, {COMPLETE_COMMAND, COMPLETE_FILE}},
+};
+
+// open addressing table over completion_specs, keyed by command name
+#define COMPLETION_SPEC_TABLE_SIZE 64
+struct completion_spec *completion_spec_table[COMPLETION_SPEC_TABLE_SIZE];
+
+// where the cursor is: the command of the current pipeline stage and which argument is typed
+struct completion_context
+{
+    char command[256];
+    int arg_index; // -1 while the command name itself is typed
+    int word_start;
+};
+
+// processes for pid completion, re-read from /proc at most once a second
+struct proc_snapshot_entry
+{
+    pid_t pid;
+    pid_t ppid;
+    char name[32];
+};
+
+struct proc_snapshot_entry *proc_snapshot;
+int proc_snapshot_count = 0;
+struct timespec proc_snapshot_time;
+
+// ranked candidates shown after a tab, further tabs cycle through them
+struct completion_menu
+{
+    struct autocomplete_match *match;
+    int selected;
+    int word_start;
+};
+
+// words used in previous commands, for frecency ranking of completions
+struct history_entry
+{
+    char *word;
+    unsigned int count;
+    time_t last_used;
 };
 
+struct history_entry *history_table;
+int history_capacity = 0;
+int history_size = 0;
+
+#define HISTORY_MAX_WORDS 4096 // past this the least frecent quarter of the words is forgotten
+
+#define COMPLETION_MENU_QUERY_ITEMS 100 // longer lists ask before they are shown
+
+// terminal size, read again only after a SIGWINCH
+volatile sig_atomic_t terminal_size_stale = 1;
+struct winsize terminal_size = {24, 80, 0, 0};
+
 char **all_available_commands;
+uint64_t *all_available_command_masks; // fuzzy_char_mask of each command
 int number_of_available_commands;
 
-char *shellgibi_builtin_commands[] = {"myjobs", "pause", "mybg", "myfg", "alarm", "psvis", "corona", "hwtim"};
+// exit status of the last foreground command, as returned by wait4
+int last_exit_status = 0;
+// wall time of the last command line, shown in the prompt
+double last_command_seconds = 0;
+
+// background commands started with &, removed when reaped
+#define MAX_JOBS 256
+
+struct job
+{
+    pid_t pid;
+    char *name;
+    char *cgroup; // removed when the job is reaped, NULL if the job has no limits
+};
+
+struct job job_table[MAX_JOBS];
+int job_count = 0;
+
+void add_job(pid_t pid, const char *name, const char *cgroup);
+
+void remove_job(pid_t pid);
+
+void release_job_cgroup(struct job_cgroup *cgroup);
+
+void free_script(struct script_node *node);
+
+int parse_command(char *buf, struct command_t *command);
+
+int process_command(struct command_t *command, int parent_to_child_pipe[2]);
+
+char *shellgibi_builtin_commands[] = {"myjobs", "pause", "mybg", "myfg", "alarm", "psvis", "corona", "hwtim", "time", "shellstats", "shellmem", "pin", "limit", "jobs", "monitor", "export", "unset", "alias", "unalias", "out"};
+
+// phases of the shell itself that are timed by the tracing layer
+enum trace_phase
+{
+    TRACE_LOAD_COMMANDS,
+    TRACE_PROMPT,
+    TRACE_COMPLETION,
+    TRACE_PARSE,
+    TRACE_SPAWN,
+    TRACE_RELAY,
+    TRACE_PHASE_COUNT
+};
+
+const char *trace_phase_names[TRACE_PHASE_COUNT] = {"load_commands", "prompt", "completion", "parse", "spawn", "relay"};
+
+// log-linear (HDR style) histogram: 8 sub-buckets per power of two, in nanoseconds
+#define TRACE_SUB_BUCKET_BITS 3
+#define TRACE_SUB_BUCKETS (1 << TRACE_SUB_BUCKET_BITS)
+#define TRACE_BUCKETS (64 * TRACE_SUB_BUCKETS)
+
+struct latency_histogram
+{
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[TRACE_BUCKETS];
+};
+
+struct latency_histogram trace_histograms[TRACE_PHASE_COUNT];
+
+// Chrome trace-event output, enabled by SHELLGIBI_TRACE=<file>
+int trace_fd = -1;
+int trace_events_written = 0;
+
+uint64_t trace_now();
+
+void trace_record(enum trace_phase phase, uint64_t start_ns);
+
+void trace_init();
+
+void trace_close();
+
+void print_trace_histograms(FILE *out);
+
+// owners of the long-lived heap memory of the shell, reported by shellmem
+enum memory_subsystem
+{
+    MEMORY_COMMAND,    // parsed lines: tokens, stages, arguments, redirects, glob results
+    MEMORY_SCRIPT,     // compiled blocks, aliases and functions
+    MEMORY_COMPLETION, // command index and completion matches
+    MEMORY_HISTORY,
+    MEMORY_VARIABLES,  // shell variables and the exported environment
+    MEMORY_JOBS,       // job table and cgroups
+    MEMORY_SUBSYSTEM_COUNT
+};
+
+const char *memory_subsystem_names[MEMORY_SUBSYSTEM_COUNT] = {"command", "script", "completion", "history", "variables", "jobs"};
+
+struct memory_account
+{
+    long live_count;
+    long live_bytes;
+    long peak_bytes;
+    unsigned long allocations;
+};
+
+struct memory_account memory_accounts[MEMORY_SUBSYSTEM_COUNT];
+
+// glob workers count into private accounts that are merged once they are joined, so the
+// counters need no atomics. NULL on the threads of the shell itself
+__thread struct memory_account *memory_thread_accounts;
+
+/**
+ * Accounts a block handed out to or taken back from a subsystem. Sizes are
+ * the usable sizes reported by malloc, so the pointers stay plain malloc
+ * pointers and a block freed through free() only skews the counters
+ * @param subsystem owner of the block
+ * @param pointer   block, NULL is ignored
+ * @param sign      1 for an allocation, -1 for a release
+ */
+void memory_account_block(enum memory_subsystem subsystem, void *pointer, int sign)
+{
+    if (pointer == NULL)
+        return;
+    struct memory_account *account = (memory_thread_accounts ? memory_thread_accounts : memory_accounts) + subsystem;
+    account->live_bytes += (long)malloc_usable_size(pointer) * sign;
+    account->live_count += sign;
+    if (sign > 0)
+    {
+        account->allocations++;
+        if (account->live_bytes > account->peak_bytes)
+            account->peak_bytes = account->live_bytes;
+    }
+}
+
+// adds the accounts of a joined worker to the ones of the shell
+void memory_merge_accounts(const struct memory_account *accounts)
+{
+    for (int i = 0; i < MEMORY_SUBSYSTEM_COUNT; i++)
+    {
+        memory_accounts[i].live_count += accounts[i].live_count;
+        memory_accounts[i].live_bytes += accounts[i].live_bytes;
+        memory_accounts[i].allocations += accounts[i].allocations;
+        if (memory_accounts[i].live_bytes > memory_accounts[i].peak_bytes)
+            memory_accounts[i].peak_bytes = memory_accounts[i].live_bytes;
+    }
+}
+
+void *shell_malloc(enum memory_subsystem subsystem, size_t size)
+{
+    void *pointer = malloc(size);
+    memory_account_block(subsystem, pointer, 1);
+    return pointer;
+}
+
+void *shell_calloc(enum memory_subsystem subsystem, size_t count, size_t size)
+{
+    void *pointer = calloc(count, size);
+    memory_account_block(subsystem, pointer, 1);
+    return pointer;
+}
+
+void *shell_realloc(enum memory_subsystem subsystem, void *pointer, size_t size)
+{
+    memory_account_block(subsystem, pointer, -1);
+    pointer = realloc(pointer, size);
+    memory_account_block(subsystem, pointer, 1);
+    return pointer;
+}
+
+char *shell_strdup(enum memory_subsystem subsystem, const char *text)
+{
+    char *copy = strdup(text);
+    memory_account_block(subsystem, copy, 1);
+    return copy;
+}
+
+char *shell_strndup(enum memory_subsystem subsystem, const char *text, size_t length)
+{
+    char *copy = strndup(text, length);
+    memory_account_block(subsystem, copy, 1);
+    return copy;
+}
+
+void shell_free(enum memory_subsystem subsystem, void *pointer)
+{
+    memory_account_block(subsystem, pointer, -1);
+    free(pointer);
+}
+
+long read_resident_bytes();
+
+void print_memory_usage(FILE *out);
 
 struct autocomplete_match *shellgibi_autocomplete(const char *input_str);
 
 struct autocomplete_match *filename_autocomplete(const char *input_str);
 
-char *get_command_name(char *buf);
+struct autocomplete_match *directory_autocomplete(const char *input_str);
+
+int current_word_start(const char *buf, int index);
+
+double elapsed_seconds(const struct timespec *start, const struct timespec *end);
 
 void print_warning(char *message);
 
@@ -57,6 +427,18 @@ void print_error(char *message);
 
 void combine_path(char *, char *, char *);
 
+#define CORONA_DEFAULT_URL "https://www.worldometers.info/coronavirus/"
+#define CORONA_COUNTRY "Turkey"
+#define CORONA_MAX_REDIRECTS 5
+
+enum corona_result
+{
+    CORONA_FOUND,
+    CORONA_FAILED
+};
+
+enum corona_result corona_fetch(const char *url, char *value, size_t value_size);
+
 /**
  * Prints a command struct
  * @param struct command_t *
@@ -67,8 +449,21 @@ void print_command(struct command_t *command)
     printf("Command: <%s>\n", command->name);
     printf("\tIs Background: %s\n", command->background ? "yes" : "no");
     printf("\tRedirects:\n");
-    for (i = 0; i < 3; i++)
-        printf("\t\t%d: %s\n", i, command->redirects[i] ? command->redirects[i] : "N/A");
+    if (command->redirects == NULL)
+        printf("\t\tN/A\n");
+    for (struct redirect *redirect = command->redirects; redirect; redirect = redirect->next)
+    {
+        if (redirect->type == REDIRECT_FILE)
+            printf("\t\t%d: %s (flags %#o)\n", redirect->fd, redirect->path, redirect->flags);
+        else if (redirect->type == REDIRECT_DUP)
+            printf("\t\t%d: &%d\n", redirect->fd, redirect->source_fd);
+        else if (redirect->type == REDIRECT_CLOSE)
+            printf("\t\t%d: closed\n", redirect->fd);
+        else if (redirect->type == REDIRECT_AMBIGUOUS)
+            printf("\t\t%d: ambiguous (%s)\n", redirect->fd, redirect->path);
+        else
+            printf("\t\t%d: here-document (%zu bytes)\n", redirect->fd, redirect->body_length);
+    }
     printf("\tArguments (%d):\n", command->arg_count);
     for (i = 0; i < command->arg_count; ++i)
         printf("\t\tArg %d: %s\n", i, command->args[i]);
@@ -95,256 +490,3329 @@ int free_command(struct command_t *command)
     {
         for (int i = 0; i < command->arg_count; ++i)
         {
-            free(command->args[i]);
+            shell_free(MEMORY_COMMAND, command->args[i]);
             command->args[i] = NULL;
         }
-        free(command->args);
-        command->args = 0;
     }
-    for (int i = 0; i < 3; ++i)
-        if (command->redirects[i])
-        {
-            free(command->redirects[i]);
-            command->redirects[i] = NULL;
-        }
-    free(command->name);
+    shell_free(MEMORY_COMMAND, command->args); // allocated even for commands without arguments
+    command->args = 0;
+    while (command->redirects)
+    {
+        struct redirect *redirect = command->redirects;
+        command->redirects = redirect->next;
+        shell_free(MEMORY_COMMAND, redirect->path);
+        shell_free(MEMORY_COMMAND, redirect->body);
+        shell_free(MEMORY_COMMAND, redirect);
+    }
+    for (int i = 0; i < command->substitution_fd_count; i++)
+        close(command->substitution_fds[i]);
+    release_job_cgroup(command->cgroup);
+    free_script(command->script);
+    shell_free(MEMORY_COMMAND, command->substitution_fds);
+    shell_free(MEMORY_COMMAND, command->name);
     command->name = NULL;
-    free(command);
+    shell_free(MEMORY_COMMAND, command);
     return 0;
 }
 
+/**
+ * Replaces the name and arguments of a command with copies of the given words,
+ * builtins that run as another program use it so a command only owns heap strings
+ * @param command command to rewrite
+ * @param name    new command name
+ * @param words   new arguments, may point into the old ones
+ * @param count   number of arguments
+ */
+void set_command_words(struct command_t *command, const char *name, const char *const *words, int count)
+{
+    char **args = shell_malloc(MEMORY_COMMAND, sizeof(char *) * (count + 1));
+    for (int i = 0; i < count; i++)
+        args[i] = shell_strdup(MEMORY_COMMAND, words[i]);
+    char *copy = shell_strdup(MEMORY_COMMAND, name);
+    for (int i = 0; i < command->arg_count; i++)
+        shell_free(MEMORY_COMMAND, command->args[i]);
+    shell_free(MEMORY_COMMAND, command->args);
+    shell_free(MEMORY_COMMAND, command->name);
+    command->name = copy;
+    command->args = args;
+    command->arg_count = count;
+}
+
+// releases a match returned by one of the *_autocomplete functions, including the struct itself
 int free_autocomplete_match(struct autocomplete_match *match)
 {
     if (match->match_count)
     {
         for (int i = 0; i < match->match_count; ++i)
         {
-            free(match->matches[i]);
+            shell_free(MEMORY_COMPLETION, match->matches[i]);
             match->matches[i] = NULL;
         }
-        free(match->matches);
+        shell_free(MEMORY_COMPLETION, match->matches);
         match->match_count = 0;
     }
+    if (match->descriptions)
+    {
+        for (int i = 0; match->descriptions[i]; ++i)
+            shell_free(MEMORY_COMPLETION, match->descriptions[i]);
+        shell_free(MEMORY_COMPLETION, match->descriptions);
+        match->descriptions = NULL;
+    }
+    shell_free(MEMORY_COMPLETION, match);
     return 0;
 }
 
+// prompt segments: user and host never change, cwd changes only with cd,
+// the vcs branch is looked up by a worker thread and drawn once it is ready.
+// Any command may switch or create the branch, so it is looked up again after each one
+#define PROMPT_SEGMENT_SIZE 1024
+
+struct prompt_state
+{
+    bool initialized;
+    char user[256];
+    char host[256];
+    char cwd[PROMPT_SEGMENT_SIZE];
+    char drawn[4 * PROMPT_SEGMENT_SIZE]; // last prompt written to the terminal
+    // vcs segment, guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    unsigned long cwd_generation;
+    unsigned long vcs_generation;
+    unsigned long vcs_request_generation; // bumped on cd and after every foreground command
+    char vcs_request[PROMPT_SEGMENT_SIZE];
+    char vcs_branch[256];
+    bool vcs_busy;      // the worker is inside a lookup, which may hold malloc and stdio locks
+    int notify_pipe[2]; // worker -> prompt, a byte per finished lookup
+};
+
+struct prompt_state prompt_state = {.lock = PTHREAD_MUTEX_INITIALIZER, .wakeup = PTHREAD_COND_INITIALIZER};
+
 /**
- * Show the command prompt
- * @return [description]
+ * Finds the branch of the git repository containing path by reading .git/HEAD,
+ * walking up the directories. Runs on the prompt worker thread
+ * @param path   directory to start from
+ * @param branch filled with the branch name or the short detached hash
  */
-int show_prompt()
+void find_vcs_branch(const char *path, char *branch, size_t branch_size)
 {
-    char cwd[1024], hostname[1024];
-    gethostname(hostname, sizeof(hostname));
-    getcwd(cwd, sizeof(cwd));
-    //    printf("Mypid is %d\n", getpid());
-    printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
-    return 0;
+    char dir[PROMPT_SEGMENT_SIZE], head_path[2 * PROMPT_SEGMENT_SIZE], head[512];
+    branch[0] = '\0';
+    snprintf(dir, sizeof(dir), "%s", path);
+    while (1)
+    {
+        snprintf(head_path, sizeof(head_path), "%s/.git", dir);
+        FILE *git_file = fopen(head_path, "r");
+        if (git_file != NULL)
+        {
+            // worktrees and submodules have a .git file pointing to the real directory
+            if (fgets(head, sizeof(head), git_file) && strncmp(head, "gitdir: ", 8) == 0)
+            {
+                head[strcspn(head, "\n")] = '\0';
+                if (head[8] == '/')
+                    snprintf(head_path, sizeof(head_path), "%s", head + 8);
+                else
+                    snprintf(head_path, sizeof(head_path), "%s/%s", dir, head + 8);
+            }
+            fclose(git_file);
+            strncat(head_path, "/HEAD", sizeof(head_path) - strlen(head_path) - 1);
+            FILE *head_file = fopen(head_path, "r");
+            if (head_file == NULL)
+                return;
+            if (fgets(head, sizeof(head), head_file))
+            {
+                head[strcspn(head, "\n")] = '\0';
+                if (strncmp(head, "ref: refs/heads/", 16) == 0)
+                    snprintf(branch, branch_size, "%s", head + 16);
+                else
+                    snprintf(branch, branch_size, "%.7s", head);
+            }
+            fclose(head_file);
+            return;
+        }
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL || slash == dir)
+            return;
+        *slash = '\0';
+    }
 }
 
-char *get_command_name(char *buf)
+void *prompt_vcs_worker(void *arg)
 {
-    const char *splitters = " \t"; // split at whitespace
-    int len = strlen(buf);
-    while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
+    char path[PROMPT_SEGMENT_SIZE], branch[256];
+    unsigned long request = 0, generation;
+    while (1)
     {
-        buf++;
-        len--;
+        pthread_mutex_lock(&prompt_state.lock);
+        while (prompt_state.vcs_request_generation == request)
+            pthread_cond_wait(&prompt_state.wakeup, &prompt_state.lock);
+        request = prompt_state.vcs_request_generation;
+        generation = prompt_state.cwd_generation;
+        strcpy(path, prompt_state.vcs_request);
+        prompt_state.vcs_busy = true;
+        pthread_mutex_unlock(&prompt_state.lock);
+
+        find_vcs_branch(path, branch, sizeof(branch));
+
+        pthread_mutex_lock(&prompt_state.lock);
+        prompt_state.vcs_busy = false;
+        bool changed = false;
+        if (generation == prompt_state.cwd_generation) // cwd did not change meanwhile
+        {
+            changed = generation != prompt_state.vcs_generation || strcmp(prompt_state.vcs_branch, branch) != 0;
+            strcpy(prompt_state.vcs_branch, branch);
+            prompt_state.vcs_generation = generation;
+        }
+        pthread_mutex_unlock(&prompt_state.lock);
+        if (changed)
+            write(prompt_state.notify_pipe[1], "", 1);
     }
-    while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-        buf[--len] = 0; // trim right whitespace
-
-    char *pch = strtok(buf, splitters);
-
-    if (pch == NULL)
-        return NULL;
-    else
-        return strdup(pch);
+    return NULL;
 }
 
-int should_complete_filename(char *buf, char *filename_start)
+// called once at startup and after every cd
+void prompt_refresh_cwd()
 {
-    const char *splitters = " \t"; // split at whitespace
-    int len;
-    len = strlen(buf);
-    while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
-    {
-        buf++;
-        len--;
-    }
-    int have_spaces_at_the_end = 0;
-    while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-    {
-        buf[--len] = 0; // trim right whitespace
-        have_spaces_at_the_end = 1;
-    }
+    pthread_mutex_lock(&prompt_state.lock);
+    if (getcwd(prompt_state.cwd, sizeof(prompt_state.cwd)) == NULL)
+        strcpy(prompt_state.cwd, "?");
+    strcpy(prompt_state.vcs_request, prompt_state.cwd);
+    prompt_state.cwd_generation++;
+    prompt_state.vcs_request_generation++;
+    pthread_cond_signal(&prompt_state.wakeup);
+    pthread_mutex_unlock(&prompt_state.lock);
+}
 
-    char *pch = strtok(buf, splitters);
+// called after every foreground command, the branch stays drawn until the new lookup replaces it
+void prompt_refresh_vcs()
+{
+    if (!prompt_state.initialized)
+        return;
+    pthread_mutex_lock(&prompt_state.lock);
+    prompt_state.vcs_request_generation++;
+    pthread_cond_signal(&prompt_state.wakeup);
+    pthread_mutex_unlock(&prompt_state.lock);
+}
 
-    // empty string
-    if (pch == NULL)
-        return 0;
+void handle_sigwinch(int signal)
+{
+    terminal_size_stale = 1;
+}
 
-    // at least the command and a space is entered
-    if (have_spaces_at_the_end)
+const struct winsize *current_terminal_size()
+{
+    if (terminal_size_stale)
     {
-        filename_start[0] = '\0';
-        return 1;
+        terminal_size_stale = 0;
+        struct winsize window;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0 && window.ws_col > 0 && window.ws_row > 0)
+            terminal_size = window;
     }
+    return &terminal_size;
+}
 
-    pch = strtok(NULL, splitters);
-    // we only have the command part without empty string
-    // it could be unfinished
-    if (pch == NULL)
-        return 0;
-
-    char *last_token = pch;
-
-    while ((pch = strtok(NULL, splitters)) != NULL)
+void prompt_init()
+{
+    struct sigaction resize = {.sa_handler = handle_sigwinch, .sa_flags = SA_RESTART};
+    sigaction(SIGWINCH, &resize, NULL);
+    char *user = getenv("USER");
+    snprintf(prompt_state.user, sizeof(prompt_state.user), "%s", user ? user : "?");
+    gethostname(prompt_state.host, sizeof(prompt_state.host));
+    prompt_state.notify_pipe[0] = prompt_state.notify_pipe[1] = -1;
+    pthread_t worker;
+    if (pipe2(prompt_state.notify_pipe, O_CLOEXEC | O_NONBLOCK) == 0)
     {
-        last_token = pch;
+        pthread_create(&worker, NULL, prompt_vcs_worker, NULL);
+        pthread_detach(worker);
     }
+    prompt_state.initialized = true;
+    prompt_refresh_cwd();
+}
 
-    strcpy(filename_start, last_token);
-    return 1;
+/**
+ * Renders the prompt from the cached segments
+ * @return length of the rendered prompt
+ */
+int render_prompt(char *out, size_t out_size)
+{
+    if (!prompt_state.initialized)
+        prompt_init();
+    int len = snprintf(out, out_size, "%s@%s:%s ", prompt_state.user, prompt_state.host, prompt_state.cwd);
+
+    pthread_mutex_lock(&prompt_state.lock);
+    if (prompt_state.vcs_generation == prompt_state.cwd_generation && prompt_state.vcs_branch[0])
+        len += snprintf(out + len, out_size - len, "(%s) ", prompt_state.vcs_branch);
+    pthread_mutex_unlock(&prompt_state.lock);
+
+    if (job_count > 0)
+        len += snprintf(out + len, out_size - len, "[%d] ", job_count);
+    if (last_command_seconds >= 1)
+        len += snprintf(out + len, out_size - len, "%.1fs ", last_command_seconds);
+    len += snprintf(out + len, out_size - len, "%s$ ", sysname);
+    return len < out_size ? len : out_size - 1;
 }
 
 /**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
+ * Show the command prompt
+ * @return [description]
  */
-int parse_command(char *buf, struct command_t *command)
+int show_prompt()
 {
-    const char *splitters = " \t"; // split at whitespace
-    int index, len;
-    len = strlen(buf);
-    while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
-    {
-        buf++;
-        len--;
-    }
-    while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-        buf[--len] = 0; // trim right whitespace
+    render_prompt(prompt_state.drawn, sizeof(prompt_state.drawn));
+    fflush(stdout); // anything printed with stdio must come before the prompt
+    write(STDOUT_FILENO, prompt_state.drawn, strlen(prompt_state.drawn));
+    return 0;
+}
 
-    if (len > 0 && buf[len - 1] == '&') // background
-        command->background = true;
+/**
+ * Redraws the prompt line in place if an async segment changed it
+ * @param buf   current input
+ * @param index length of the input
+ */
+void refresh_prompt_line(const char *buf, int index)
+{
+    char rendered[sizeof(prompt_state.drawn)];
+    render_prompt(rendered, sizeof(rendered));
+    if (strcmp(rendered, prompt_state.drawn) == 0)
+        return;
+    strcpy(prompt_state.drawn, rendered);
+    char line[sizeof(rendered) + 4096 + 8];
+    int len = snprintf(line, sizeof(line), "\r\x1b[K%s%.*s", rendered, index, buf);
+    fflush(stdout);
+    write(STDOUT_FILENO, line, len < sizeof(line) ? len : sizeof(line) - 1);
+}
 
-    char *pch = strtok(buf, splitters);
-    command->name = (char *)malloc(strlen(pch) + 1);
-    if (pch == NULL)
-        command->name[0] = 0;
-    else
-        strcpy(command->name, pch);
+#define KEY_PROMPT_REFRESH -2
 
-    command->args = (char **)malloc(sizeof(char *));
+/**
+ * Reads one key from stdin, waking up early when an async prompt segment is ready
+ * @return the key, EOF, or KEY_PROMPT_REFRESH
+ */
+int read_key()
+{
+    static unsigned char keys[256];
+    static int key_index = 0, key_count = 0;
+    if (key_index < key_count)
+        return keys[key_index++];
 
-    int redirect_index;
-    int arg_index = 0;
-    char temp_buf[1024], *arg;
+    fflush(stdout); // echoed characters are written with stdio
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {prompt_state.notify_pipe[0], POLLIN, 0}};
     while (1)
     {
-        // tokenize input on splitters
-        pch = strtok(NULL, splitters);
-        if (!pch)
-            break;
-        arg = temp_buf;
-        strcpy(arg, pch);
-        len = strlen(arg);
-
-        if (len == 0)
-            continue;                                        // empty arg, go for next
-        while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
-        {
-            arg++;
-            len--;
-        }
-        while (len > 0 && strchr(splitters, arg[len - 1]) != NULL)
-            arg[--len] = 0; // trim right whitespace
-        if (len == 0)
-            continue; // empty arg, go for next
-
-        // piping to another command
-        if (strcmp(arg, "|") == 0)
+        int nfds = prompt_state.notify_pipe[0] != -1 ? 2 : 1;
+        if (poll(fds, nfds, -1) == -1)
         {
-            struct command_t *c = malloc(sizeof(struct command_t));
-            memset(c, 0, sizeof(struct command_t));
-            int l = strlen(pch);
-            pch[l] = splitters[0]; // restore strtok termination
-            index = 1;
-            while (pch[index] == ' ' || pch[index] == '\t')
-                index++; // skip whitespaces
-
-            parse_command(pch + index, c);
-            pch[l] = 0; // put back strtok termination
-            command->next = c;
-            continue;
+            if (errno == EINTR)
+                continue;
+            return EOF;
         }
-
-        // background process
-        if (strcmp(arg, "&") == 0)
-            continue; // handled before
-
-        // handle input redirection
-        redirect_index = -1;
-        if (arg[0] == '<')
-            redirect_index = 0;
-        if (arg[0] == '>')
+        if (nfds == 2 && (fds[1].revents & POLLIN))
         {
-            if (len > 1 && arg[1] == '>')
-            {
-                redirect_index = 2;
-                arg++;
-                len--;
-            }
-            else
-                redirect_index = 1;
+            char drain[64];
+            while (read(prompt_state.notify_pipe[0], drain, sizeof(drain)) > 0)
+                ;
+            return KEY_PROMPT_REFRESH;
         }
-        if (redirect_index != -1)
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
         {
-            command->redirects[redirect_index] = malloc(len);
-            strcpy(command->redirects[redirect_index], arg + 1);
-            continue;
+            ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+            if (n <= 0)
+                return EOF;
+            key_count = n;
+            key_index = 1;
+            return keys[0];
         }
+    }
+}
 
-        // normal arguments
-        if (len > 2 && ((arg[0] == '"' && arg[len - 1] == '"') || (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
+// shell variables, exported ones make up the environment of every command
+struct variable
+{
+    char *name; // NULL for an empty slot
+    char *value;
+    bool exported;
+};
+
+struct variable *variable_table;
+int variable_capacity = 0;
+int variable_count = 0;
+
+extern char **environ;
+// environment built from the exported variables, rebuilt only after one of them changed
+char **exported_environment;
+bool environment_dirty = false;
+
+uint64_t hash_string(const char *str);
+
+/**
+ * Finds a variable in the open addressing table
+ * @param  name   variable name
+ * @param  create add an empty, unexported variable if it is missing
+ * @return        the variable, NULL if it is missing and create is false
+ */
+struct variable *variable_lookup(const char *name, bool create)
+{
+    if (variable_capacity == 0)
+    {
+        if (!create)
+            return NULL;
+        variable_capacity = 256;
+        variable_table = shell_calloc(MEMORY_VARIABLES, variable_capacity, sizeof(struct variable));
+    }
+    if (create && (variable_count + 1) * 2 > variable_capacity) // keep the load factor under 1/2
+    {
+        struct variable *old_table = variable_table;
+        int old_capacity = variable_capacity;
+        variable_capacity *= 2;
+        variable_table = shell_calloc(MEMORY_VARIABLES, variable_capacity, sizeof(struct variable));
+        for (int i = 0; i < old_capacity; i++)
         {
-            arg[--len] = 0;
-            arg++;
+            if (old_table[i].name == NULL)
+                continue;
+            uint64_t slot = hash_string(old_table[i].name) & (variable_capacity - 1);
+            while (variable_table[slot].name != NULL)
+                slot = (slot + 1) & (variable_capacity - 1);
+            variable_table[slot] = old_table[i];
         }
-        command->args = (char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
-        command->args[arg_index] = (char *)malloc(len + 1);
-        strcpy(command->args[arg_index++], arg);
+        shell_free(MEMORY_VARIABLES, old_table);
     }
-    command->arg_count = arg_index;
-    return 0;
+    uint64_t slot = hash_string(name) & (variable_capacity - 1);
+    while (variable_table[slot].name != NULL)
+    {
+        if (strcmp(variable_table[slot].name, name) == 0)
+            return &variable_table[slot];
+        slot = (slot + 1) & (variable_capacity - 1);
+    }
+    if (!create)
+        return NULL;
+    variable_table[slot].name = shell_strdup(MEMORY_VARIABLES, name);
+    variable_table[slot].value = shell_strdup(MEMORY_VARIABLES, "");
+    variable_count++;
+    return &variable_table[slot];
 }
 
-void prompt_backspace()
+const char *get_variable(const char *name)
 {
-    putchar(8);   // go back 1
-    putchar(' '); // write empty over
-    putchar(8);   // go back 1 again
+    struct variable *variable = variable_lookup(name, false);
+    return variable ? variable->value : NULL;
 }
 
 /**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
+ * Sets a variable, the environment is marked for a rebuild if it is exported
+ * @param value    new value, NULL keeps the current one
+ * @param exported true exports the variable, false leaves its export flag as it is
  */
-int prompt(struct command_t *command)
+void set_variable(const char *name, const char *value, bool exported)
 {
-    int index = 0;
-    char c;
-    char buf[4096];
-    static char oldbuf[4096];
-    char filename_buf[4096];
-
-    // tcgetattr gets the parameters of the current terminal
-    // STDIN_FILENO will tell tcgetattr that it should write the settings
+    struct variable *variable = variable_lookup(name, true);
+    if (value != NULL && strcmp(variable->value, value) != 0)
+    {
+        shell_free(MEMORY_VARIABLES, variable->value);
+        variable->value = shell_strdup(MEMORY_VARIABLES, value);
+        environment_dirty |= variable->exported;
+    }
+    if (exported && !variable->exported)
+    {
+        variable->exported = true;
+        environment_dirty = true;
+    }
+}
+
+// removes a variable, later entries of its probe chain are moved up so lookups still find them
+void unset_variable(const char *name)
+{
+    struct variable *variable = variable_lookup(name, false);
+    if (variable == NULL)
+        return;
+    environment_dirty |= variable->exported;
+    shell_free(MEMORY_VARIABLES, variable->name);
+    shell_free(MEMORY_VARIABLES, variable->value);
+    variable->name = NULL;
+    variable_count--;
+    uint64_t hole = variable - variable_table, slot = hole;
+    while (1)
+    {
+        slot = (slot + 1) & (variable_capacity - 1);
+        if (variable_table[slot].name == NULL)
+            break;
+        uint64_t home = hash_string(variable_table[slot].name) & (variable_capacity - 1);
+        // the entry may fill the hole if its home slot is not between the hole and itself
+        if (((slot - home) & (variable_capacity - 1)) >= ((slot - hole) & (variable_capacity - 1)))
+        {
+            variable_table[hole] = variable_table[slot];
+            variable_table[slot].name = NULL;
+            hole = slot;
+        }
+    }
+}
+
+// imports the environment the shell was started with, every entry is exported
+void variables_init()
+{
+    for (char **entry = environ; *entry; entry++)
+    {
+        char *equals = strchr(*entry, '=');
+        if (equals == NULL)
+            continue;
+        char *name = shell_strndup(MEMORY_VARIABLES, *entry, equals - *entry);
+        set_variable(name, equals + 1, true);
+        shell_free(MEMORY_VARIABLES, name);
+    }
+    environment_dirty = false; // environ already matches
+}
+
+/**
+ * Rebuilds environ from the exported variables if one of them changed since
+ * the last call, so exec, execvp and getenv all see the shell's exports.
+ * Called before commands are started, a line that changes nothing costs a test
+ */
+void refresh_environment()
+{
+    if (!environment_dirty)
+        return;
+    char **old_environment = exported_environment;
+    int count = 0;
+    for (int i = 0; i < variable_capacity; i++)
+        count += variable_table[i].name != NULL && variable_table[i].exported;
+    exported_environment = shell_malloc(MEMORY_VARIABLES, sizeof(char *) * (count + 1));
+    count = 0;
+    for (int i = 0; i < variable_capacity; i++)
+    {
+        struct variable *variable = &variable_table[i];
+        if (variable->name == NULL || !variable->exported)
+            continue;
+        char *entry = shell_malloc(MEMORY_VARIABLES, strlen(variable->name) + strlen(variable->value) + 2);
+        sprintf(entry, "%s=%s", variable->name, variable->value);
+        exported_environment[count++] = entry;
+    }
+    exported_environment[count] = NULL;
+    environ = exported_environment;
+    if (old_environment != NULL)
+    {
+        for (char **entry = old_environment; *entry; entry++)
+            shell_free(MEMORY_VARIABLES, *entry);
+        shell_free(MEMORY_VARIABLES, old_environment);
+    }
+    environment_dirty = false;
+}
+
+static inline bool is_name_character(char c, bool first)
+{
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (!first && c >= '0' && c <= '9');
+}
+
+bool is_name(const char *word)
+{
+    if (!is_name_character(word[0], true))
+        return false;
+    while (is_name_character(*word, false))
+        word++;
+    return *word == '\0';
+}
+
+// NAME=value with a valid name, the value may be empty
+bool is_assignment(const char *word)
+{
+    if (!is_name_character(word[0], true))
+        return false;
+    while (is_name_character(*word, false))
+        word++;
+    return *word == '=';
+}
+
+/**
+ * Reads the variable reference after a '$': $NAME, ${NAME}, $? or $$
+ * @param  p         points after the '$'
+ * @param  value_out set to the value, "" for unset variables, stored in scratch for $? and $$
+ * @return           the first character after the reference, p itself if there is none
+ */
+const char *read_variable_reference(const char *p, const char **value_out, char *scratch, size_t scratch_size)
+{
+    if (*p == '?' || *p == '$')
+    {
+        snprintf(scratch, scratch_size, "%d", *p == '?' ? last_exit_status : (int)getpid());
+        *value_out = scratch;
+        return p + 1;
+    }
+    // $1 to $9 and $#, the arguments of the running function
+    if ((*p >= '1' && *p <= '9') || *p == '#')
+    {
+        char name[2] = {*p, '\0'};
+        const char *value = get_variable(name);
+        *value_out = value ? value : *p == '#' ? "0" : "";
+        return p + 1;
+    }
+    bool braced = *p == '{';
+    const char *start = p + braced, *end = start;
+    if (!is_name_character(*end, true))
+        return p;
+    while (is_name_character(*end, false))
+        end++;
+    if (braced && *end != '}')
+        return p;
+    char name[256];
+    if (end - start >= (long)sizeof(name))
+        return p;
+    memcpy(name, start, end - start);
+    name[end - start] = '\0';
+    const char *value = get_variable(name);
+    *value_out = value ? value : "";
+    return end + braced;
+}
+
+enum substitution_type
+{
+    SUBSTITUTION_NONE,
+    SUBSTITUTION_COMMAND, // $(cmd), replaced by the output of cmd
+    SUBSTITUTION_INPUT,   // <(cmd), replaced by /dev/fd/N reading the output of cmd
+    SUBSTITUTION_OUTPUT   // >(cmd), replaced by /dev/fd/N writing to the input of cmd
+};
+
+// a word of the command line with its quoting resolved
+struct token
+{
+    char *text;    // quotes and escapes removed
+    char *pattern; // glob pattern with quoted metacharacters escaped, NULL if there is nothing to expand
+    bool quoted;   // some part of the word was quoted, so it is never an operator
+    int plain_length; // leading characters of text that were neither quoted nor escaped
+    enum substitution_type substitution; // text is the command line inside the parentheses
+    char *source;  // the word as written if it refers to variables and was not expanded, see tokenize
+    char *prefix;  // NAME= of NAME=$(cmd), put before the output of cmd
+};
+
+void free_tokens(struct token *tokens, int token_count)
+{
+    for (int i = 0; i < token_count; i++)
+    {
+        shell_free(MEMORY_COMMAND, tokens[i].text);
+        shell_free(MEMORY_COMMAND, tokens[i].pattern);
+        shell_free(MEMORY_COMMAND, tokens[i].source);
+        shell_free(MEMORY_COMMAND, tokens[i].prefix);
+    }
+    shell_free(MEMORY_COMMAND, tokens);
+}
+
+// matching ')' of a substitution, p points after its '(', NULL if the line ends first
+const char *find_substitution_end(const char *p)
+{
+    int depth = 1;
+    char quote = 0;
+    for (; *p; p++)
+    {
+        if (quote)
+        {
+            if (*p == quote)
+                quote = 0;
+            else if (*p == '\\' && quote == '"' && p[1] != '\0')
+                p++;
+        }
+        else if (*p == '\\' && p[1] != '\0')
+            p++;
+        else if (*p == '\'' || *p == '"')
+            quote = *p;
+        else if (*p == '(')
+            depth++;
+        else if (*p == ')' && --depth == 0)
+            return p;
+    }
+    return NULL;
+}
+
+static inline bool is_splitter(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+static inline bool is_glob_character(char c)
+{
+    return c == '*' || c == '?' || c == '[';
+}
+
+/**
+ * Splits a line into words at unquoted whitespace. Single quotes keep
+ * everything literal, double quotes and backslashes escape the next character.
+ * $NAME and ${NAME} outside single quotes are replaced by the variable's value,
+ * which is taken literally: it is neither split nor globbed
+ * @param  expand     false keeps references as they are and the word in source,
+ *                    compiled scripts expand such words again on every run
+ * @param  line       command line
+ * @param  tokens_out set to a malloc'ed array of tokens
+ * @return            number of tokens
+ */
+int tokenize(const char *line, struct token **tokens_out, bool expand)
+{
+    size_t line_len = strlen(line);
+    struct token *tokens = NULL;
+    int token_count = 0, token_capacity = 0;
+    // without variables a word is never longer than the line, the pattern at most twice as long
+    size_t text_capacity = line_len + 1;
+    char *text = shell_malloc(MEMORY_COMMAND, text_capacity), *pattern = shell_malloc(MEMORY_COMMAND, 2 * text_capacity);
+    char scratch[32];
+
+    const char *p = line;
+    while (1)
+    {
+        while (is_splitter(*p)) // skip whitespace
+            p++;
+        if (*p == '\0')
+            break;
+
+        if (token_count == token_capacity)
+        {
+            token_capacity = token_capacity ? token_capacity * 2 : 8;
+            tokens = shell_realloc(MEMORY_COMMAND, tokens, token_capacity * sizeof(struct token));
+        }
+
+        // $(cmd), "$(cmd)", <(cmd) and >(cmd) are whole words, their command line is kept as it is,
+        // so is NAME=$(cmd) whose output is the value
+        const char *word = p;
+        const char *assignment_end = p;
+        while (is_name_character(*assignment_end, assignment_end == p))
+            assignment_end++;
+        if (assignment_end > p && *assignment_end == '=' && (assignment_end[1] == '$' || assignment_end[1] == '"'))
+            p = assignment_end + 1;
+        const char *start = p + (p[0] == '"');
+        if (start[1] == '(' && (start[0] == '$' || (start == p && p == word && (start[0] == '<' || start[0] == '>'))))
+        {
+            const char *end = find_substitution_end(start + 2);
+            if (end != NULL && (start == p || end[1] == '"'))
+            {
+                struct token *token = &tokens[token_count++];
+                token->text = shell_strndup(MEMORY_COMMAND, start + 2, end - start - 2);
+                token->pattern = NULL;
+                token->prefix = p != word ? shell_strndup(MEMORY_COMMAND, word, p - word) : NULL;
+                token->quoted = start != p || p != word; // a quoted $(cmd) is one word, otherwise it is split
+                token->plain_length = 0;
+                token->substitution = start[0] == '$' ? SUBSTITUTION_COMMAND : start[0] == '<' ? SUBSTITUTION_INPUT : SUBSTITUTION_OUTPUT;
+                token->source = NULL;
+                p = end + 1 + (start != p);
+                continue;
+            }
+        }
+        p = word;
+
+        const char *word_start = p;
+        int text_len = 0, pattern_len = 0;
+        bool quoted = false, has_glob = false, expanded = false, deferred = false;
+        char quote = 0;
+        int plain_length = -1;
+        for (; *p && (quote || !is_splitter(*p)); p++)
+        {
+            char c = *p;
+            bool literal = quote != 0;
+            if (c == '$' && quote != '\'')
+            {
+                const char *value;
+                const char *after = read_variable_reference(p + 1, &value, scratch, sizeof(scratch));
+                deferred |= !expand && after != p + 1;
+                if (expand && after != p + 1)
+                {
+                    size_t value_len = strlen(value);
+                    size_t needed = text_len + value_len + strlen(after) + 1;
+                    if (needed > text_capacity)
+                    {
+                        text_capacity = needed * 2;
+                        text = shell_realloc(MEMORY_COMMAND, text, text_capacity);
+                        pattern = shell_realloc(MEMORY_COMMAND, pattern, 2 * text_capacity);
+                    }
+                    // the value is never an operator or a glob pattern
+                    if (plain_length == -1)
+                        plain_length = text_len;
+                    for (size_t i = 0; i < value_len; i++)
+                    {
+                        text[text_len++] = value[i];
+                        if (is_glob_character(value[i]) || value[i] == ']' || value[i] == '\\')
+                            pattern[pattern_len++] = '\\';
+                        pattern[pattern_len++] = value[i];
+                    }
+                    expanded = true;
+                    p = after - 1;
+                    continue;
+                }
+            }
+            if (quote == '\'' && c == '\'')
+            {
+                quote = 0;
+                continue;
+            }
+            if (quote == '"' && c == '"')
+            {
+                quote = 0;
+                continue;
+            }
+            if (quote == 0 && (c == '\'' || c == '"'))
+            {
+                quote = c;
+                quoted = true;
+                if (plain_length == -1)
+                    plain_length = text_len;
+                continue;
+            }
+            if (c == '\\' && quote != '\'' && p[1] != '\0')
+            {
+                // inside double quotes only the quote, backslash and $ are escaped
+                if (quote == 0 || p[1] == '"' || p[1] == '\\' || p[1] == '$')
+                {
+                    c = *++p;
+                    literal = true;
+                    quoted = true;
+                    if (plain_length == -1)
+                        plain_length = text_len;
+                }
+            }
+            text[text_len++] = c;
+            if (is_glob_character(c) && !literal)
+                has_glob = true;
+            if (literal && (is_glob_character(c) || c == ']' || c == '\\'))
+                pattern[pattern_len++] = '\\';
+            pattern[pattern_len++] = c;
+        }
+        text[text_len] = '\0';
+        pattern[pattern_len] = '\0';
+        // an unquoted reference to an empty variable leaves no word behind
+        if (expanded && !quoted && text_len == 0)
+            continue;
+
+        tokens[token_count].text = shell_strdup(MEMORY_COMMAND, text);
+        tokens[token_count].pattern = has_glob ? shell_strdup(MEMORY_COMMAND, pattern) : NULL;
+        tokens[token_count].quoted = quoted || expanded;
+        tokens[token_count].plain_length = plain_length == -1 ? text_len : plain_length;
+        tokens[token_count].substitution = SUBSTITUTION_NONE;
+        tokens[token_count].source = deferred ? shell_strndup(MEMORY_COMMAND, word_start, p - word_start) : NULL;
+        tokens[token_count].prefix = NULL;
+        token_count++;
+    }
+    shell_free(MEMORY_COMMAND, text);
+    shell_free(MEMORY_COMMAND, pattern);
+    *tokens_out = tokens;
+    return token_count;
+}
+
+// one directory to read for a glob pattern component
+struct glob_work
+{
+    char *dir;
+    int component;
+};
+
+struct glob_state
+{
+    char **components; // pattern split at '/'
+    char **literals;   // unescaped component if it has no metacharacters, NULL otherwise
+    int component_count;
+    char **results;
+    int result_count, result_capacity;
+    // directories still to be read, shared by the worker pool
+    struct glob_work *queue;
+    int queue_count, queue_capacity;
+    int active; // directories being read right now
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+};
+
+// getdents64 record, see getdents(2)
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+#define GLOB_MAX_THREADS 16
+
+/**
+ * Matches a single path component against a glob pattern with *, ?, [...]
+ * (ranges and ! or ^ negation) and backslash escapes
+ * @return 1 on match
+ */
+int glob_match(const char *pattern, const char *name)
+{
+    const char *star_pattern = NULL, *star_name = NULL;
+    while (*name)
+    {
+        if (*pattern == '*')
+        {
+            while (*pattern == '*')
+                pattern++;
+            if (*pattern == '\0')
+                return 1;
+            star_pattern = pattern;
+            star_name = name;
+            continue;
+        }
+        if (*pattern == '?')
+        {
+            pattern++;
+            name++;
+            continue;
+        }
+        if (*pattern == '[')
+        {
+            const char *q = pattern + 1;
+            bool negate = *q == '!' || *q == '^';
+            if (negate)
+                q++;
+            bool matched = false, first = true;
+            while (*q && (*q != ']' || first))
+            {
+                first = false;
+                char low = *q;
+                if (low == '\\' && q[1])
+                    low = *++q;
+                if (q[1] == '-' && q[2] && q[2] != ']')
+                {
+                    char high = q[2];
+                    if (high == '\\' && q[3])
+                        high = *(q++ + 3);
+                    matched |= (unsigned char)*name >= (unsigned char)low && (unsigned char)*name <= (unsigned char)high;
+                    q += 3;
+                }
+                else
+                {
+                    matched |= *name == low;
+                    q++;
+                }
+            }
+            if (*q == ']') // a well formed class
+            {
+                if (matched != negate)
+                {
+                    pattern = q + 1;
+                    name++;
+                    continue;
+                }
+                goto backtrack;
+            }
+            // unterminated class, the [ is literal
+        }
+        {
+            const char *literal = pattern;
+            if (*literal == '\\' && literal[1])
+                literal++;
+            if (*literal != '\0' && *literal == *name)
+            {
+                pattern = literal + 1;
+                name++;
+                continue;
+            }
+        }
+    backtrack:
+        if (star_pattern == NULL)
+            return 0;
+        pattern = star_pattern;
+        name = ++star_name;
+    }
+    while (*pattern == '*')
+        pattern++;
+    return *pattern == '\0';
+}
+
+char *glob_join(const char *dir, const char *name)
+{
+    size_t dir_len = strlen(dir);
+    char *path = shell_malloc(MEMORY_COMMAND, dir_len + strlen(name) + 2);
+    if (dir_len == 0)
+        strcpy(path, name);
+    else if (dir[dir_len - 1] == '/')
+        sprintf(path, "%s%s", dir, name);
+    else
+        sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+void glob_push(struct glob_state *state, char *dir, int component)
+{
+    pthread_mutex_lock(&state->lock);
+    if (state->queue_count == state->queue_capacity)
+    {
+        state->queue_capacity = state->queue_capacity ? state->queue_capacity * 2 : 64;
+        state->queue = shell_realloc(MEMORY_COMMAND, state->queue, state->queue_capacity * sizeof(struct glob_work));
+    }
+    state->queue[state->queue_count].dir = dir;
+    state->queue[state->queue_count].component = component;
+    state->queue_count++;
+    pthread_cond_signal(&state->wakeup);
+    pthread_mutex_unlock(&state->lock);
+}
+
+void glob_add_results(struct glob_state *state, char **paths, int count)
+{
+    if (count == 0)
+        return;
+    pthread_mutex_lock(&state->lock);
+    if (state->result_count + count > state->result_capacity)
+    {
+        while (state->result_count + count > state->result_capacity)
+            state->result_capacity = state->result_capacity ? state->result_capacity * 2 : 64;
+        state->results = shell_realloc(MEMORY_COMMAND, state->results, state->result_capacity * sizeof(char *));
+    }
+    memcpy(state->results + state->result_count, paths, count * sizeof(char *));
+    state->result_count += count;
+    pthread_mutex_unlock(&state->lock);
+}
+
+// type of a directory entry when getdents64 does not report it
+unsigned char glob_entry_type(int dir_fd, const char *name, int flags)
+{
+    struct stat entry_stat;
+    if (fstatat(dir_fd, name, &entry_stat, flags) != 0)
+        return DT_UNKNOWN;
+    return S_ISDIR(entry_stat.st_mode) ? DT_DIR : DT_REG;
+}
+
+/**
+ * Matches one pattern component against the entries of a directory.
+ * Literal components are joined without reading the directory, ** descends
+ * into every subdirectory without following symlinks
+ */
+void glob_process(struct glob_state *state, struct glob_work work)
+{
+    int component = work.component;
+    bool last = component == state->component_count - 1;
+
+    if (state->literals[component] != NULL)
+    {
+        char *path = glob_join(work.dir, state->literals[component]);
+        if (!last)
+            glob_push(state, path, component + 1);
+        else if (faccessat(AT_FDCWD, path, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+            glob_add_results(state, &path, 1);
+        else
+            shell_free(MEMORY_COMMAND, path);
+        shell_free(MEMORY_COMMAND, work.dir);
+        return;
+    }
+
+    const char *pattern = state->components[component];
+    bool recursive = strcmp(pattern, "**") == 0;
+    if (recursive && !last)
+        glob_push(state, shell_strdup(MEMORY_COMMAND, work.dir), component + 1); // ** also matches no directory at all
+
+    int dir_fd = openat(AT_FDCWD, work.dir[0] ? work.dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+    {
+        shell_free(MEMORY_COMMAND, work.dir);
+        return;
+    }
+    char **matches = NULL;
+    int match_count = 0, match_capacity = 0;
+    long buffer[65536 / sizeof(long)];
+    long n;
+    while ((n = syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (long offset = 0; offset < n;)
+        {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)((char *)buffer + offset);
+            offset += entry->d_reclen;
+            const char *name = entry->d_name;
+            // hidden files only match a pattern that starts with a dot
+            if (name[0] == '.' && (recursive || pattern[0] != '.' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0))
+                continue;
+            if (!recursive && !glob_match(pattern, name))
+                continue;
+
+            unsigned char type = entry->d_type;
+            if (recursive && type == DT_UNKNOWN)
+                type = glob_entry_type(dir_fd, name, AT_SYMLINK_NOFOLLOW);
+            else if (!recursive && !last && (type == DT_UNKNOWN || type == DT_LNK))
+                type = glob_entry_type(dir_fd, name, 0);
+
+            char *path = glob_join(work.dir, name);
+            if (recursive && type == DT_DIR)
+                glob_push(state, last ? shell_strdup(MEMORY_COMMAND, path) : path, component);
+            else if (!recursive && !last)
+            {
+                if (type == DT_DIR)
+                    glob_push(state, path, component + 1);
+                else
+                    shell_free(MEMORY_COMMAND, path);
+            }
+            if (last)
+            {
+                if (match_count == match_capacity)
+                {
+                    match_capacity = match_capacity ? match_capacity * 2 : 64;
+                    matches = shell_realloc(MEMORY_COMMAND, matches, match_capacity * sizeof(char *));
+                }
+                matches[match_count++] = path;
+            }
+            else if (recursive && type != DT_DIR)
+                shell_free(MEMORY_COMMAND, path);
+        }
+    }
+    close(dir_fd);
+    glob_add_results(state, matches, match_count);
+    shell_free(MEMORY_COMMAND, matches);
+    shell_free(MEMORY_COMMAND, work.dir);
+}
+
+void *glob_worker(void *arg)
+{
+    struct glob_state *state = arg;
+    pthread_mutex_lock(&state->lock);
+    while (1)
+    {
+        while (state->queue_count == 0 && state->active > 0)
+            pthread_cond_wait(&state->wakeup, &state->lock);
+        if (state->queue_count == 0)
+            break; // nothing queued and nobody can queue more
+        struct glob_work work = state->queue[--state->queue_count];
+        state->active++;
+        pthread_mutex_unlock(&state->lock);
+
+        glob_process(state, work);
+
+        pthread_mutex_lock(&state->lock);
+        state->active--;
+        if (state->queue_count == 0 && state->active == 0)
+            pthread_cond_broadcast(&state->wakeup);
+    }
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+// a pool thread of glob_expand, allocations are counted in accounts until it is joined
+struct glob_thread
+{
+    struct glob_state *state;
+    struct memory_account accounts[MEMORY_SUBSYSTEM_COUNT];
+};
+
+void *glob_thread(void *arg)
+{
+    struct glob_thread *thread = arg;
+    memory_thread_accounts = thread->accounts;
+    return glob_worker(thread->state);
+}
+
+int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/**
+ * Expands a glob pattern to the sorted list of matching paths.
+ * Patterns with ** are walked by SHELLGIBI_GLOB_THREADS threads when set
+ * @param  pattern     pattern, quoted metacharacters are backslash escaped
+ * @param  results_out set to a malloc'ed array of malloc'ed paths
+ * @return             number of paths
+ */
+int glob_expand(const char *pattern, char ***results_out)
+{
+    struct glob_state state;
+    memset(&state, 0, sizeof(state));
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.wakeup, NULL);
+
+    char *pattern_copy = shell_strdup(MEMORY_COMMAND, pattern);
+    char *start = pattern_copy;
+    char *root = shell_strdup(MEMORY_COMMAND, "");
+    if (*start == '/')
+    {
+        shell_free(MEMORY_COMMAND, root);
+        root = shell_strdup(MEMORY_COMMAND, "/");
+        while (*start == '/')
+            start++;
+    }
+    int capacity = 1;
+    for (char *c = start; *c; c++)
+        capacity += *c == '/';
+    state.components = shell_malloc(MEMORY_COMMAND, capacity * sizeof(char *));
+    state.literals = shell_malloc(MEMORY_COMMAND, capacity * sizeof(char *));
+    for (char *component = start;;)
+    {
+        char *slash = strchr(component, '/');
+        if (slash)
+            *slash = '\0';
+        state.components[state.component_count] = component;
+        // components without metacharacters are joined directly, pruning the walk
+        if (strpbrk(component, "*?[") == NULL)
+        {
+            char *literal = shell_malloc(MEMORY_COMMAND, strlen(component) + 1), *out = literal;
+            for (char *in = component; *in; in++)
+                *out++ = (*in == '\\' && in[1]) ? *++in : *in;
+            *out = '\0';
+            state.literals[state.component_count] = literal;
+        }
+        else
+            state.literals[state.component_count] = NULL;
+        state.component_count++;
+        if (slash == NULL)
+            break;
+        component = slash + 1;
+    }
+    // a trailing slash leaves an empty last component, joining it keeps only directories
+
+    glob_push(&state, root, 0);
+    int threads = 1;
+    char *threads_env = getenv("SHELLGIBI_GLOB_THREADS");
+    if (threads_env != NULL && strstr(pattern, "**") != NULL)
+        threads = atoi(threads_env);
+    if (threads < 1)
+        threads = 1;
+    if (threads > GLOB_MAX_THREADS)
+        threads = GLOB_MAX_THREADS;
+    pthread_t workers[GLOB_MAX_THREADS];
+    struct glob_thread worker_threads[GLOB_MAX_THREADS];
+    int started = 0;
+    for (int i = 1; i < threads; i++)
+    {
+        worker_threads[started] = (struct glob_thread){.state = &state};
+        if (pthread_create(&workers[started], NULL, glob_thread, &worker_threads[started]) == 0)
+            started++;
+    }
+    glob_worker(&state);
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i], NULL);
+        memory_merge_accounts(worker_threads[i].accounts);
+    }
+
+    // byte order, independent of the locale
+    if (state.result_count > 1)
+        qsort(state.results, state.result_count, sizeof(char *), compare_strings);
+
+    for (int i = 0; i < state.component_count; i++)
+        shell_free(MEMORY_COMMAND, state.literals[i]);
+    shell_free(MEMORY_COMMAND, state.literals);
+    shell_free(MEMORY_COMMAND, state.components);
+    shell_free(MEMORY_COMMAND, state.queue);
+    shell_free(MEMORY_COMMAND, pattern_copy);
+    pthread_mutex_destroy(&state.lock);
+    pthread_cond_destroy(&state.wakeup);
+    *results_out = state.results;
+    return state.result_count;
+}
+
+/**
+ * Recognizes a redirection operator at the start of a word
+ * @param  word     word to check
+ * @param  redirect filled with the fd, type and open flags
+ * @param  target   set to the text after the operator, empty if the target is the next word
+ * @return          0 if word is not a redirection, 1 for a redirection, 2 for &> which
+ *                  redirects stdout and then copies it to stderr
+ */
+int parse_redirect_operator(const char *word, struct redirect *redirect, const char **target)
+{
+    const char *p = word;
+    memset(redirect, 0, sizeof(struct redirect));
+    if (p[0] == '&' && p[1] == '>')
+    {
+        p += 2;
+        redirect->type = REDIRECT_FILE;
+        redirect->fd = STDOUT_FILENO;
+        redirect->flags = O_WRONLY | O_CREAT | O_TRUNC;
+        if (*p == '>')
+        {
+            p++;
+            redirect->flags = O_WRONLY | O_CREAT | O_APPEND;
+        }
+        *target = p;
+        return 2;
+    }
+
+    int fd = -1;
+    if (*p >= '0' && *p <= '9')
+    {
+        fd = 0;
+        while (*p >= '0' && *p <= '9')
+            fd = fd * 10 + (*p++ - '0');
+    }
+    redirect->type = REDIRECT_FILE;
+    if (*p == '<')
+    {
+        p++;
+        redirect->fd = fd == -1 ? STDIN_FILENO : fd;
+        redirect->flags = O_RDONLY;
+        if (p[0] == '<' && p[1] == '<')
+        {
+            p += 2;
+            redirect->type = REDIRECT_HERESTRING;
+        }
+        else if (*p == '<')
+        {
+            p++;
+            redirect->type = REDIRECT_HEREDOC;
+            if (*p == '-')
+            {
+                p++;
+                redirect->strip_tabs = true;
+            }
+        }
+        else if (*p == '>')
+        {
+            p++;
+            redirect->flags = O_RDWR | O_CREAT;
+        }
+        else if (*p == '&')
+        {
+            p++;
+            redirect->type = REDIRECT_DUP;
+        }
+    }
+    else if (*p == '>')
+    {
+        p++;
+        redirect->fd = fd == -1 ? STDOUT_FILENO : fd;
+        redirect->flags = O_WRONLY | O_CREAT | O_TRUNC;
+        if (*p == '>')
+        {
+            p++;
+            redirect->flags = O_WRONLY | O_CREAT | O_APPEND;
+        }
+        else if (*p == '&')
+        {
+            p++;
+            redirect->type = REDIRECT_DUP;
+        }
+    }
+    else
+        return 0;
+    *target = p;
+    return 1;
+}
+
+// appends a copy of redirect to the redirections of the command
+void add_redirect(struct command_t *command, const struct redirect *redirect)
+{
+    struct redirect *copy = shell_malloc(MEMORY_COMMAND, sizeof(struct redirect));
+    *copy = *redirect;
+    copy->next = NULL;
+    struct redirect **tail = &command->redirects;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = copy;
+}
+
+// last redirection of fd to a file, NULL if fd is not redirected to a file
+struct redirect *find_file_redirect(struct command_t *command, int fd)
+{
+    struct redirect *found = NULL;
+    for (struct redirect *redirect = command->redirects; redirect; redirect = redirect->next)
+        if (redirect->fd == fd)
+            found = redirect->type == REDIRECT_FILE ? redirect : NULL;
+    return found;
+}
+
+/**
+ * Puts the body of a here-document behind a readable descriptor without
+ * touching the filesystem. Bodies that fit in the pipe buffer go through a
+ * pipe, larger ones through an anonymous memfd that is rewound after writing
+ * @return descriptor positioned at the start of the body, -1 on failure
+ */
+int here_document_fd(const struct redirect *redirect)
+{
+    int fd;
+    if (redirect->body_length <= PIPE_BUF)
+    {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1)
+            return -1;
+        // a write of at most PIPE_BUF bytes into an empty pipe never blocks
+        if (redirect->body_length > 0 && write(fds[1], redirect->body, redirect->body_length) == -1)
+        {
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        close(fds[1]);
+        return fds[0];
+    }
+
+    fd = memfd_create("shellgibi-heredoc", MFD_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    size_t written = 0;
+    while (written < redirect->body_length)
+    {
+        ssize_t n = write(fd, redirect->body + written, redirect->body_length - written);
+        if (n == -1)
+        {
+            close(fd);
+            return -1;
+        }
+        written += n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/**
+ * Applies the redirections of a command in order, in the forked child.
+ * Files are opened with O_CLOEXEC and moved into place with dup2, which
+ * clears the flag on the target descriptor
+ * @return 0, or -1 after printing the error
+ */
+int apply_redirects(struct command_t *command)
+{
+    for (struct redirect *redirect = command->redirects; redirect; redirect = redirect->next)
+    {
+        if (redirect->type == REDIRECT_CLOSE)
+        {
+            close(redirect->fd);
+            continue;
+        }
+        if (redirect->type == REDIRECT_AMBIGUOUS)
+        {
+            fprintf(stderr, "-%s: %s: ambiguous redirect\n", sysname, redirect->path);
+            return -1;
+        }
+        int source_fd = redirect->source_fd;
+        if (redirect->type == REDIRECT_HEREDOC || redirect->type == REDIRECT_HERESTRING)
+        {
+            source_fd = here_document_fd(redirect);
+            if (source_fd == -1)
+            {
+                fprintf(stderr, "-%s: here-document: %s\n", sysname, strerror(errno));
+                return -1;
+            }
+        }
+        else if (redirect->type == REDIRECT_FILE)
+        {
+            source_fd = open(redirect->path, redirect->flags | O_CLOEXEC, 0666);
+            if (source_fd == -1)
+            {
+                fprintf(stderr, "-%s: %s: %s\n", sysname, redirect->path, strerror(errno));
+                return -1;
+            }
+        }
+        if (source_fd == redirect->fd)
+        {
+            fcntl(source_fd, F_SETFD, 0); // already in place, only keep it across exec
+            continue;
+        }
+        if (dup2(source_fd, redirect->fd) == -1)
+        {
+            fprintf(stderr, "-%s: %d: %s\n", sysname, source_fd, strerror(errno));
+            return -1;
+        }
+        if (redirect->type != REDIRECT_DUP)
+            close(source_fd);
+    }
+    return 0;
+}
+
+// an unquoted | written on the command line, not one that came out of a substitution
+static inline bool is_pipe_token(const struct token *token)
+{
+    return !token->quoted && token->substitution == SUBSTITUTION_NONE && strcmp(token->text, "|") == 0;
+}
+
+/**
+ * Runs a command line in a forked copy of the shell, through the same
+ * parse_command and process_command path as a line typed at the prompt
+ * @param  line           command line to run
+ * @param  fd             STDOUT_FILENO to read what the subshell writes, STDIN_FILENO to feed it
+ * @param  close_fds      ends of earlier substitutions, closed in the subshell so readers see EOF
+ * @param  close_fd_count number of close_fds
+ * @param  pipe_end       set to the parent's end of the pipe, opened with O_CLOEXEC
+ * @return                pid of the subshell, -1 on failure
+ */
+pid_t spawn_subshell(const char *line, int fd, const int *close_fds, int close_fd_count, int *pipe_end)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+        return -1;
+    int child_end = fd == STDOUT_FILENO ? fds[1] : fds[0];
+    int parent_end = fd == STDOUT_FILENO ? fds[0] : fds[1];
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        for (int i = 0; i < close_fd_count; i++)
+            close(close_fds[i]);
+        close(parent_end);
+        dup2(child_end, fd);
+        close(child_end);
+        struct command_t *command = shell_calloc(MEMORY_COMMAND, 1, sizeof(struct command_t));
+        char *buf = shell_strdup(MEMORY_COMMAND, line);
+        parse_command(buf, command);
+        process_command(command, NULL);
+        free_command(command);
+        shell_free(MEMORY_COMMAND, buf);
+        exit(last_exit_status);
+    }
+    close(child_end);
+    if (pid == -1)
+    {
+        close(parent_end);
+        return -1;
+    }
+    *pipe_end = parent_end;
+    return pid;
+}
+
+/**
+ * Replaces the text of a $(cmd) token with the output of cmd. The output is
+ * read straight into a buffer that grows geometrically, and trailing newlines
+ * are dropped. The exit status of cmd becomes the last exit status
+ * @param token   $(cmd) token
+ * @param command first stage of the line being parsed
+ */
+void capture_substitution(struct token *token, struct command_t *command)
+{
+    size_t length = 0, capacity = 256;
+    char *output = shell_malloc(MEMORY_COMMAND, capacity);
+    int fd;
+    pid_t pid = spawn_subshell(token->text, STDOUT_FILENO, command->substitution_fds, command->substitution_fd_count, &fd);
+    if (pid == -1)
+        print_error("command substitution failed.");
+    else
+    {
+        ssize_t n;
+        while ((n = read(fd, output + length, capacity - length - 1)) != 0)
+        {
+            if (n == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            length += n;
+            if (length == capacity - 1)
+            {
+                capacity *= 2;
+                output = shell_realloc(MEMORY_COMMAND, output, capacity);
+            }
+        }
+        close(fd);
+        int status;
+        waitpid(pid, &status, 0);
+        last_exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+    while (length > 0 && output[length - 1] == '\n')
+        length--;
+    output[length] = '\0';
+    shell_free(MEMORY_COMMAND, token->text);
+    token->text = output;
+    if (token->prefix != NULL)
+    {
+        token->text = shell_malloc(MEMORY_COMMAND, strlen(token->prefix) + length + 1);
+        sprintf(token->text, "%s%s", token->prefix, output);
+        shell_free(MEMORY_COMMAND, output);
+    }
+}
+
+/**
+ * Starts the command of a <(cmd) or >(cmd) token in the background and
+ * replaces the token with /dev/fd/N, the parent's end of the pipe to it. The
+ * descriptor is inherited by the stages and closed when the command is freed
+ * @param token   <(cmd) or >(cmd) token
+ * @param command first stage of the line being parsed
+ */
+void open_process_substitution(struct token *token, struct command_t *command)
+{
+    int fd;
+    int child_fd = token->substitution == SUBSTITUTION_INPUT ? STDOUT_FILENO : STDIN_FILENO;
+    pid_t pid = spawn_subshell(token->text, child_fd, command->substitution_fds, command->substitution_fd_count, &fd);
+    shell_free(MEMORY_COMMAND, token->text);
+    if (pid == -1)
+    {
+        print_error("process substitution failed.");
+        token->text = shell_strdup(MEMORY_COMMAND, "/dev/null");
+        return;
+    }
+    fcntl(fd, F_SETFD, 0); // kept across exec, the command opens it by name
+    add_job(pid, token->substitution == SUBSTITUTION_INPUT ? "<(...)" : ">(...)", NULL);
+    command->substitution_fds = shell_realloc(MEMORY_COMMAND, command->substitution_fds, sizeof(int) * (command->substitution_fd_count + 1));
+    command->substitution_fds[command->substitution_fd_count++] = fd;
+    token->text = shell_malloc(MEMORY_COMMAND, 32);
+    snprintf(token->text, 32, "/dev/fd/%d", fd);
+}
+
+/**
+ * Splits text at whitespace and appends the words to a stage, the first one
+ * becoming the name if the stage has none yet. Every word is copied: the
+ * prefixes (time, pin, limit), set_command_words and free_command free
+ * arguments one by one, so args cannot point into the shared capture buffer
+ * @param command   stage to append to
+ * @param text      words, modified in place
+ * @param remaining words still to come in the stage, args keeps room for them
+ */
+void add_split_words(struct command_t *command, char *text, int remaining)
+{
+    int word_count = 0;
+    for (char *p = text; *p; p++)
+        if (!is_splitter(*p) && (p == text || is_splitter(p[-1])))
+            word_count++;
+    command->args = (char **)shell_realloc(MEMORY_COMMAND, command->args, sizeof(char *) * (command->arg_count + word_count + remaining));
+    char *save;
+    for (char *word = strtok_r(text, " \t\n", &save); word; word = strtok_r(NULL, " \t\n", &save))
+    {
+        if (command->name == NULL)
+            command->name = shell_strdup(MEMORY_COMMAND, word);
+        else
+            command->args[command->arg_count++] = shell_strdup(MEMORY_COMMAND, word);
+    }
+}
+
+// number of words up to the next pipe, an upper bound for the arguments of a stage
+int stage_word_count(struct token *tokens, int start, int token_count)
+{
+    int count = 1;
+    for (int i = start; i < token_count && !is_pipe_token(&tokens[i]); i++)
+        count++;
+    return count;
+}
+
+bool starts_block(const char *line);
+bool is_compound_line(const char *line);
+struct script_node *compile_script(const char *text);
+
+int expand_aliases(struct token **tokens, int token_count);
+
+/**
+ * Builds the pipeline of a tokenized command line: expands aliases, runs its
+ * substitutions, then splits it into stages, redirections and arguments
+ * @param  tokens      words of the line, freed here
+ * @param  token_count number of tokens
+ * @param  command     first stage, filled in
+ * @return             0
+ */
+int build_pipeline(struct token *tokens, int token_count, struct command_t *command)
+{
+    token_count = expand_aliases(&tokens, token_count);
+
+    // substitutions run before the pipeline is built, in the order they appear
+    for (int i = 0; i < token_count; i++)
+    {
+        if (tokens[i].substitution == SUBSTITUTION_COMMAND)
+            capture_substitution(&tokens[i], command);
+        else if (tokens[i].substitution != SUBSTITUTION_NONE)
+            open_process_substitution(&tokens[i], command);
+    }
+
+    // a trailing & puts every stage of the pipeline in the background
+    bool background = false;
+    if (token_count > 0 && !tokens[token_count - 1].quoted && tokens[token_count - 1].substitution == SUBSTITUTION_NONE)
+    {
+        struct token *last = &tokens[token_count - 1];
+        size_t len = strlen(last->text);
+        if (strcmp(last->text, "&") == 0)
+        {
+            background = true;
+            shell_free(MEMORY_COMMAND, last->text);
+            shell_free(MEMORY_COMMAND, last->pattern);
+            token_count--;
+        }
+        else if (len > 1 && last->text[len - 1] == '&')
+        {
+            background = true;
+            last->text[len - 1] = '\0';
+        }
+    }
+
+    struct command_t *current = command;
+    current->background = background;
+    current->args = (char **)shell_malloc(MEMORY_COMMAND, sizeof(char *) * stage_word_count(tokens, 0, token_count));
+    for (int i = 0; i < token_count; i++)
+    {
+        struct token *token = &tokens[i];
+
+        // piping to another command
+        if (is_pipe_token(token))
+        {
+            if (current->name == NULL)
+                current->name = shell_strdup(MEMORY_COMMAND, "");
+            struct command_t *c = shell_malloc(MEMORY_COMMAND, sizeof(struct command_t));
+            memset(c, 0, sizeof(struct command_t));
+            c->background = background;
+            c->args = (char **)shell_malloc(MEMORY_COMMAND, sizeof(char *) * stage_word_count(tokens, i + 1, token_count));
+            current->next = c;
+            current = c;
+            continue;
+        }
+
+        // redirections may appear anywhere in the stage, even before the name,
+        // as long as the operator itself is not quoted (2>"my file" is fine)
+        struct redirect redirect;
+        const char *target;
+        int redirect_kind = parse_redirect_operator(token->text, &redirect, &target);
+        if (redirect_kind != 0 && target - token->text <= token->plain_length)
+        {
+            // the target may be attached (>out) or the next word (> out)
+            if (*target == '\0' && i + 1 < token_count)
+                target = tokens[++i].text;
+            if (redirect.type == REDIRECT_DUP)
+            {
+                if (strcmp(target, "-") == 0)
+                    redirect.type = REDIRECT_CLOSE;
+                else if (target[0] != '\0' && strspn(target, "0123456789") == strlen(target))
+                    redirect.source_fd = atoi(target);
+                else if (token->text[0] == '>') // >&file is the same as &>file
+                {
+                    redirect.type = REDIRECT_FILE;
+                    redirect.flags = O_WRONLY | O_CREAT | O_TRUNC;
+                    redirect_kind = 2;
+                }
+                else // <&file and n>&file never open the file
+                    redirect.type = REDIRECT_AMBIGUOUS;
+            }
+            if (redirect.type == REDIRECT_FILE || redirect.type == REDIRECT_HEREDOC ||
+                redirect.type == REDIRECT_AMBIGUOUS)
+                redirect.path = shell_strdup(MEMORY_COMMAND, target); // the here-document body is read after parsing
+            if (redirect.type == REDIRECT_HERESTRING)
+            {
+                redirect.body_length = strlen(target) + 1;
+                redirect.body = shell_malloc(MEMORY_COMMAND, redirect.body_length + 1);
+                sprintf(redirect.body, "%s\n", target);
+            }
+            add_redirect(current, &redirect);
+            if (redirect_kind == 2) // &> also sends stderr to the same open file
+            {
+                struct redirect stderr_to_stdout = {.type = REDIRECT_DUP, .fd = STDERR_FILENO, .source_fd = redirect.fd};
+                add_redirect(current, &stderr_to_stdout);
+            }
+            continue;
+        }
+
+        // the output of an unquoted $(cmd) becomes as many words as it holds
+        if (token->substitution == SUBSTITUTION_COMMAND && !token->quoted)
+        {
+            add_split_words(current, token->text, stage_word_count(tokens, i + 1, token_count));
+            continue;
+        }
+
+        if (current->name == NULL)
+        {
+            current->name = token->text;
+            token->text = NULL;
+            continue;
+        }
+
+        // unquoted glob characters expand into the matching paths, sorted
+        if (token->pattern != NULL)
+        {
+            char **paths;
+            int path_count = glob_expand(token->pattern, &paths);
+            if (path_count > 0)
+            {
+                // the matches are moved into argv as they are, without copies
+                current->args = (char **)shell_realloc(MEMORY_COMMAND, current->args, sizeof(char *) * (current->arg_count + path_count +
+                                                                                  stage_word_count(tokens, i + 1, token_count)));
+                memcpy(current->args + current->arg_count, paths, sizeof(char *) * path_count);
+                current->arg_count += path_count;
+                shell_free(MEMORY_COMMAND, paths);
+                continue;
+            }
+            // no match, the word is passed as it is
+        }
+
+        // normal arguments, args already has room for every word of the stage
+        current->args[current->arg_count++] = token->text;
+        token->text = NULL;
+    }
+    if (current->name == NULL)
+        current->name = shell_strdup(MEMORY_COMMAND, "");
+    free_tokens(tokens, token_count);
+    return 0;
+}
+
+/**
+ * Parse a command string into a command struct
+ * @param  buf     command line
+ * @param  command filled with the first stage, later stages hang off command->next
+ * @return         0
+ */
+int parse_command(char *buf, struct command_t *command)
+{
+    // blocks, statement lists and here-documents are compiled once and run by process_command
+    if (starts_block(buf) || is_compound_line(buf))
+    {
+        command->script = compile_script(buf);
+        command->name = shell_strdup(MEMORY_COMMAND, "");
+        command->args = shell_malloc(MEMORY_COMMAND, sizeof(char *));
+        return 0;
+    }
+    struct token *tokens;
+    int token_count = tokenize(buf, &tokens, true);
+    return build_pipeline(tokens, token_count, command);
+}
+
+// control flow: for NAME in words; do ...; done, while cmd; do ...; done and if cmd; then ...; elif ...; else ...; fi
+enum script_node_type
+{
+    SCRIPT_COMMAND,
+    SCRIPT_FOR,
+    SCRIPT_WHILE,
+    SCRIPT_IF,
+    SCRIPT_FUNCTION // NAME() { ...; }, defines the function when it runs
+};
+
+// compiled body of a function, shared by the node that defines it, the definition and every call still running it
+struct function_body
+{
+    struct script_node *script;
+    int references;
+};
+
+void release_function_body(struct function_body *body);
+
+/**
+ * A compiled statement. Command lines are tokenized once, when the block is
+ * read; a run copies the words and tokenizes again only the ones that refer
+ * to variables
+ */
+struct script_node
+{
+    enum script_node_type type;
+    struct token *tokens; // command line, for the word list of for after a "for" name word
+    int token_count;
+    char *variable;                // for, the name of a function
+    struct script_node *condition; // while and if, a command
+    struct script_node *body;      // loop body or then branch
+    struct script_node *else_body; // else branch, an if node for elif
+    char **here_documents;         // bodies of the <<WORD redirections of a command, in order
+    int here_document_count;
+    struct function_body *function; // body of a function definition, shared with the table
+    struct script_node *next;
+};
+
+struct script_parser
+{
+    char **segments; // statements split at newlines and ;
+    int count;
+    int index;
+    bool failed;
+};
+
+void free_script(struct script_node *node)
+{
+    while (node)
+    {
+        struct script_node *next = node->next;
+        free_tokens(node->tokens, node->token_count);
+        shell_free(MEMORY_SCRIPT, node->variable);
+        free_script(node->condition);
+        free_script(node->body);
+        free_script(node->else_body);
+        for (int i = 0; i < node->here_document_count; i++)
+            shell_free(MEMORY_SCRIPT, node->here_documents[i]);
+        shell_free(MEMORY_SCRIPT, node->here_documents);
+        release_function_body(node->function);
+        shell_free(MEMORY_SCRIPT, node);
+        node = next;
+    }
+}
+
+#define HERE_DOCUMENT_MAX 16
+
+/**
+ * Finds the here-document operators of one statement, the way build_pipeline
+ * reads them
+ * @param  statement  a single line
+ * @param  delimiters filled with malloc'ed delimiters, in the order of the operators
+ * @param  strip_tabs set for the <<- ones
+ * @return            number of here-documents, at most max
+ */
+int find_here_documents(const char *statement, char **delimiters, bool *strip_tabs, int max)
+{
+    if (strstr(statement, "<<") == NULL)
+        return 0;
+    struct token *tokens;
+    int token_count = tokenize(statement, &tokens, false);
+    int count = 0;
+    for (int i = 0; i < token_count && count < max; i++)
+    {
+        struct redirect redirect;
+        const char *target;
+        if (parse_redirect_operator(tokens[i].text, &redirect, &target) == 0 ||
+            target - tokens[i].text > tokens[i].plain_length || redirect.type != REDIRECT_HEREDOC)
+            continue;
+        if (*target == '\0' && i + 1 < token_count)
+            target = tokens[++i].text;
+        delimiters[count] = shell_strdup(MEMORY_SCRIPT, target);
+        strip_tabs[count++] = redirect.strip_tabs;
+    }
+    free_tokens(tokens, token_count);
+    return count;
+}
+
+/**
+ * Takes the lines of one here-document off the text, up to and including the
+ * delimiter line
+ * @param  text       first line of the body, advanced past the delimiter line
+ * @param  found      set if the delimiter was found before the end of the text
+ * @return            malloc'ed body, every line ends with a newline
+ */
+char *take_here_document(const char **text, const char *delimiter, bool strip_tabs, bool *found)
+{
+    size_t length = 0, capacity = 256;
+    char *body = shell_malloc(MEMORY_SCRIPT, capacity);
+    const char *line = *text;
+    *found = false;
+    while (*line != '\0')
+    {
+        const char *end = strchr(line, '\n');
+        if (end == NULL)
+            end = line + strlen(line);
+        const char *next = *end ? end + 1 : end;
+        if (strip_tabs)
+            while (*line == '\t')
+                line++;
+        size_t line_length = end - line;
+        if (line_length == strlen(delimiter) && strncmp(line, delimiter, line_length) == 0)
+        {
+            *found = true;
+            line = next;
+            break;
+        }
+        while (length + line_length + 2 > capacity)
+            capacity *= 2;
+        body = shell_realloc(MEMORY_SCRIPT, body, capacity);
+        memcpy(body + length, line, line_length);
+        length += line_length;
+        body[length++] = '\n';
+        line = next;
+    }
+    body[length] = '\0';
+    *text = line;
+    return body;
+}
+
+/**
+ * Splits script text into statements at newlines and unquoted ;, outside of
+ * $(cmd), <(cmd) and >(cmd). Empty statements and # comment lines are dropped.
+ * The lines of here-documents are no statements: they are kept after a newline
+ * at the end of the statement with the operator, for compile_command
+ * @param  count          set to the number of statements
+ * @param  open_documents if not NULL, set to the number of here-documents the text ends in
+ * @return                malloc'ed array of malloc'ed statements
+ */
+char **split_script(const char *text, int *count, int *open_documents)
+{
+    char **segments = NULL;
+    int capacity = 0;
+    *count = 0;
+    if (open_documents != NULL)
+        *open_documents = 0;
+    // here-documents of the current line, their bodies start on the next one
+    char *delimiters[HERE_DOCUMENT_MAX];
+    bool strip_tabs[HERE_DOCUMENT_MAX];
+    int owners[HERE_DOCUMENT_MAX];
+    int pending = 0;
+    const char *start = text;
+    char quote = 0;
+    int depth = 0;
+    for (const char *p = text;; p++)
+    {
+        if (*p != '\0' && quote)
+        {
+            if (*p == quote)
+                quote = 0;
+            else if (*p == '\\' && quote == '"' && p[1] != '\0')
+                p++;
+            continue;
+        }
+        if (*p == '\\' && p[1] != '\0' && p[1] != '\n')
+        {
+            p++;
+            continue;
+        }
+        if (*p == '\'' || *p == '"')
+            quote = *p;
+        else if (*p == '(' && p > text && (p[-1] == '$' || p[-1] == '<' || p[-1] == '>'))
+            depth++;
+        else if (*p == ')' && depth > 0)
+            depth--;
+        else if (*p == '\0' || *p == '\n' || (*p == ';' && depth == 0))
+        {
+            while (start < p && is_splitter(*start))
+                start++;
+            const char *end = p;
+            while (end > start && is_splitter(end[-1]))
+                end--;
+            if (end > start && *start != '#')
+            {
+                if (*count == capacity)
+                {
+                    capacity = capacity ? capacity * 2 : 16;
+                    segments = shell_realloc(MEMORY_SCRIPT, segments, sizeof(char *) * capacity);
+                }
+                segments[*count] = shell_strndup(MEMORY_SCRIPT, start, end - start);
+                int found = find_here_documents(segments[*count], delimiters + pending, strip_tabs + pending,
+                                                HERE_DOCUMENT_MAX - pending);
+                for (int i = 0; i < found; i++)
+                    owners[pending++] = *count;
+                (*count)++;
+            }
+            if (*p == '\n' && pending > 0)
+            {
+                // the raw lines, delimiters included, go to the end of the statement that owns them
+                const char *body = p + 1;
+                for (int i = 0; i < pending; i++)
+                {
+                    const char *body_start = body;
+                    bool closed;
+                    shell_free(MEMORY_SCRIPT, take_here_document(&body, delimiters[i], strip_tabs[i], &closed));
+                    if (!closed && open_documents != NULL)
+                        (*open_documents)++;
+                    size_t segment_length = strlen(segments[owners[i]]), raw_length = body - body_start;
+                    segments[owners[i]] =
+                        shell_realloc(MEMORY_SCRIPT, segments[owners[i]], segment_length + raw_length + 2);
+                    sprintf(segments[owners[i]] + segment_length, "\n%.*s", (int)raw_length, body_start);
+                    shell_free(MEMORY_SCRIPT, delimiters[i]);
+                }
+                pending = 0;
+                p = body - 1; // the newline of the last delimiter line, or the end of the text
+                if (*body == '\0')
+                    break;
+            }
+            if (*p == '\0')
+                break;
+            start = p + 1;
+        }
+    }
+    // operators on the last line, no body follows yet
+    for (int i = 0; i < pending; i++)
+        shell_free(MEMORY_SCRIPT, delimiters[i]);
+    if (open_documents != NULL)
+        *open_documents += pending;
+    return segments;
+}
+
+// the text after the first word of a statement and the blanks that follow it
+char *skip_first_word(char *statement)
+{
+    while (*statement && !is_splitter(*statement))
+        statement++;
+    while (is_splitter(*statement))
+        statement++;
+    return statement;
+}
+
+// true if the first word of statement is keyword, unquoted
+bool starts_with_keyword(const char *statement, const char *keyword)
+{
+    size_t length = strlen(keyword);
+    return strncmp(statement, keyword, length) == 0 && (statement[length] == '\0' || is_splitter(statement[length]));
+}
+
+/**
+ * Recognizes the head of a function definition, NAME() or function NAME
+ * @return the text after it, NULL if statement does not define a function
+ */
+const char *function_definition_body(const char *statement, char *name, size_t name_size)
+{
+    const char *p = statement;
+    bool keyword = starts_with_keyword(p, "function");
+    if (keyword)
+        p = skip_first_word((char *)p);
+    const char *start = p;
+    while (is_name_character(*p, p == start) || (p > start && (*p == '-' || *p == '.')))
+        p++;
+    size_t length = p - start;
+    if (length == 0 || length >= name_size)
+        return NULL;
+    while (is_splitter(*p))
+        p++;
+    if (p[0] == '(' && p[1] == ')')
+        p += 2;
+    else if (!keyword)
+        return NULL;
+    while (is_splitter(*p))
+        p++;
+    memcpy(name, start, length);
+    name[length] = '\0';
+    return p;
+}
+
+/**
+ * True if a line holds more than one statement (a newline or an unquoted ;) or
+ * a here-document, these go through split_script like a script does
+ */
+bool is_compound_line(const char *line)
+{
+    char quote = 0;
+    int depth = 0;
+    for (const char *p = line; *p; p++)
+    {
+        if (quote)
+        {
+            if (*p == quote)
+                quote = 0;
+            else if (*p == '\\' && quote == '"' && p[1] != '\0')
+                p++;
+            continue;
+        }
+        if (*p == '\\' && p[1] != '\0' && p[1] != '\n')
+            p++;
+        else if (*p == '\'' || *p == '"')
+            quote = *p;
+        else if (*p == '(' && p > line && (p[-1] == '$' || p[-1] == '<' || p[-1] == '>'))
+            depth++;
+        else if (*p == ')' && depth > 0)
+            depth--;
+        else if (*p == '\n')
+            return true;
+        else if (depth == 0 && *p == ';')
+            return true;
+        else if (depth == 0 && p[0] == '<' && p[1] == '<')
+        {
+            if (p[2] != '<')
+                return true;
+            p += 2; // a here-string
+        }
+    }
+    return false;
+}
+
+bool starts_block(const char *line)
+{
+    char name[256];
+    while (is_splitter(*line))
+        line++;
+    return starts_with_keyword(line, "for") || starts_with_keyword(line, "while") || starts_with_keyword(line, "if") ||
+           function_definition_body(line, name, sizeof(name)) != NULL;
+}
+
+/**
+ * How many blocks and here-documents are left open at the end of text, the
+ * prompt keeps reading lines while this is positive
+ */
+int block_depth(const char *text)
+{
+    int count, depth;
+    char **segments = split_script(text, &count, &depth);
+    for (int i = 0; i < count; i++)
+    {
+        char *statement = segments[i];
+        while (starts_with_keyword(statement, "do") || starts_with_keyword(statement, "then") ||
+               starts_with_keyword(statement, "else"))
+            statement = skip_first_word(statement);
+        if (starts_block(statement))
+            depth++;
+        else if (starts_with_keyword(statement, "done") || starts_with_keyword(statement, "fi") ||
+                 starts_with_keyword(statement, "}"))
+            depth--;
+        shell_free(MEMORY_SCRIPT, segments[i]);
+    }
+    shell_free(MEMORY_SCRIPT, segments);
+    return depth;
+}
+
+/**
+ * Compiles one statement into a command node, words are tokenized without
+ * expanding variables. Here-document bodies follow the first line, see split_script
+ */
+struct script_node *compile_command(const char *statement)
+{
+    struct script_node *node = shell_calloc(MEMORY_SCRIPT, 1, sizeof(struct script_node));
+    node->type = SCRIPT_COMMAND;
+    const char *bodies = strchr(statement, '\n');
+    if (bodies == NULL && strstr(statement, "<<") == NULL)
+    {
+        node->token_count = tokenize(statement, &node->tokens, false);
+        return node;
+    }
+    char *line = shell_strndup(MEMORY_SCRIPT, statement, bodies ? (size_t)(bodies - statement) : strlen(statement));
+    node->token_count = tokenize(line, &node->tokens, false);
+    char *delimiters[HERE_DOCUMENT_MAX];
+    bool strip_tabs[HERE_DOCUMENT_MAX];
+    node->here_document_count = find_here_documents(line, delimiters, strip_tabs, HERE_DOCUMENT_MAX);
+    shell_free(MEMORY_SCRIPT, line);
+    node->here_documents = shell_malloc(MEMORY_SCRIPT, sizeof(char *) * node->here_document_count);
+    // a single line from --client or the server has no body lines at all
+    bodies = bodies ? bodies + 1 : "";
+    for (int i = 0; i < node->here_document_count; i++)
+    {
+        bool closed;
+        node->here_documents[i] = take_here_document(&bodies, delimiters[i], strip_tabs[i], &closed);
+        if (!closed)
+            print_warning("here-document delimited by end-of-file.");
+        shell_free(MEMORY_SCRIPT, delimiters[i]);
+    }
+    return node;
+}
+
+/**
+ * Consumes keyword at the start of the current statement, what follows it on
+ * the same statement (do echo $i) stays as the current statement
+ */
+bool expect_keyword(struct script_parser *parser, const char *keyword)
+{
+    if (parser->index >= parser->count || !starts_with_keyword(parser->segments[parser->index], keyword))
+    {
+        fprintf(stderr, "-%s: syntax error: expected '%s'\n", sysname, keyword);
+        parser->failed = true;
+        return false;
+    }
+    char *rest = skip_first_word(parser->segments[parser->index]);
+    if (*rest == '\0')
+        parser->index++;
+    else
+        memmove(parser->segments[parser->index], rest, strlen(rest) + 1);
+    return true;
+}
+
+struct script_node *compile_if(struct script_parser *parser);
+
+/**
+ * Compiles statements until one starts with one of the terminators
+ * @param  terminators NULL terminated keywords that end the list, NULL at the top level
+ * @param  found       set to the terminator, consumed like expect_keyword, NULL at the end
+ * @return             the statements in order
+ */
+struct script_node *compile_list(struct script_parser *parser, const char *const *terminators, const char **found)
+{
+    struct script_node *first = NULL, **link = &first;
+    *found = NULL;
+    while (parser->index < parser->count && !parser->failed)
+    {
+        char *statement = parser->segments[parser->index];
+        for (int i = 0; terminators && terminators[i]; i++)
+        {
+            if (starts_with_keyword(statement, terminators[i]))
+            {
+                *found = terminators[i];
+                expect_keyword(parser, terminators[i]);
+                return first;
+            }
+        }
+        const char *reserved[] = {"do", "done", "then", "elif", "else", "fi", "{", "}"};
+        for (int i = 0; i < sizeof(reserved) / sizeof(reserved[0]); i++)
+        {
+            if (starts_with_keyword(statement, reserved[i]))
+            {
+                fprintf(stderr, "-%s: syntax error near unexpected '%s'\n", sysname, reserved[i]);
+                parser->failed = true;
+                return first;
+            }
+        }
+        struct script_node *node = NULL;
+        const char *end;
+        char name[256];
+        const char *function_body = function_definition_body(statement, name, sizeof(name));
+        if (function_body != NULL)
+        {
+            // NAME() { body; }, the brace may also open the next statement
+            node = shell_calloc(MEMORY_SCRIPT, 1, sizeof(struct script_node));
+            node->type = SCRIPT_FUNCTION;
+            node->variable = shell_strdup(MEMORY_SCRIPT, name);
+            memmove(statement, function_body, strlen(function_body) + 1);
+            if (*statement == '\0')
+                parser->index++;
+            node->function = shell_malloc(MEMORY_SCRIPT, sizeof(struct function_body));
+            node->function->script = NULL;
+            node->function->references = 1;
+            if (expect_keyword(parser, "{"))
+            {
+                node->function->script = compile_list(parser, (const char *const[]){"}", NULL}, &end);
+                if (end == NULL && !parser->failed)
+                    expect_keyword(parser, "}");
+            }
+        }
+        else if (starts_with_keyword(statement, "for"))
+        {
+            node = shell_calloc(MEMORY_SCRIPT, 1, sizeof(struct script_node));
+            node->type = SCRIPT_FOR;
+            node->token_count = tokenize(statement, &node->tokens, false);
+            parser->index++;
+            // for NAME in words..., the name and "in" are dropped, "for" stays as the command name of the list
+            if (node->token_count < 3 || !is_name(node->tokens[1].text) || strcmp(node->tokens[2].text, "in") != 0)
+            {
+                fprintf(stderr, "-%s: syntax error: for NAME in WORDS...\n", sysname);
+                parser->failed = true;
+            }
+            else
+            {
+                node->variable = shell_strdup(MEMORY_SCRIPT, node->tokens[1].text);
+                shell_free(MEMORY_COMMAND, node->tokens[1].text);
+                shell_free(MEMORY_COMMAND, node->tokens[1].pattern);
+                shell_free(MEMORY_COMMAND, node->tokens[1].source);
+                shell_free(MEMORY_COMMAND, node->tokens[2].text);
+                shell_free(MEMORY_COMMAND, node->tokens[2].pattern);
+                shell_free(MEMORY_COMMAND, node->tokens[2].source);
+                memmove(node->tokens + 1, node->tokens + 3, sizeof(struct token) * (node->token_count - 3));
+                node->token_count -= 2;
+            }
+            if (!parser->failed && expect_keyword(parser, "do"))
+            {
+                node->body = compile_list(parser, (const char *const[]){"done", NULL}, &end);
+                if (end == NULL && !parser->failed)
+                    expect_keyword(parser, "done");
+            }
+        }
+        else if (starts_with_keyword(statement, "while"))
+        {
+            node = shell_calloc(MEMORY_SCRIPT, 1, sizeof(struct script_node));
+            node->type = SCRIPT_WHILE;
+            node->condition = compile_command(skip_first_word(statement));
+            parser->index++;
+            if (expect_keyword(parser, "do"))
+            {
+                node->body = compile_list(parser, (const char *const[]){"done", NULL}, &end);
+                if (end == NULL && !parser->failed)
+                    expect_keyword(parser, "done");
+            }
+        }
+        else if (starts_with_keyword(statement, "if"))
+        {
+            memmove(statement, skip_first_word(statement), strlen(skip_first_word(statement)) + 1);
+            node = compile_if(parser);
+        }
+        else
+        {
+            node = compile_command(statement);
+            parser->index++;
+        }
+        *link = node;
+        link = &node->next;
+    }
+    return first;
+}
+
+// compiles if, the current statement holds its condition, elif chains nest as else branches
+struct script_node *compile_if(struct script_parser *parser)
+{
+    struct script_node *node = shell_calloc(MEMORY_SCRIPT, 1, sizeof(struct script_node));
+    node->type = SCRIPT_IF;
+    node->condition = compile_command(parser->segments[parser->index]);
+    parser->index++;
+    if (!expect_keyword(parser, "then"))
+        return node;
+    const char *end;
+    node->body = compile_list(parser, (const char *const[]){"elif", "else", "fi", NULL}, &end);
+    if (end == NULL)
+    {
+        if (!parser->failed)
+            expect_keyword(parser, "fi");
+    }
+    else if (strcmp(end, "elif") == 0)
+    {
+        if (parser->index < parser->count)
+            node->else_body = compile_if(parser);
+        else
+            expect_keyword(parser, "then");
+    }
+    else if (strcmp(end, "else") == 0)
+    {
+        node->else_body = compile_list(parser, (const char *const[]){"fi", NULL}, &end);
+        if (end == NULL && !parser->failed)
+            expect_keyword(parser, "fi");
+    }
+    return node;
+}
+
+/**
+ * Compiles script text: a command line typed at the prompt, or a whole file
+ * @return the statements, NULL if the text has a syntax error or nothing to run
+ */
+struct script_node *compile_script(const char *text)
+{
+    struct script_parser parser = {0};
+    parser.segments = split_script(text, &parser.count, NULL);
+    const char *end;
+    struct script_node *script = compile_list(&parser, NULL, &end);
+    for (int i = 0; i < parser.count; i++)
+        shell_free(MEMORY_SCRIPT, parser.segments[i]);
+    shell_free(MEMORY_SCRIPT, parser.segments);
+    if (parser.failed)
+    {
+        free_script(script);
+        return NULL;
+    }
+    return script;
+}
+
+// aliases and functions, kept compiled in one table
+struct definition
+{
+    char *name; // NULL for an empty slot
+    struct token *alias; // words of an alias, NULL for a function
+    int alias_token_count;
+    struct function_body *function; // body of a function
+};
+
+void release_function_body(struct function_body *body)
+{
+    if (body == NULL || --body->references > 0)
+        return;
+    free_script(body->script);
+    shell_free(MEMORY_SCRIPT, body);
+}
+
+struct definition *definition_table;
+int definition_capacity = 0;
+int definition_count = 0;
+
+void add_available_command(const char *name);
+
+// finds an alias or function, create adds an empty definition if it is missing
+struct definition *definition_lookup(const char *name, bool create)
+{
+    if (definition_capacity == 0)
+    {
+        if (!create)
+            return NULL;
+        definition_capacity = 64;
+        definition_table = shell_calloc(MEMORY_SCRIPT, definition_capacity, sizeof(struct definition));
+    }
+    if (create && (definition_count + 1) * 2 > definition_capacity) // keep the load factor under 1/2
+    {
+        struct definition *old_table = definition_table;
+        int old_capacity = definition_capacity;
+        definition_capacity *= 2;
+        definition_table = shell_calloc(MEMORY_SCRIPT, definition_capacity, sizeof(struct definition));
+        for (int i = 0; i < old_capacity; i++)
+        {
+            if (old_table[i].name == NULL)
+                continue;
+            uint64_t slot = hash_string(old_table[i].name) & (definition_capacity - 1);
+            while (definition_table[slot].name != NULL)
+                slot = (slot + 1) & (definition_capacity - 1);
+            definition_table[slot] = old_table[i];
+        }
+        shell_free(MEMORY_SCRIPT, old_table);
+    }
+    uint64_t slot = hash_string(name) & (definition_capacity - 1);
+    while (definition_table[slot].name != NULL)
+    {
+        if (strcmp(definition_table[slot].name, name) == 0)
+            return &definition_table[slot];
+        slot = (slot + 1) & (definition_capacity - 1);
+    }
+    if (!create)
+        return NULL;
+    definition_table[slot].name = shell_strdup(MEMORY_SCRIPT, name);
+    definition_count++;
+    add_available_command(name);
+    return &definition_table[slot];
+}
+
+// drops the alias or the function body of a definition, keeping the slot
+void clear_definition(struct definition *definition)
+{
+    if (definition->alias != NULL)
+        free_tokens(definition->alias, definition->alias_token_count);
+    definition->alias = NULL;
+    definition->alias_token_count = 0;
+    release_function_body(definition->function); // a running call keeps its own reference
+    definition->function = NULL;
+}
+
+// removes a definition, later entries of its probe chain are moved up like in unset_variable
+void remove_definition(struct definition *definition)
+{
+    clear_definition(definition);
+    shell_free(MEMORY_SCRIPT, definition->name);
+    definition->name = NULL;
+    definition_count--;
+    uint64_t hole = definition - definition_table, slot = hole;
+    while (1)
+    {
+        slot = (slot + 1) & (definition_capacity - 1);
+        if (definition_table[slot].name == NULL)
+            break;
+        uint64_t home = hash_string(definition_table[slot].name) & (definition_capacity - 1);
+        if (((slot - home) & (definition_capacity - 1)) >= ((slot - hole) & (definition_capacity - 1)))
+        {
+            definition_table[hole] = definition_table[slot];
+            definition_table[slot].name = NULL;
+            hole = slot;
+        }
+    }
+}
+
+struct definition *find_alias(const char *name)
+{
+    struct definition *definition = definition_lookup(name, false);
+    return definition && definition->alias ? definition : NULL;
+}
+
+struct definition *find_function(const char *name)
+{
+    struct definition *definition = definition_lookup(name, false);
+    return definition && definition->function ? definition : NULL;
+}
+
+/**
+ * Copies compiled words, the ones that refer to variables are tokenized again
+ * from their source so they pick up the current values
+ * @param  out room for count tokens
+ * @return     number of tokens written, an empty unquoted expansion leaves none
+ */
+int copy_tokens(const struct token *compiled, int count, struct token *out)
+{
+    int written = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (compiled[i].source != NULL)
+        {
+            struct token *expanded;
+            int expanded_count = tokenize(compiled[i].source, &expanded, true);
+            if (expanded_count > 0) // the source is one word, values are not split
+                out[written++] = expanded[0];
+            shell_free(MEMORY_COMMAND, expanded);
+            continue;
+        }
+        out[written] = compiled[i];
+        out[written].text = shell_strdup(MEMORY_COMMAND, compiled[i].text);
+        out[written].pattern = compiled[i].pattern ? shell_strdup(MEMORY_COMMAND, compiled[i].pattern) : NULL;
+        out[written].prefix = compiled[i].prefix ? shell_strdup(MEMORY_COMMAND, compiled[i].prefix) : NULL;
+        written++;
+    }
+    return written;
+}
+
+#define ALIAS_MAX_DEPTH 16
+
+/**
+ * Replaces the command name of every stage with its alias, the words of an
+ * alias are spliced in as they were compiled. An alias whose first word is
+ * another alias is expanded again, but never twice by the same name
+ * @return the new token count, *tokens may be reallocated
+ */
+int expand_aliases(struct token **tokens, int token_count)
+{
+    if (definition_count == 0)
+        return token_count;
+    const char *expanded[ALIAS_MAX_DEPTH];
+    int depth = 0;
+    for (int i = 0; i < token_count; i++)
+    {
+        struct token *token = &(*tokens)[i];
+        bool stage_start = i == 0 || is_pipe_token(&(*tokens)[i - 1]);
+        if (!stage_start)
+        {
+            depth = 0;
+            continue;
+        }
+        struct definition *alias = token->quoted || token->substitution != SUBSTITUTION_NONE ? NULL : find_alias(token->text);
+        for (int j = 0; alias && j < depth; j++)
+            if (strcmp(expanded[j], alias->name) == 0)
+                alias = NULL;
+        if (alias == NULL || depth == ALIAS_MAX_DEPTH)
+        {
+            depth = 0;
+            continue;
+        }
+        expanded[depth++] = alias->name;
+        struct token *words = shell_malloc(MEMORY_COMMAND, sizeof(struct token) * (alias->alias_token_count + 1));
+        int word_count = copy_tokens(alias->alias, alias->alias_token_count, words);
+        *tokens = shell_realloc(MEMORY_COMMAND, *tokens, sizeof(struct token) * (token_count + word_count + 1));
+        token = &(*tokens)[i];
+        shell_free(MEMORY_COMMAND, token->text);
+        shell_free(MEMORY_COMMAND, token->pattern);
+        shell_free(MEMORY_COMMAND, token->source);
+        shell_free(MEMORY_COMMAND, token->prefix);
+        memmove(token + word_count, token + 1, sizeof(struct token) * (token_count - i - 1));
+        memcpy(token, words, sizeof(struct token) * word_count);
+        shell_free(MEMORY_COMMAND, words);
+        token_count += word_count - 1;
+        i--; // the first word of the alias may be an alias too
+    }
+    return token_count;
+}
+
+/**
+ * Runs the alias and unalias builtins that change the shell:
+ * alias NAME=VALUE... and unalias NAME..., plain alias and alias NAME print
+ * in the child. unset -f NAME... removes functions
+ * @return true if the command was one of them
+ */
+bool update_definitions(struct command_t *command)
+{
+    if (strcmp(command->name, "alias") == 0)
+    {
+        bool any = false;
+        for (int i = 0; i < command->arg_count; i++)
+            any |= strchr(command->args[i], '=') != NULL;
+        if (!any)
+            return false;
+        for (int i = 0; i < command->arg_count; i++)
+        {
+            char *equals = strchr(command->args[i], '=');
+            if (equals == NULL)
+                continue;
+            *equals = '\0';
+            struct definition *definition = definition_lookup(command->args[i], true);
+            clear_definition(definition);
+            definition->alias_token_count = tokenize(equals + 1, &definition->alias, false);
+            if (definition->alias == NULL) // alias x= has no words
+                definition->alias = shell_malloc(MEMORY_COMMAND, sizeof(struct token));
+            *equals = '=';
+        }
+        return true;
+    }
+    bool unalias = strcmp(command->name, "unalias") == 0;
+    bool unset_function = strcmp(command->name, "unset") == 0 && command->arg_count > 0 &&
+                          strcmp(command->args[0], "-f") == 0;
+    if (!unalias && !unset_function)
+        return false;
+    for (int i = unset_function; i < command->arg_count; i++)
+    {
+        struct definition *definition = unalias ? find_alias(command->args[i]) : find_function(command->args[i]);
+        if (definition != NULL)
+            remove_definition(definition);
+        else if (unalias)
+            fprintf(stderr, "-%s: unalias: %s: not found\n", sysname, command->args[i]);
+    }
+    return true;
+}
+
+int compare_definitions(const void *a, const void *b)
+{
+    return strcmp((*(struct definition *const *)a)->name, (*(struct definition *const *)b)->name);
+}
+
+// alias NAME='words' for the given names, or for every alias sorted by name
+int print_aliases(struct command_t *command)
+{
+    struct definition **aliases = malloc(sizeof(struct definition *) * (definition_count + 1));
+    int count = 0, status = SUCCESS;
+    if (command->arg_count > 0)
+    {
+        for (int i = 0; i < command->arg_count; i++)
+        {
+            if ((aliases[count] = find_alias(command->args[i])) != NULL)
+                count++;
+            else
+            {
+                fprintf(stderr, "-%s: alias: %s: not found\n", sysname, command->args[i]);
+                status = INVALID;
+            }
+        }
+    }
+    else
+    {
+        for (int i = 0; i < definition_capacity; i++)
+            if (definition_table[i].name != NULL && definition_table[i].alias != NULL)
+                aliases[count++] = &definition_table[i];
+        qsort(aliases, count, sizeof(struct definition *), compare_definitions);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        printf("alias %s='", aliases[i]->name);
+        for (int j = 0; j < aliases[i]->alias_token_count; j++)
+        {
+            struct token *word = &aliases[i]->alias[j];
+            const char *text = word->source ? word->source : word->text;
+            printf(j ? " %s" : "%s", text);
+        }
+        printf("'\n");
+    }
+    free(aliases);
+    return status;
+}
+
+uint64_t hash_string(const char *str)
+{
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (; *str; str++)
+    {
+        hash ^= (unsigned char)*str;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * Use count of a word weighted by how recently it was used, the base of the
+ * frecency bonus and of the eviction order
+ */
+unsigned int history_weight(const struct history_entry *entry, time_t now)
+{
+    time_t age = now - entry->last_used;
+    unsigned int weighted = entry->count * 4;
+    if (age > 3600)
+        weighted /= 2;
+    if (age > 86400)
+        weighted /= 2;
+    if (age > 7 * 86400)
+        weighted /= 2;
+    return weighted;
+}
+
+struct history_rank
+{
+    struct history_entry entry;
+    unsigned int weight;
+};
+
+// heaviest first, the most recently used first among equal weights
+int compare_history_ranks(const void *a, const void *b)
+{
+    const struct history_rank *x = a, *y = b;
+    if (x->weight != y->weight)
+        return x->weight < y->weight ? 1 : -1;
+    return (x->entry.last_used < y->entry.last_used) - (x->entry.last_used > y->entry.last_used);
+}
+
+/**
+ * Keeps the table of a long session bounded: forgets the least frecent words
+ * down to three quarters of HISTORY_MAX_WORDS, so it runs once per quarter of new words
+ */
+void history_evict()
+{
+    time_t now = time(NULL);
+    struct history_rank *ranks = shell_malloc(MEMORY_HISTORY, sizeof(struct history_rank) * history_size);
+    int count = 0;
+    for (int i = 0; i < history_capacity; i++)
+        if (history_table[i].word != NULL)
+            ranks[count++] = (struct history_rank){history_table[i], history_weight(&history_table[i], now)};
+    qsort(ranks, count, sizeof(struct history_rank), compare_history_ranks);
+
+    memset(history_table, 0, sizeof(struct history_entry) * history_capacity);
+    history_size = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (i >= HISTORY_MAX_WORDS * 3 / 4)
+        {
+            shell_free(MEMORY_HISTORY, ranks[i].entry.word);
+            continue;
+        }
+        uint64_t slot = hash_string(ranks[i].entry.word) & (history_capacity - 1);
+        while (history_table[slot].word != NULL)
+            slot = (slot + 1) & (history_capacity - 1);
+        history_table[slot] = ranks[i].entry;
+        history_size++;
+    }
+    shell_free(MEMORY_HISTORY, ranks);
+}
+
+struct history_entry *history_lookup(const char *word, bool create)
+{
+    if (create && history_size >= HISTORY_MAX_WORDS)
+        history_evict();
+    if (history_capacity == 0)
+    {
+        if (!create)
+            return NULL;
+        history_capacity = 1024;
+        history_table = shell_calloc(MEMORY_HISTORY, history_capacity, sizeof(struct history_entry));
+    }
+    if (create && (history_size + 1) * 2 > history_capacity) // keep the load factor under 1/2
+    {
+        struct history_entry *old_table = history_table;
+        int old_capacity = history_capacity;
+        history_capacity *= 2;
+        history_table = shell_calloc(MEMORY_HISTORY, history_capacity, sizeof(struct history_entry));
+        for (int i = 0; i < old_capacity; i++)
+        {
+            if (old_table[i].word == NULL)
+                continue;
+            uint64_t slot = hash_string(old_table[i].word) & (history_capacity - 1);
+            while (history_table[slot].word != NULL)
+                slot = (slot + 1) & (history_capacity - 1);
+            history_table[slot] = old_table[i];
+        }
+        shell_free(MEMORY_HISTORY, old_table);
+    }
+    uint64_t slot = hash_string(word) & (history_capacity - 1);
+    while (history_table[slot].word != NULL)
+    {
+        if (strcmp(history_table[slot].word, word) == 0)
+            return &history_table[slot];
+        slot = (slot + 1) & (history_capacity - 1);
+    }
+    if (!create)
+        return NULL;
+    history_table[slot].word = shell_strdup(MEMORY_HISTORY, word);
+    history_size++;
+    return &history_table[slot];
+}
+
+// counts the command names and arguments of an executed pipeline
+void record_history(struct command_t *command)
+{
+    time_t now = time(NULL);
+    for (; command; command = command->next)
+    {
+        if (command->name == NULL || command->name[0] == '\0')
+            continue;
+        struct history_entry *entry = history_lookup(command->name, true);
+        entry->count++;
+        entry->last_used = now;
+        for (int i = 0; i < command->arg_count; i++)
+        {
+            entry = history_lookup(command->args[i], true);
+            entry->count++;
+            entry->last_used = now;
+        }
+    }
+}
+
+/**
+ * Frecency bonus of a word: use count weighted by how recently it was used,
+ * folded into a small logarithmic score so it breaks ties between good matches
+ */
+int frecency_bonus(const char *word)
+{
+    struct history_entry *entry = history_lookup(word, false);
+    if (entry == NULL)
+        return 0;
+    unsigned int weighted = history_weight(entry, time(NULL));
+    int bonus = 0;
+    while (weighted > 0 && bonus < 48)
+    {
+        bonus += 8;
+        weighted >>= 1;
+    }
+    return bonus;
+}
+
+int fuzzy_char_bit(unsigned char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        c += 'a' - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a';
+    if (c >= '0' && c <= '9')
+        return 26 + c - '0';
+    return 36 + c % 28;
+}
+
+/**
+ * Set of characters in a string, one bit per letter or digit.
+ * A candidate can only match if it has every bit of the pattern, so a single
+ * AND rejects most candidates before the scorer looks at them
+ */
+uint64_t fuzzy_char_mask(const char *str)
+{
+    uint64_t mask = 0;
+    for (; *str; str++)
+        mask |= 1ull << fuzzy_char_bit(*str);
+    return mask;
+}
+
+static inline int fuzzy_char_equal(char a, char b)
+{
+    if (a >= 'A' && a <= 'Z')
+        a += 'a' - 'A';
+    if (b >= 'A' && b <= 'Z')
+        b += 'a' - 'A';
+    return a == b;
+}
+
+static inline int fuzzy_is_boundary(char c)
+{
+    return c == '_' || c == '-' || c == '.' || c == '/' || c == ' ';
+}
+
+/**
+ * Scores pattern as a case-insensitive subsequence of candidate, fzf v1 style:
+ * find the first occurrence, shrink it from the back to the tightest window,
+ * then reward consecutive and word-boundary matches and penalize gaps
+ * @return score, or -1 if the pattern is not a subsequence
+ */
+int fuzzy_score(const char *pattern, const char *candidate)
+{
+    int pattern_len = strlen(pattern);
+    if (pattern_len == 0)
+        return 0;
+
+    int pattern_index = 0, end = -1, i;
+    for (i = 0; candidate[i]; i++)
+    {
+        if (fuzzy_char_equal(candidate[i], pattern[pattern_index]) && ++pattern_index == pattern_len)
+        {
+            end = i;
+            break;
+        }
+    }
+    if (end == -1)
+        return -1;
+
+    int start = end;
+    pattern_index = pattern_len - 1;
+    for (i = end; i >= 0; i--)
+    {
+        if (fuzzy_char_equal(candidate[i], pattern[pattern_index]) && pattern_index-- == 0)
+        {
+            start = i;
+            break;
+        }
+    }
+
+    int score = 0, previous_match = -2;
+    pattern_index = 0;
+    for (i = start; i <= end; i++)
+    {
+        if (pattern_index < pattern_len && fuzzy_char_equal(candidate[i], pattern[pattern_index]))
+        {
+            score += 16;
+            if (i == previous_match + 1)
+                score += 8; // consecutive
+            if (i == 0 || fuzzy_is_boundary(candidate[i - 1]))
+                score += 8; // start of a word
+            previous_match = i;
+            pattern_index++;
+        }
+        else
+            score -= 2; // gap inside the match
+    }
+    if (start == 0)
+        score += 16;
+    return score - (int)(strlen(candidate) - pattern_len) / 8; // shorter candidates first
+}
+
+struct ranked_candidate
+{
+    const char *text;
+    const char *description;
+    int score;
+    bool prefix;
+};
+
+int compare_ranked_candidates(const void *a, const void *b)
+{
+    const struct ranked_candidate *x = a, *y = b;
+    if (x->prefix != y->prefix)
+        return y->prefix - x->prefix;
+    if (x->score != y->score)
+        return y->score - x->score;
+    return strcmp(x->text, y->text);
+}
+
+/**
+ * Adds a candidate to the ranking if it fuzzy-matches the input
+ * @param candidates   growable array of candidates
+ * @param count        number of candidates
+ * @param capacity     allocated size of candidates
+ * @param input_str    typed pattern
+ * @param pattern_mask fuzzy_char_mask of input_str
+ * @param text         candidate text, must outlive the ranking
+ * @param mask         fuzzy_char_mask of text
+ */
+void rank_candidate(struct ranked_candidate **candidates, int *count, int *capacity, const char *input_str,
+                    uint64_t pattern_mask, const char *text, uint64_t mask)
+{
+    if ((pattern_mask & ~mask) != 0)
+        return;
+    int score = fuzzy_score(input_str, text);
+    if (score < 0)
+        return;
+    if (*count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *candidates = shell_realloc(MEMORY_COMPLETION, *candidates, *capacity * sizeof(struct ranked_candidate));
+    }
+    (*candidates)[*count].text = text;
+    (*candidates)[*count].description = NULL;
+    (*candidates)[*count].score = score + frecency_bonus(text);
+    (*candidates)[*count].prefix = strncmp(text, input_str, strlen(input_str)) == 0;
+    (*count)++;
+}
+
+// sorts the ranked candidates and copies them into an autocomplete_match
+struct autocomplete_match *ranked_candidates_to_match(struct ranked_candidate *candidates, int count)
+{
+    struct autocomplete_match *match = shell_malloc(MEMORY_COMPLETION, sizeof(struct autocomplete_match));
+    memset(match, 0, sizeof(struct autocomplete_match)); // set all bytes to 0
+    qsort(candidates, count, sizeof(struct ranked_candidate), compare_ranked_candidates);
+    if (count > 0)
+        match->matches = (char **)shell_malloc(MEMORY_COMPLETION, sizeof(char *) * count);
+    if (count > 0 && candidates[0].description != NULL)
+        match->descriptions = (char **)shell_calloc(MEMORY_COMPLETION, count + 1, sizeof(char *));
+    for (int i = 0; i < count; i++)
+    {
+        match->matches[i] = shell_strdup(MEMORY_COMPLETION, candidates[i].text);
+        if (match->descriptions)
+            match->descriptions[i] = shell_strdup(MEMORY_COMPLETION, candidates[i].description ? candidates[i].description : "");
+        if (candidates[i].prefix)
+            match->prefix_count++;
+    }
+    match->match_count = count;
+    return match;
+}
+
+void completion_specs_init()
+{
+    for (int i = 0; i < sizeof(completion_specs) / sizeof(completion_specs[0]); i++)
+    {
+        uint64_t slot = hash_string(completion_specs[i].command) & (COMPLETION_SPEC_TABLE_SIZE - 1);
+        while (completion_spec_table[slot] != NULL)
+            slot = (slot + 1) & (COMPLETION_SPEC_TABLE_SIZE - 1);
+        completion_spec_table[slot] = &completion_specs[i];
+    }
+}
+
+struct completion_spec *find_completion_spec(const char *command)
+{
+    uint64_t slot = hash_string(command) & (COMPLETION_SPEC_TABLE_SIZE - 1);
+    while (completion_spec_table[slot] != NULL)
+    {
+        if (strcmp(completion_spec_table[slot]->command, command) == 0)
+            return completion_spec_table[slot];
+        slot = (slot + 1) & (COMPLETION_SPEC_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+// completion kind of the argument at arg_index, commands without a spec complete files
+enum completion_kind completion_kind_for(const char *command, int arg_index)
+{
+    if (arg_index < 0)
+        return COMPLETE_COMMAND;
+    struct completion_spec *spec = find_completion_spec(command);
+    if (spec == NULL)
+        return COMPLETE_FILE;
+    if (arg_index >= spec->arg_kind_count)
+        return spec->arg_kinds[spec->arg_kind_count - 1];
+    return spec->arg_kinds[arg_index];
+}
+
+/**
+ * Finds the command of the pipeline stage under the cursor and the index of
+ * the argument being typed, in a single pass over the input
+ * @param buf     input line
+ * @param index   cursor position
+ * @param context filled with the result
+ */
+void parse_completion_context(const char *buf, int index, struct completion_context *context)
+{
+    int word_count = 0;
+    context->command[0] = '\0';
+    for (int i = 0; i < index;)
+    {
+        while (i < index && (buf[i] == ' ' || buf[i] == '\t'))
+            i++;
+        if (i == index)
+            break;
+        int start = i;
+        while (i < index && buf[i] != ' ' && buf[i] != '\t')
+            i++;
+        int len = i - start;
+        if (len == 1 && buf[start] == '|')
+        {
+            word_count = 0; // next stage starts
+            continue;
+        }
+        if (i == index)
+            break; // the word under the cursor is not counted
+        // the time prefix completes like the command it runs
+        if (word_count == 0 && len == 4 && strncmp(buf + start, "time", 4) == 0)
+            continue;
+        if (word_count == 0)
+            snprintf(context->command, sizeof(context->command), "%.*s", len, buf + start);
+        word_count++;
+    }
+    context->word_start = current_word_start(buf, index);
+    context->arg_index = word_count - 1;
+}
+
+/**
+ * Refreshes the process list used by pid completion and psvis --watch, only processes of this user
+ * @param force re-read /proc even if the list is less than a second old
+ */
+void refresh_proc_snapshot(bool force)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!force && proc_snapshot != NULL && elapsed_seconds(&proc_snapshot_time, &now) < 1)
+        return;
+    proc_snapshot_time = now;
+    proc_snapshot_count = 0;
+    int capacity = 0;
+
+    DIR *directory = opendir("/proc");
+    struct dirent *directory_entry;
+    uid_t uid = getuid();
+    char path[64];
+    struct stat proc_stat;
+    if (directory == NULL)
+        return;
+    while ((directory_entry = readdir(directory)) != NULL)
+    {
+        pid_t pid = strtol(directory_entry->d_name, NULL, 10);
+        if (pid <= 0)
+            continue;
+        snprintf(path, sizeof(path), "/proc/%d", (int)pid);
+        if (uid != 0 && (stat(path, &proc_stat) != 0 || proc_stat.st_uid != uid))
+            continue;
+        if (proc_snapshot_count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            proc_snapshot = shell_realloc(MEMORY_COMPLETION, proc_snapshot, capacity * sizeof(struct proc_snapshot_entry));
+        }
+        struct proc_snapshot_entry *entry = &proc_snapshot[proc_snapshot_count];
+        entry->pid = pid;
+        entry->name[0] = '\0';
+        // stat is "pid (comm) state ppid ...", comm may contain spaces and parentheses
+        char stat_line[256];
+        int ppid = 0;
+        snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            continue;
+        ssize_t n = read(fd, stat_line, sizeof(stat_line) - 1);
+        close(fd);
+        stat_line[n > 0 ? n : 0] = '\0';
+        char *name_start = strchr(stat_line, '(');
+        char *name_end = strrchr(stat_line, ')');
+        if (name_start == NULL || name_end == NULL || name_end < name_start)
+            continue;
+        sscanf(name_end + 1, " %*c %d", &ppid);
+        if (pid == 2 || ppid == 2) // kernel threads
+            continue;
+        entry->ppid = ppid;
+        snprintf(entry->name, sizeof(entry->name), "%.*s", (int)(name_end - name_start - 1), name_start + 1);
+        proc_snapshot_count++;
+    }
+    closedir(directory);
+}
+
+/**
+ * Completes a pid: digits match pids by prefix, anything else is fuzzy matched
+ * against the process names. Jobs of this shell come first
+ * @param  input_str typed part of the argument
+ * @return           pids, described by their process names
+ */
+struct autocomplete_match *pid_autocomplete(const char *input_str)
+{
+    refresh_proc_snapshot(false);
+    int digits = input_str[0] != '\0' && strspn(input_str, "0123456789") == strlen(input_str);
+    struct ranked_candidate *candidates = shell_malloc(MEMORY_COMPLETION, sizeof(struct ranked_candidate) * (job_count + proc_snapshot_count + 1));
+    char (*pid_texts)[16] = shell_malloc(MEMORY_COMPLETION, sizeof(*pid_texts) * (job_count + proc_snapshot_count + 1));
+    int count = 0;
+
+    for (int i = 0; i < job_count + proc_snapshot_count; i++)
+    {
+        bool is_job = i < job_count;
+        pid_t pid = is_job ? job_table[i].pid : proc_snapshot[i - job_count].pid;
+        const char *name = is_job ? job_table[i].name : proc_snapshot[i - job_count].name;
+        if (!is_job && pid == getpid())
+            continue;
+        bool duplicate = false;
+        for (int j = 0; j < job_count && !is_job; j++)
+            duplicate |= job_table[j].pid == pid;
+        if (duplicate)
+            continue;
+
+        snprintf(pid_texts[count], sizeof(pid_texts[count]), "%d", (int)pid);
+        int score;
+        if (digits || input_str[0] == '\0') // newest processes first
+            score = strncmp(pid_texts[count], input_str, strlen(input_str)) == 0 ? pid : -1;
+        else
+            score = fuzzy_score(input_str, name);
+        if (score < 0)
+            continue;
+        candidates[count].text = pid_texts[count];
+        candidates[count].description = name;
+        candidates[count].score = score;
+        candidates[count].prefix = is_job; // jobs are ranked ahead of other processes
+        count++;
+    }
+
+    struct autocomplete_match *match = ranked_candidates_to_match(candidates, count);
+    match->prefix_count = 0; // pids are never completed without a choice unless unique
+    shell_free(MEMORY_COMPLETION, candidates);
+    shell_free(MEMORY_COMPLETION, pid_texts);
+    return match;
+}
+
+// suggests alarm times (HH.MM) for the next five-minute marks and the next hours
+struct autocomplete_match *time_autocomplete(const char *input_str)
+{
+    const int offsets[] = {5, 15, 30, 60, 120};
+    struct ranked_candidate candidates[sizeof(offsets) / sizeof(offsets[0])];
+    char texts[sizeof(offsets) / sizeof(offsets[0])][8], descriptions[sizeof(offsets) / sizeof(offsets[0])][32];
+    int count = 0;
+    time_t now = time(NULL);
+    struct tm local;
+    for (int i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++)
+    {
+        time_t at = now + offsets[i] * 60;
+        at -= at % 300; // round down to five minutes
+        localtime_r(&at, &local);
+        snprintf(texts[count], sizeof(texts[count]), "%02d.%02d", local.tm_hour, local.tm_min);
+        if (strncmp(texts[count], input_str, strlen(input_str)) != 0)
+            continue;
+        snprintf(descriptions[count], sizeof(descriptions[count]), "in about %d min", offsets[i]);
+        candidates[count].text = texts[count];
+        candidates[count].description = descriptions[count];
+        candidates[count].score = -i; // keep chronological order
+        candidates[count].prefix = false;
+        count++;
+    }
+    return ranked_candidates_to_match(candidates, count);
+}
+
+// start of the word under the cursor
+int current_word_start(const char *buf, int index)
+{
+    int start = index;
+    while (start > 0 && buf[start - 1] != ' ' && buf[start - 1] != '\t')
+        start--;
+    return start;
+}
+
+void prompt_backspace();
+
+// replaces the word under the cursor with replacement, on screen and in buf
+void replace_current_word(char *buf, int *index, int word_start, const char *replacement)
+{
+    while (*index > word_start)
+    {
+        prompt_backspace();
+        (*index)--;
+    }
+    for (int i = 0; replacement[i] && *index < 4096 - 2; i++)
+    {
+        putchar(replacement[i]); // echo the character
+        buf[(*index)++] = replacement[i];
+    }
+    buf[*index] = '\0';
+}
+
+void write_all(int fd, const char *data, size_t length);
+
+// shows question under the list and reads the answer, true to go on
+bool ask_completion_menu(const char *question)
+{
+    write(STDOUT_FILENO, question, strlen(question));
+    int c;
+    while ((c = read_key()) == KEY_PROMPT_REFRESH)
+        ;
+    write(STDOUT_FILENO, "\r\x1b[K", 4);
+    return c == ' ' || c == 'y' || c == 'Y' || c == '\n';
+}
+
+/**
+ * Lists the candidates under the prompt in columns, filled row by row so the
+ * best ranked ones are on the first page, then draws the prompt again. Every page goes out in a single
+ * write, a terminal asks before a long list and after every full page
+ * @param match candidates, the first tab after the list selects the first one
+ * @param buf   current input, drawn again after the prompt
+ * @param index length of the input
+ */
+void show_completion_menu(struct autocomplete_match *match, const char *buf, int index)
+{
+    const struct winsize *window = current_terminal_size();
+    bool interactive = isatty(STDIN_FILENO);
+    int count = match->match_count;
+    char entry[512];
+    fflush(stdout);
+
+    bool listed = true, new_line = false;
+    if (interactive && count > COMPLETION_MENU_QUERY_ITEMS)
+    {
+        snprintf(entry, sizeof(entry), "\nDisplay all %d possibilities? (y or n)", count);
+        listed = ask_completion_menu(entry);
+        new_line = true; // the question was cleared, the cursor is under the input
+    }
+
+    if (listed)
+    {
+        // two spaces separate the columns, a few very long names do not force a single
+        // column: cells are at most a third of the terminal and longer entries end in ~
+        int cell = 0, widest = window->ws_col / 3 > 16 ? window->ws_col / 3 : window->ws_col;
+        for (int i = 0; i < count; i++)
+        {
+            int length = strlen(match->matches[i]);
+            if (match->descriptions && match->descriptions[i][0])
+                length += 2 + strlen(match->descriptions[i]);
+            if (length + 2 > cell)
+                cell = length + 2;
+        }
+        if (cell > widest)
+            cell = widest;
+        int columns = window->ws_col / cell > 0 ? window->ws_col / cell : 1;
+        int rows = (count + columns - 1) / columns;
+        int page_rows = interactive && window->ws_row > 2 ? window->ws_row - 1 : rows;
+
+        char *page = malloc((size_t)page_rows * (window->ws_col + 1) + 2);
+        size_t length = 0;
+        if (!new_line)
+            page[length++] = '\n';
+        for (int row = 0; row < rows;)
+        {
+            for (int page_row = 0; page_row < page_rows && row < rows; page_row++, row++)
+            {
+                for (int column = 0; column < columns; column++)
+                {
+                    int i = row * columns + column;
+                    if (i >= count)
+                        break;
+                    if (match->descriptions && match->descriptions[i][0])
+                        snprintf(entry, sizeof(entry), "%s  %s", match->matches[i], match->descriptions[i]);
+                    else
+                        snprintf(entry, sizeof(entry), "%s", match->matches[i]);
+                    int fits = cell > 2 ? cell - 2 : cell;
+                    if (strlen(entry) > fits)
+                        strcpy(entry + fits - 1, "~");
+                    bool last = column == columns - 1 || i + 1 == count;
+                    length += sprintf(page + length, "%-*s", last ? 0 : cell, entry);
+                }
+                page[length++] = '\n';
+            }
+            write_all(STDOUT_FILENO, page, length);
+            length = 0;
+            if (row < rows && !ask_completion_menu("--More--"))
+                break;
+        }
+        free(page);
+    }
+    show_prompt();
+    printf("%.*s", index, buf);
+}
+
+void prompt_backspace()
+{
+    putchar(8);   // go back 1
+    putchar(' '); // write empty over
+    putchar(8);   // go back 1 again
+}
+
+/**
+ * Reads one continuation line of a block or here-document behind a "> " prompt, with echo and backspace
+ * @param  buf  filled with the line, without the newline
+ * @param  size size of buf
+ * @return      length of the line, -1 at end of input
+ */
+int read_continuation_line(char *buf, int size)
+{
+    int index = 0;
+    printf("> ");
+    fflush(stdout);
+    while (1)
+    {
+        int c = read_key();
+        if (c == KEY_PROMPT_REFRESH)
+            continue;
+        if (c == EOF || (c == 4 && index == 0)) // Ctrl+D
+        {
+            if (index == 0)
+                return -1;
+            break;
+        }
+        if (c == 127)
+        {
+            if (index > 0)
+            {
+                prompt_backspace();
+                index--;
+            }
+            continue;
+        }
+        putchar(c);
+        if (c == '\n')
+            break;
+        if (index < size - 1)
+            buf[index++] = c;
+    }
+    buf[index] = '\0';
+    return index;
+}
+
+/**
+ * Prompt a command from the user
+ * @param  buf      [description]
+ * @param  buf_size [description]
+ * @return          [description]
+ */
+int prompt(struct command_t *command)
+{
+    int index = 0;
+    int c;
+    char buf[4096];
+    static char oldbuf[4096];
+    struct completion_menu menu = {NULL, 0, 0};
+
+    // tcgetattr gets the parameters of the current terminal
+    // STDIN_FILENO will tell tcgetattr that it should write the settings
     // of stdin to oldt
     static struct termios backup_termios, new_termios;
     tcgetattr(STDIN_FILENO, &backup_termios);
@@ -356,299 +3824,2507 @@ int prompt(struct command_t *command)
     // TCSANOW tells tcsetattr to change attributes immediately.
     tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
 
-    //FIXME: backspace is applied before printing chars
-    show_prompt();
-    int multicode_state = 0;
-    buf[0] = 0;
-    while (1)
+    //FIXME: backspace is applied before printing chars
+    uint64_t trace_start = trace_now();
+    show_prompt();
+    trace_record(TRACE_PROMPT, trace_start);
+    int multicode_state = 0;
+    buf[0] = 0;
+    while (1)
+    {
+        c = read_key();
+        // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+        if (c == KEY_PROMPT_REFRESH)
+        {
+            refresh_prompt_line(buf, index);
+            continue;
+        }
+        if (c == EOF || c == 4) // end of a scripted session or Ctrl+D
+        {
+            if (c == 4)
+                putchar(c);
+            if (menu.match != NULL)
+                free_autocomplete_match(menu.match);
+            tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+            return EXIT;
+        }
+        if (c == 9) // handle tab
+        {
+            if (index == 0)
+            {
+                continue;
+            }
+            uint64_t completion_start = trace_now();
+            buf[index] = '\0';
+
+            // tab again while the menu is open selects the next candidate
+            if (menu.match != NULL)
+            {
+                menu.selected = (menu.selected + 1) % menu.match->match_count;
+                replace_current_word(buf, &index, menu.word_start, menu.match->matches[menu.selected]);
+                trace_record(TRACE_COMPLETION, completion_start);
+                continue;
+            }
+
+            struct autocomplete_match *match;
+            struct completion_context context;
+            parse_completion_context(buf, index, &context);
+            int word_start = context.word_start;
+
+            switch (completion_kind_for(context.command, context.arg_index))
+            {
+            case COMPLETE_COMMAND:
+                match = shellgibi_autocomplete(buf + word_start);
+                break;
+            case COMPLETE_DIRECTORY:
+                match = directory_autocomplete(buf + word_start);
+                break;
+            case COMPLETE_PID:
+                match = pid_autocomplete(buf + word_start);
+                break;
+            case COMPLETE_TIME:
+                match = time_autocomplete(buf + word_start);
+                break;
+            case COMPLETE_NONE:
+                match = shell_calloc(MEMORY_COMPLETION, 1, sizeof(struct autocomplete_match));
+                break;
+            default:
+                match = filename_autocomplete(buf + word_start);
+            }
+
+            // a single candidate, or a single prefix match, is completed directly
+            if (match->match_count == 1 || match->prefix_count == 1)
+            {
+                replace_current_word(buf, &index, word_start, match->matches[0]);
+                c = ' ';
+            }
+            else if (match->match_count > 1)
+            {
+                show_completion_menu(match, buf, index);
+                menu.match = match;
+                menu.selected = -1;
+                menu.word_start = word_start;
+            }
+            if (menu.match != match)
+                free_autocomplete_match(match);
+            trace_record(TRACE_COMPLETION, completion_start);
+            if (c == 9)
+            {
+                continue;
+            }
+        }
+        else if (menu.match != NULL) // any other key accepts the selected candidate
+        {
+            free_autocomplete_match(menu.match);
+            menu.match = NULL;
+        }
+
+        if (c == 127) // handle backspace
+        {
+            if (index > 0)
+            {
+                prompt_backspace();
+                index--;
+            }
+            continue;
+        }
+        if (c == 27 && multicode_state == 0) // handle multi-code keys
+        {
+            multicode_state = 1;
+            continue;
+        }
+        if (c == 91 && multicode_state == 1)
+        {
+            multicode_state = 2;
+            continue;
+        }
+        if (c == 65 && multicode_state == 2) // up arrow
+        {
+            int i;
+            while (index > 0)
+            {
+                prompt_backspace();
+                index--;
+            }
+            for (i = 0; oldbuf[i]; ++i)
+            {
+                putchar(oldbuf[i]);
+                buf[i] = oldbuf[i];
+            }
+            index = i;
+            multicode_state = 0;
+            continue;
+        }
+
+        putchar(c); // echo the character
+        buf[index++] = c;
+        if (index >= sizeof(buf) - 1)
+            break;
+        if (c == '\n') // enter key
+            break;
+    }
+    if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
+        index--;
+    buf[index] = '\0'; // null terminate string
+    fflush(stdout);    // echoed input goes out before the command's output
+
+    strcpy(oldbuf, buf);
+
+    // a block or a here-document goes on over the following lines until it is closed
+    char *block = NULL;
+    if ((starts_block(buf) || is_compound_line(buf)) && block_depth(buf) > 0)
+    {
+        char line[4096];
+        size_t length = strlen(buf);
+        block = strdup(buf);
+        while (block_depth(block) > 0 && read_continuation_line(line, sizeof(line)) != -1)
+        {
+            block = realloc(block, length + strlen(line) + 2);
+            length += sprintf(block + length, "\n%s", line);
+        }
+        fflush(stdout);
+    }
+
+    trace_start = trace_now();
+    parse_command(block ? block : buf, command);
+    trace_record(TRACE_PARSE, trace_start);
+    free(block);
+
+    // print_command(command); // DEBUG: uncomment for debugging
+
+    // restore the old settings
+    tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+    return SUCCESS;
+}
+
+int qstrcmp(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// releases the command index, every entry is a heap copy
+void free_available_commands()
+{
+    for (int i = 0; i < number_of_available_commands; i++)
+        shell_free(MEMORY_COMPLETION, all_available_commands[i]);
+    shell_free(MEMORY_COMPLETION, all_available_commands);
+    shell_free(MEMORY_COMPLETION, all_available_command_masks);
+    all_available_commands = NULL;
+    all_available_command_masks = NULL;
+    number_of_available_commands = 0;
+}
+
+void load_all_available_commands()
+{
+    free_available_commands();
+    char *path = shell_strdup(MEMORY_COMPLETION, getenv("PATH"));
+    int total_number_of_executables = sizeof(shellgibi_builtin_commands) / sizeof(shellgibi_builtin_commands[0]);
+    all_available_commands = shell_malloc(MEMORY_COMPLETION, total_number_of_executables * sizeof(char *));
+    for (int i = 0; i < total_number_of_executables; i++)
+        all_available_commands[i] = shell_strdup(MEMORY_COMPLETION, shellgibi_builtin_commands[i]);
+    int capacity = total_number_of_executables;
+
+    char *path_tokenizer = strtok(path, ":");
+    while (path_tokenizer != NULL)
+    {
+        DIR *directory;
+        struct dirent *directory_entry;
+        directory = opendir(path_tokenizer);
+        if (directory)
+        {
+            while ((directory_entry = readdir(directory)) != NULL)
+            {
+                if (directory_entry->d_name[0] == '.')
+                {
+                    continue;
+                }
+                char full_path[strlen(path_tokenizer) + strlen(directory_entry->d_name) + 2];
+                combine_path(full_path, path_tokenizer, directory_entry->d_name);
+                if (access(full_path, X_OK) != 0)
+                    continue;
+                // grow geometrically, PATH directories can hold more than 64k executables
+                if (total_number_of_executables == capacity)
+                {
+                    capacity *= 2;
+                    all_available_commands = shell_realloc(MEMORY_COMPLETION, all_available_commands, capacity * sizeof(char *));
+                }
+                all_available_commands[total_number_of_executables++] = shell_strdup(MEMORY_COMPLETION, directory_entry->d_name);
+            }
+            closedir(directory);
+        }
+        path_tokenizer = strtok(NULL, ":");
+    }
+    shell_free(MEMORY_COMPLETION, path);
+
+    qsort(all_available_commands, total_number_of_executables, sizeof(char *), qstrcmp);
+
+    int unique_number_of_executables = 1;
+    for (int i = 1; i < total_number_of_executables; i++)
+    {
+        if (strcmp(all_available_commands[i], all_available_commands[unique_number_of_executables - 1]) != 0)
+        {
+            all_available_commands[unique_number_of_executables++] = all_available_commands[i];
+        }
+        else
+            shell_free(MEMORY_COMPLETION, all_available_commands[i]);
+    }
+    all_available_commands = shell_realloc(MEMORY_COMPLETION, all_available_commands, sizeof(char *) * unique_number_of_executables);
+    number_of_available_commands = unique_number_of_executables;
+
+    all_available_command_masks = shell_malloc(MEMORY_COMPLETION, sizeof(uint64_t) * unique_number_of_executables);
+    for (int i = 0; i < unique_number_of_executables; i++)
+        all_available_command_masks[i] = fuzzy_char_mask(all_available_commands[i]);
+}
+
+// adds an alias or function name to the completion index, kept sorted
+void add_available_command(const char *name)
+{
+    int low = 0, high = number_of_available_commands;
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        if (strcmp(all_available_commands[middle], name) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if (low < number_of_available_commands && strcmp(all_available_commands[low], name) == 0)
+        return;
+    all_available_commands = shell_realloc(MEMORY_COMPLETION, all_available_commands, sizeof(char *) * (number_of_available_commands + 1));
+    all_available_command_masks = shell_realloc(MEMORY_COMPLETION, all_available_command_masks, sizeof(uint64_t) * (number_of_available_commands + 1));
+    memmove(all_available_commands + low + 1, all_available_commands + low,
+            sizeof(char *) * (number_of_available_commands - low));
+    memmove(all_available_command_masks + low + 1, all_available_command_masks + low,
+            sizeof(uint64_t) * (number_of_available_commands - low));
+    all_available_commands[low] = shell_strdup(MEMORY_COMPLETION, name);
+    all_available_command_masks[low] = fuzzy_char_mask(name);
+    number_of_available_commands++;
+}
+
+int process_command(struct command_t *command, int parent_to_child_pipe[2]);
+
+int execute_command(struct command_t *command);
+
+int execv_command(struct command_t *command);
+
+int execvp_command(struct command_t *command);
+
+int process_command_child(struct command_t *command, const int *child_to_parent_pipe);
+
+double elapsed_seconds(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Waits for a foreground stage and records its wall time and rusage
+ * @param command stage that was forked
+ * @param pid     pid of the forked stage
+ * @param started CLOCK_MONOTONIC timestamp taken right before fork
+ */
+void wait_for_stage(struct command_t *command, pid_t pid, const struct timespec *started)
+{
+    struct timespec finished;
+    int status = 0;
+    memset(&command->stats, 0, sizeof(command->stats));
+    if (wait4(pid, &status, 0, &command->stats.usage) == -1)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    command->stats.collected = true;
+    command->stats.pid = pid;
+    command->stats.status = status;
+    command->stats.wall_seconds = elapsed_seconds(started, &finished);
+    last_exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// group holding the job groups of this shell, created on first use
+char cgroup_container[PATH_MAX];
+int job_cgroup_count = 0;
+
+// writes value to a control file of a cgroup directory, prints a warning on failure
+int write_cgroup_file(int dir_fd, const char *file, const char *value)
+{
+    int fd = openat(dir_fd, file, O_WRONLY | O_CLOEXEC);
+    if (fd == -1 || write(fd, value, strlen(value)) == -1)
+    {
+        fprintf(stderr, "-%s: limit: %s: %s\n", sysname, file, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * Finds the cgroup this shell is in: SHELLGIBI_CGROUP if set, otherwise the
+ * cgroup2 mount from /proc/self/mountinfo joined with the 0:: line of
+ * /proc/self/cgroup. The group must be delegated to the user
+ * @return 0, or -1 if there is no cgroup v2 hierarchy
+ */
+int find_own_cgroup(char *path, size_t size)
+{
+    const char *configured = getenv("SHELLGIBI_CGROUP");
+    if (configured != NULL && *configured)
+    {
+        snprintf(path, size, "%s", configured);
+        return 0;
+    }
+    char line[1024], mount_point[PATH_MAX] = "", own[PATH_MAX] = "";
+    FILE *mounts = fopen("/proc/self/mountinfo", "r");
+    if (mounts == NULL)
+        return -1;
+    // id parent major:minor root mount-point options ... - fstype source options
+    while (fgets(line, sizeof(line), mounts))
+    {
+        char *separator = strstr(line, " - cgroup2 ");
+        if (separator != NULL && sscanf(line, "%*s %*s %*s %*s %4095s", mount_point) == 1)
+            break;
+        mount_point[0] = '\0';
+    }
+    fclose(mounts);
+    FILE *groups = fopen("/proc/self/cgroup", "r");
+    if (groups == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), groups))
+        if (strncmp(line, "0::", 3) == 0)
+            sscanf(line + 3, "%4095s", own);
+    fclose(groups);
+    if (mount_point[0] == '\0' || own[0] == '\0')
+        return -1;
+    snprintf(path, size, "%s%s", mount_point, strcmp(own, "/") == 0 ? "" : own);
+    return 0;
+}
+
+/**
+ * Creates a cgroup v2 group for one job below shellgibi-<pid>, next to the
+ * shell's own group, and writes its limits. A group with processes in it may
+ * not enable controllers for its children, so the shell first moves itself
+ * into the leaf shellgibi-<pid>/shell. Controllers are then enabled on the way
+ * down as far as the hierarchy allows
+ * @param  cpu_max    value for cpu.max, NULL to leave it unlimited
+ * @param  memory_max value for memory.max, NULL to leave it unlimited
+ * @param  io_weight  value for io.weight, NULL for the default weight
+ * @return            the group with one reference, NULL on failure
+ */
+struct job_cgroup *create_job_cgroup(const char *cpu_max, const char *memory_max, const char *io_weight)
+{
+    char base[PATH_MAX];
+    if (cgroup_container[0] == '\0')
+    {
+        if (find_own_cgroup(base, sizeof(base)) == -1)
+        {
+            print_error("limit needs a cgroup v2 hierarchy.");
+            return NULL;
+        }
+        snprintf(cgroup_container, sizeof(cgroup_container), "%.4000s/shellgibi-%d", base, (int)getpid());
+        if (mkdir(cgroup_container, 0755) == -1 && errno != EEXIST)
+        {
+            fprintf(stderr, "-%s: limit: %s: %s\n", sysname, cgroup_container, strerror(errno));
+            cgroup_container[0] = '\0';
+            return NULL;
+        }
+        int base_fd = open(base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        int container_fd = open(cgroup_container, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        char pid[16];
+        snprintf(pid, sizeof(pid), "%d", (int)getpid());
+        int shell_fd = -1;
+        if (container_fd != -1 && (mkdirat(container_fd, "shell", 0755) == 0 || errno == EEXIST))
+            shell_fd = openat(container_fd, "shell", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (shell_fd == -1 || write_cgroup_file(shell_fd, "cgroup.procs", pid) == -1)
+            print_warning("limit: the shell stays in its group, controllers may not be enabled below it.");
+        if (shell_fd != -1)
+            close(shell_fd);
+        // each controller separately, one that is not available must not block the others
+        const char *controllers[] = {"+cpu", "+memory", "+io"};
+        for (int i = 0; i < 3; i++)
+        {
+            int fd = openat(base_fd, "cgroup.subtree_control", O_WRONLY | O_CLOEXEC);
+            if (fd != -1)
+            {
+                write(fd, controllers[i], strlen(controllers[i]));
+                close(fd);
+            }
+            fd = openat(container_fd, "cgroup.subtree_control", O_WRONLY | O_CLOEXEC);
+            if (fd != -1)
+            {
+                write(fd, controllers[i], strlen(controllers[i]));
+                close(fd);
+            }
+        }
+        if (base_fd != -1)
+            close(base_fd);
+        if (container_fd != -1)
+            close(container_fd);
+    }
+
+    struct job_cgroup *cgroup = shell_calloc(MEMORY_JOBS, 1, sizeof(struct job_cgroup));
+    cgroup->path = shell_malloc(MEMORY_JOBS, PATH_MAX);
+    snprintf(cgroup->path, PATH_MAX, "%.4000s/job-%d", cgroup_container, ++job_cgroup_count);
+    if (mkdir(cgroup->path, 0755) == -1 || (cgroup->fd = open(cgroup->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+    {
+        fprintf(stderr, "-%s: limit: %s: %s\n", sysname, cgroup->path, strerror(errno));
+        shell_free(MEMORY_JOBS, cgroup->path);
+        shell_free(MEMORY_JOBS, cgroup);
+        return NULL;
+    }
+    cgroup->references = 1;
+    if ((cpu_max && write_cgroup_file(cgroup->fd, "cpu.max", cpu_max) == -1) ||
+        (memory_max && write_cgroup_file(cgroup->fd, "memory.max", memory_max) == -1) ||
+        (io_weight && write_cgroup_file(cgroup->fd, "io.weight", io_weight) == -1))
+    {
+        close(cgroup->fd);
+        rmdir(cgroup->path);
+        shell_free(MEMORY_JOBS, cgroup->path);
+        shell_free(MEMORY_JOBS, cgroup);
+        return NULL;
+    }
+    return cgroup;
+}
+
+// moves the shell back to the group it came from and removes its container, at exit
+void remove_cgroup_container()
+{
+    if (cgroup_container[0] == '\0')
+        return;
+    char pid[16];
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    int fd = open(cgroup_container, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd != -1)
+    {
+        int parent_fd = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (parent_fd != -1)
+        {
+            write_cgroup_file(parent_fd, "cgroup.procs", pid);
+            close(parent_fd);
+        }
+        unlinkat(fd, "shell", AT_REMOVEDIR);
+        close(fd);
+    }
+    rmdir(cgroup_container);
+}
+
+// drops a reference, the last one removes the group once its processes are gone
+void release_job_cgroup(struct job_cgroup *cgroup)
+{
+    if (cgroup == NULL || --cgroup->references > 0)
+        return;
+    close(cgroup->fd);
+    rmdir(cgroup->path); // a background job still runs in it, it is removed when reaped
+    shell_free(MEMORY_JOBS, cgroup->path);
+    shell_free(MEMORY_JOBS, cgroup);
+}
+
+/**
+ * Parses the limits of a limit command into cgroup v2 values: cpu=50% or
+ * cpu=<quota>/<period> in microseconds, mem=512M (K, M, G suffixes), io=<1-10000>
+ * @return 0, or -1 if option is not a valid limit
+ */
+int parse_limit(const char *option, char *cpu_max, char *memory_max, char *io_weight, size_t size)
+{
+    char *end;
+    if (strncmp(option, "cpu=", 4) == 0)
+    {
+        double percent = strtod(option + 4, &end);
+        if (strcmp(option + 4, "max") == 0)
+            snprintf(cpu_max, size, "max");
+        else if (*end == '%' && end[1] == '\0' && percent > 0 && percent <= LONG_MAX / 1000)
+            snprintf(cpu_max, size, "%ld 100000", (long)(percent * 1000));
+        else
+        {
+            // <quota>/<period>, nothing may follow the period
+            errno = 0;
+            long quota = strtol(option + 4, &end, 10);
+            if (*end != '/' || quota <= 0)
+                return -1;
+            long period = strtol(end + 1, &end, 10);
+            if (*end != '\0' || period <= 0 || errno == ERANGE)
+                return -1;
+            snprintf(cpu_max, size, "%ld %ld", quota, period);
+        }
+        return 0;
+    }
+    if (strncmp(option, "mem=", 4) == 0)
+    {
+        if (strcmp(option + 4, "max") == 0)
+        {
+            snprintf(memory_max, size, "max");
+            return 0;
+        }
+        // strtoull would take a sign or blanks, and wrap a negative number around
+        if (option[4] < '0' || option[4] > '9')
+            return -1;
+        errno = 0;
+        unsigned long long bytes = strtoull(option + 4, &end, 10);
+        int shift = 0;
+        if (*end == 'K' || *end == 'k')
+            shift = 10, end++;
+        else if (*end == 'M' || *end == 'm')
+            shift = 20, end++;
+        else if (*end == 'G' || *end == 'g')
+            shift = 30, end++;
+        if (*end != '\0' || errno == ERANGE || bytes > ULLONG_MAX >> shift)
+            return -1;
+        snprintf(memory_max, size, "%llu", bytes << shift);
+        return 0;
+    }
+    if (strncmp(option, "io=", 3) == 0)
+    {
+        long weight = strtol(option + 3, &end, 10);
+        if (*end != '\0' || weight < 1 || weight > 10000)
+            return -1;
+        snprintf(io_weight, size, "%ld", weight);
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Forks a stage straight into its job's cgroup with clone3(CLONE_INTO_CGROUP),
+ * so it never runs outside its limits. The raw syscall skips glibc's fork
+ * handlers, so it is only used while the prompt worker is idle and cannot be
+ * holding a malloc or stdio lock. Otherwise, and on kernels before 5.7, the
+ * child is forked and moves itself into the group
+ * @return like fork
+ */
+pid_t fork_into_cgroup(struct job_cgroup *cgroup)
+{
+#ifdef SYS_clone3
+    pthread_mutex_lock(&prompt_state.lock);
+    if (!prompt_state.vcs_busy)
+    {
+        struct clone_args args;
+        memset(&args, 0, sizeof(args));
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = cgroup->fd;
+        pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid == 0)
+            return 0; // the child never takes the prompt lock, its copy stays locked
+        pthread_mutex_unlock(&prompt_state.lock);
+        if (pid != -1)
+            return pid;
+    }
+    else
+        pthread_mutex_unlock(&prompt_state.lock);
+#endif
+    pid_t pid = fork();
+    if (pid == 0)
+        write_cgroup_file(cgroup->fd, "cgroup.procs", "0");
+    return pid;
+}
+
+// reads a single number from a cgroup file, or the usage_usec line of cpu.stat
+long long read_cgroup_value(const char *path, const char *file)
+{
+    char full_path[PATH_MAX + 32], buf[512];
+    snprintf(full_path, sizeof(full_path), "%.4000s/%s", path, file);
+    int fd = open(full_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    buf[n > 0 ? n : 0] = '\0';
+    char *value = strstr(buf, "usage_usec ");
+    return strtoll(value ? value + 11 : buf, NULL, 10);
+}
+
+// jobs builtin: background jobs of this shell with the live usage of their cgroups
+void print_jobs()
+{
+    for (int i = 0; i < job_count; i++)
+    {
+        printf("[%d] %-16s", (int)job_table[i].pid, job_table[i].name);
+        if (job_table[i].cgroup)
+        {
+            long long cpu_usec = read_cgroup_value(job_table[i].cgroup, "cpu.stat");
+            long long memory = read_cgroup_value(job_table[i].cgroup, "memory.current");
+            long long peak = read_cgroup_value(job_table[i].cgroup, "memory.peak");
+            printf(" cpu %.2fs", cpu_usec >= 0 ? cpu_usec / 1e6 : 0);
+            if (memory >= 0)
+                printf(" mem %.1fMB", memory / 1048576.0);
+            if (peak >= 0)
+                printf(" peak %.1fMB", peak / 1048576.0);
+            long long max = read_cgroup_value(job_table[i].cgroup, "memory.max");
+            if (max > 0)
+                printf(" / %.1fMB", max / 1048576.0);
+        }
+        printf("\n");
+    }
+}
+
+// one link of a monitored pipeline: upstream stdout -> shell -> downstream stdin
+struct monitor_link
+{
+    int in_fd;        // read end of the upstream stage's stdout, -1 once closed
+    int out_fd;       // write end of the downstream stage's stdin, -1 once closed
+    bool output_full; // the downstream pipe was full, wait for it to drain
+    unsigned long long bytes, bytes_at_last_draw;
+};
+
+struct monitor_stage
+{
+    struct command_t *command;
+    pid_t pid;
+    bool exited;
+    struct timespec started;
+    int samples, read_blocked, write_blocked; // /proc/<pid>/syscall samples
+};
+
+#define MONITOR_SAMPLE_MS 10
+#define MONITOR_DRAW_MS 500
+
+/**
+ * Samples what a stage is doing from /proc/<pid>/syscall
+ * @return 1 if it is in a read from stdin, 2 if it is in a write to stdout, 0 otherwise
+ */
+int sample_stage_blocking(pid_t pid)
+{
+    char path[64], buf[256];
+    snprintf(path, sizeof(path), "/proc/%d/syscall", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    buf[n > 0 ? n : 0] = '\0';
+    // "<nr> <arg1> ..." in hex, or "running"
+    long nr;
+    unsigned long first_arg;
+    if (sscanf(buf, "%ld %lx", &nr, &first_arg) != 2)
+        return 0;
+    if ((nr == SYS_read || nr == SYS_readv) && first_arg == STDIN_FILENO)
+        return 1;
+    if ((nr == SYS_write || nr == SYS_writev) && first_arg == STDOUT_FILENO)
+        return 2;
+    return 0;
+}
+
+// human readable byte count, 1.5MB
+void format_bytes(double bytes, char *out, size_t size)
+{
+    const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4)
+    {
+        bytes /= 1024;
+        unit++;
+    }
+    snprintf(out, size, unit ? "%.1f%s" : "%.0f%s", bytes, units[unit]);
+}
+
+/**
+ * Draws one line per stage and one per link on stderr, with a single write.
+ * On a terminal the previous table is overwritten in place
+ * @param interval seconds since the previous draw, for the rates
+ * @param terminal stderr is a terminal
+ * @param drawn    lines of the previous table, updated
+ */
+void draw_monitor(struct monitor_stage *stages, int stage_count, struct monitor_link *links, double interval,
+                  bool terminal, int *drawn)
+{
+    char *out = malloc(stage_count * 2 * 160 + 32);
+    const char *clear = terminal ? "\033[K" : "";
+    size_t length = 0;
+    if (terminal && *drawn > 0)
+        length += sprintf(out, "\033[%dA", *drawn);
+    for (int i = 0; i < stage_count; i++)
+    {
+        struct monitor_stage *stage = &stages[i];
+        char state[32];
+        if (stage->exited)
+            snprintf(state, sizeof(state), "exit %d",
+                     WIFEXITED(stage->command->stats.status) ? WEXITSTATUS(stage->command->stats.status)
+                                                             : 128 + WTERMSIG(stage->command->stats.status));
+        else
+            snprintf(state, sizeof(state), "running");
+        int samples = stage->samples ? stage->samples : 1;
+        length += sprintf(out + length, "%s[%d] %-16.16s %-8s blocked on read %3d%%, on write %3d%%\n", clear,
+                          (int)stage->pid, stage->command->name, state, 100 * stage->read_blocked / samples,
+                          100 * stage->write_blocked / samples);
+        if (i == stage_count - 1)
+            break;
+        struct monitor_link *link = &links[i];
+        char total[32], rate[32];
+        format_bytes(link->bytes, total, sizeof(total));
+        format_bytes(interval > 0 ? (link->bytes - link->bytes_at_last_draw) / interval : 0, rate, sizeof(rate));
+        length += sprintf(out + length, "%s  | %10s %10s/s%s\n", clear, total, rate, link->in_fd == -1 ? " closed" : "");
+        link->bytes_at_last_draw = link->bytes;
+    }
+    write(STDERR_FILENO, out, length);
+    free(out);
+    *drawn = 2 * stage_count - 1;
+}
+
+/**
+ * Moves what is waiting on a link with splice, pipe to pipe without copying
+ * through the shell, and counts it. Closes the link at EOF, or when the
+ * downstream stage is gone so that the upstream one gets SIGPIPE
+ */
+void relay_link(struct monitor_link *link)
+{
+    for (int round = 0; round < 16; round++) // bounded, so one busy link does not starve the others
+    {
+        ssize_t moved = splice(link->in_fd, NULL, link->out_fd, NULL, 1 << 16, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved > 0)
+        {
+            link->bytes += moved;
+            continue;
+        }
+        if (moved == -1 && errno == EAGAIN)
+        {
+            // EAGAIN comes from either side, data still waiting means the downstream pipe is full
+            int waiting = 0;
+            link->output_full = ioctl(link->in_fd, FIONREAD, &waiting) == 0 && waiting > 0;
+            return;
+        }
+        if (moved == -1 && errno == EINTR)
+            continue;
+        close(link->in_fd);
+        close(link->out_fd);
+        link->in_fd = link->out_fd = -1;
+        return;
+    }
+}
+
+/**
+ * Runs all stages of a pipeline at once, with the shell relaying every link
+ * through a counting splice. Shows bytes and bytes/s per link and how often
+ * each stage was found blocked reading stdin or writing stdout
+ * @param  command   first stage
+ * @param  pipe_size capacity of every pipe set with F_SETPIPE_SZ, 0 for the default
+ * @return           SUCCESS
+ */
+int run_monitored_pipeline(struct command_t *command, int pipe_size)
+{
+    int stage_count = 0;
+    for (struct command_t *stage = command; stage; stage = stage->next)
+        stage_count++;
+    struct monitor_stage *stages = calloc(stage_count, sizeof(struct monitor_stage));
+    struct monitor_link *links = calloc(stage_count, sizeof(struct monitor_link));
+    // upstream[i]: stage i -> shell, downstream[i]: shell -> stage i + 1
+    int (*upstream)[2] = calloc(stage_count, sizeof(int[2]));
+    int (*downstream)[2] = calloc(stage_count, sizeof(int[2]));
+    for (int i = 0; i < stage_count - 1; i++)
+    {
+        pipe2(upstream[i], O_CLOEXEC);
+        pipe2(downstream[i], O_CLOEXEC);
+        if (pipe_size > 0 && (fcntl(upstream[i][1], F_SETPIPE_SZ, pipe_size) == -1 ||
+                              fcntl(downstream[i][1], F_SETPIPE_SZ, pipe_size) == -1))
+            fprintf(stderr, "-%s: monitor: pipe size %d: %s\n", sysname, pipe_size, strerror(errno));
+        links[i].in_fd = upstream[i][0];
+        links[i].out_fd = downstream[i][1];
+    }
+
+    struct command_t *stage = command;
+    for (int i = 0; i < stage_count; i++, stage = stage->next)
+    {
+        stages[i].command = stage;
+        clock_gettime(CLOCK_MONOTONIC, &stages[i].started);
+        pid_t pid = stage->cgroup ? fork_into_cgroup(stage->cgroup) : fork();
+        if (pid == 0)
+        {
+            if (i > 0)
+                dup2(downstream[i - 1][0], STDIN_FILENO);
+            // the other pipe ends are closed by exec, O_CLOEXEC
+            exit(process_command_child(stage, upstream[i]));
+        }
+        stages[i].pid = pid;
+        if (pid == -1)
+            stages[i].exited = true;
+    }
+    for (int i = 0; i < stage_count - 1; i++)
+    {
+        close(upstream[i][1]);
+        close(downstream[i][0]);
+    }
+    // a stage that exits early turns our splice into EPIPE, not a SIGPIPE for the shell.
+    // Set after the forks, an ignored SIGPIPE would survive exec in the stages
+    struct sigaction ignore = {.sa_handler = SIG_IGN}, old_sigpipe;
+    sigaction(SIGPIPE, &ignore, &old_sigpipe);
+
+    struct pollfd *fds = malloc(sizeof(struct pollfd) * stage_count);
+    int *fd_links = malloc(sizeof(int) * stage_count);
+    bool terminal = isatty(STDERR_FILENO);
+    int drawn = 0;
+    struct timespec last_sample, last_draw, now;
+    clock_gettime(CLOCK_MONOTONIC, &last_sample);
+    last_draw = last_sample;
+    int running = stage_count;
+    for (int i = 0; i < stage_count; i++)
+        running -= stages[i].exited;
+    while (1)
+    {
+        int fd_count = 0;
+        for (int i = 0; i < stage_count - 1; i++)
+        {
+            if (links[i].in_fd == -1)
+                continue;
+            fds[fd_count].fd = links[i].output_full ? links[i].out_fd : links[i].in_fd;
+            fds[fd_count].events = links[i].output_full ? POLLOUT : POLLIN;
+            fd_links[fd_count++] = i;
+        }
+        if (fd_count == 0 && running == 0)
+            break;
+        poll(fds, fd_count, MONITOR_SAMPLE_MS);
+        for (int i = 0; i < fd_count; i++)
+        {
+            if (fds[i].revents == 0)
+                continue;
+            links[fd_links[i]].output_full = false;
+            relay_link(&links[fd_links[i]]);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (elapsed_seconds(&last_sample, &now) * 1000 < MONITOR_SAMPLE_MS)
+            continue;
+        last_sample = now;
+        for (int i = 0; i < stage_count; i++)
+        {
+            struct monitor_stage *monitored = &stages[i];
+            if (monitored->exited)
+                continue;
+            int status;
+            struct rusage usage;
+            if (wait4(monitored->pid, &status, WNOHANG, &usage) == monitored->pid)
+            {
+                struct command_stats *stats = &monitored->command->stats;
+                stats->collected = true;
+                stats->pid = monitored->pid;
+                stats->status = status;
+                stats->usage = usage;
+                stats->wall_seconds = elapsed_seconds(&monitored->started, &now);
+                monitored->exited = true;
+                running--;
+                continue;
+            }
+            int blocked = sample_stage_blocking(monitored->pid);
+            monitored->samples++;
+            monitored->read_blocked += blocked == 1;
+            monitored->write_blocked += blocked == 2;
+        }
+        if (terminal && elapsed_seconds(&last_draw, &now) * 1000 >= MONITOR_DRAW_MS)
+        {
+            draw_monitor(stages, stage_count, links, elapsed_seconds(&last_draw, &now), terminal, &drawn);
+            last_draw = now;
+        }
+    }
+    sigaction(SIGPIPE, &old_sigpipe, NULL);
+    // the summary shows average rates over the whole run
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < stage_count - 1; i++)
+        links[i].bytes_at_last_draw = 0;
+    draw_monitor(stages, stage_count, links, elapsed_seconds(&stages[0].started, &now), terminal, &drawn);
+
+    struct command_t *last = command;
+    while (last->next)
+        last = last->next;
+    if (last->stats.collected)
+        last_exit_status = WIFEXITED(last->stats.status) ? WEXITSTATUS(last->stats.status) : 128 + WTERMSIG(last->stats.status);
+    free(fds);
+    free(fd_links);
+    free(upstream);
+    free(downstream);
+    free(links);
+    free(stages);
+    return SUCCESS;
+}
+
+// output of one foreground command, kept in an anonymous memfd so out can read it back
+struct capture
+{
+    int fd;
+    size_t size;
+    bool truncated;       // the output went over the budget, the rest was not kept
+    unsigned long number; // counts the captures of the session, out N refers to it
+    char line[128];       // the pipeline as typed, for the out listing
+};
+
+#define CAPTURE_SLOTS 256
+#define CAPTURE_DEFAULT_BUDGET (64UL << 20)
+
+// ring of captures, oldest first, evicted when the total goes over the budget
+struct capture captures[CAPTURE_SLOTS];
+int capture_first = 0, capture_count = 0;
+size_t capture_total = 0;
+unsigned long capture_numbers = 0;
+
+// capture of the running command, fd is -1 when the command is not captured
+struct capture capture_running = {.fd = -1};
+size_t capture_room;
+char capture_line[128];
+bool capture_line_wanted; // false for lines that read a capture back, out -1 stays the same
+
+/**
+ * Memory budget of the captures, from SHELLGIBI_CAPTURE: a size with an
+ * optional K, M or G suffix, or 1 for the default budget
+ * @return bytes, 0 when capturing is off
+ */
+size_t capture_budget()
+{
+    char *value = getenv("SHELLGIBI_CAPTURE"), *end;
+    if (value == NULL || value[0] == '\0')
+        return 0;
+    unsigned long long bytes = strtoull(value, &end, 10);
+    if (*end == 'K' || *end == 'k')
+        bytes <<= 10, end++;
+    else if (*end == 'M' || *end == 'm')
+        bytes <<= 20, end++;
+    else if (*end == 'G' || *end == 'g')
+        bytes <<= 30, end++;
+    if (*end != '\0' || end == value)
+        return 0;
+    return bytes == 1 ? CAPTURE_DEFAULT_BUDGET : bytes;
+}
+
+// the last stage of a foreground pipeline is captured if its stdout is not redirected
+bool capture_wanted(struct command_t *last)
+{
+    if (!capture_line_wanted || last->background || capture_budget() == 0)
+        return false;
+    for (struct redirect *redirect = last->redirects; redirect; redirect = redirect->next)
+        if (redirect->fd == STDOUT_FILENO)
+            return false;
+    return true;
+}
+
+// remembers the line of a pipeline for the out listing, called before its first stage starts
+void capture_describe(struct command_t *command)
+{
+    int length = 0;
+    capture_line[0] = '\0';
+    capture_line_wanted = strcmp(command->name, "out") != 0;
+    if (!capture_line_wanted || capture_budget() == 0)
+        return;
+    for (struct command_t *stage = command; stage && length < sizeof(capture_line); stage = stage->next)
+    {
+        length += snprintf(capture_line + length, sizeof(capture_line) - length, "%s%s", stage == command ? "" : " | ",
+                           stage->name);
+        for (int i = 0; i < stage->arg_count && length < sizeof(capture_line); i++)
+            length += snprintf(capture_line + length, sizeof(capture_line) - length, " %s", stage->args[i]);
+    }
+}
+
+// starts the capture of the running command, false if no memfd could be created
+bool capture_begin()
+{
+    capture_running.fd = memfd_create("shellgibi-capture", MFD_CLOEXEC);
+    if (capture_running.fd == -1)
+        return false;
+    capture_running.size = 0;
+    capture_running.truncated = false;
+    snprintf(capture_running.line, sizeof(capture_running.line), "%s", capture_line);
+    capture_room = capture_budget();
+    return true;
+}
+
+// keeps a copy of output of the running command, up to the budget
+void capture_append(const char *data, size_t length)
+{
+    if (capture_running.fd == -1)
+        return;
+    if (length > capture_room)
+    {
+        length = capture_room;
+        capture_running.truncated = true;
+    }
+    write_all(capture_running.fd, data, length);
+    capture_running.size += length;
+    capture_room -= length;
+}
+
+void capture_evict_oldest()
+{
+    struct capture *oldest = &captures[capture_first];
+    close(oldest->fd);
+    capture_total -= oldest->size;
+    capture_first = (capture_first + 1) % CAPTURE_SLOTS;
+    capture_count--;
+}
+
+// drops the running capture without adding it to the ring
+void capture_cancel()
+{
+    if (capture_running.fd == -1)
+        return;
+    close(capture_running.fd);
+    capture_running.fd = -1;
+}
+
+// adds the finished capture to the ring, dropping the oldest ones over the budget
+void capture_finish()
+{
+    if (capture_running.fd == -1)
+        return;
+    if (capture_count == CAPTURE_SLOTS)
+        capture_evict_oldest();
+    capture_running.number = ++capture_numbers;
+    captures[(capture_first + capture_count) % CAPTURE_SLOTS] = capture_running;
+    capture_count++;
+    capture_total += capture_running.size;
+    capture_running.fd = -1;
+    size_t budget = capture_budget();
+    while (capture_count > 1 && capture_total > budget)
+        capture_evict_oldest();
+}
+
+/**
+ * Finds a capture for out
+ * @param number number of the capture, or -1 for the last one, -2 for the one before...
+ * @return       NULL if it was evicted or never existed
+ */
+struct capture *find_capture(long number)
+{
+    for (int i = 0; i < capture_count; i++)
+    {
+        struct capture *capture = &captures[(capture_first + i) % CAPTURE_SLOTS];
+        if (number < 0 ? i == capture_count + number : capture->number == number)
+            return capture;
+    }
+    return NULL;
+}
+
+/**
+ * Opens a capture for reading. The memfd is opened again through /proc, the
+ * new descriptor starts at offset 0 and reads the pages of the memfd itself
+ * @param  argument number of the capture as given to out
+ * @return          readable descriptor, -1 after printing an error
+ */
+int open_capture(const char *argument)
+{
+    char *end, path[64];
+    long number = strtol(argument, &end, 10);
+    struct capture *capture = *end == '\0' && number != 0 ? find_capture(number) : NULL;
+    if (capture == NULL)
+    {
+        fprintf(stderr, "-%s: out: no capture %s\n", sysname, argument);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", capture->fd);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        fprintf(stderr, "-%s: out: %s\n", sysname, strerror(errno));
+    return fd;
+}
+
+// out alone lists the captures
+void print_captures()
+{
+    for (int i = 0; i < capture_count; i++)
+    {
+        struct capture *capture = &captures[(capture_first + i) % CAPTURE_SLOTS];
+        printf("%5lu %10zu%s  %s\n", capture->number, capture->size, capture->truncated ? "+" : " ", capture->line);
+    }
+}
+
+/**
+ * Writes a capture to stdout, with sendfile where the kernel can splice into
+ * stdout and from a read-only mapping of the memfd everywhere else
+ * @return SUCCESS, or INVALID if the capture does not exist
+ */
+int write_capture(const char *argument)
+{
+    int fd = open_capture(argument);
+    if (fd == -1)
+        return INVALID;
+    struct stat status;
+    fstat(fd, &status);
+    off_t offset = 0;
+    while (offset < status.st_size)
+    {
+        ssize_t sent = sendfile(STDOUT_FILENO, fd, &offset, status.st_size - offset);
+        if (sent > 0)
+            continue;
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && (errno == EINVAL || errno == ENOSYS))
+        {
+            char *data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                write_all(STDOUT_FILENO, data + offset, status.st_size - offset);
+                munmap(data, status.st_size);
+            }
+        }
+        break;
+    }
+    close(fd);
+    return SUCCESS;
+}
+
+// in-process filter stages: grep, wc, head and tail at the end of a pipeline run in a thread of the shell
+enum filter_type
+{
+    FILTER_GREP, // grep [-v] [-c] [-F] literal
+    FILTER_WC,   // wc -l or wc -c
+    FILTER_HEAD, // head [-n N | -N]
+    FILTER_TAIL  // tail [-n N | -N]
+};
+
+struct filter_stage
+{
+    enum filter_type type;
+    bool invert, count_only; // grep -v, grep -c
+    char *pattern;
+    size_t pattern_length;
+    char wc_mode; // 'l' or 'c'
+    long limit;   // lines of head and tail
+    unsigned long long counter;
+    bool done;    // head has all of its lines, input is no longer needed
+    char *carry;  // grep: partial last line, tail: buffered last lines
+    size_t carry_length, carry_capacity;
+    size_t trim_at; // tail: buffer length at which older lines are dropped
+    struct filter_stage *next;
+};
+
+struct filter_chain
+{
+    struct filter_stage *first;
+    int in_fd, out_fd;
+    bool capture; // output of the last stage is also kept by capture_append
+    char *out;    // output of the last stage, written in large blocks
+    size_t out_length;
+    int status; // exit status of the last stage
+};
+
+#define FILTER_BLOCK (256 * 1024)
+
+size_t count_newlines_scalar(const char *data, size_t length)
+{
+    size_t count = 0;
+    const char *end = data + length;
+    while ((data = memchr(data, '\n', end - data)) != NULL)
+    {
+        count++;
+        data++;
+    }
+    return count;
+}
+
+// finds needle in haystack, needle_length > 0
+const char *find_literal_scalar(const char *haystack, size_t length, const char *needle, size_t needle_length)
+{
+    return memmem(haystack, length, needle, needle_length);
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+size_t count_newlines_sse2(const char *data, size_t length)
+{
+    size_t count = 0, i = 0;
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+    }
+    return count + count_newlines_scalar(data + i, length - i);
+}
+
+__attribute__((target("avx2"))) size_t count_newlines_avx2(const char *data, size_t length)
+{
+    size_t count = 0, i = 0;
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+        count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)));
+    }
+    return count + count_newlines_sse2(data + i, length - i);
+}
+
+/**
+ * Literal search comparing the first and the last byte of the needle at 16
+ * positions at once, only candidates with both bytes in place are compared in full
+ */
+const char *find_literal_sse2(const char *haystack, size_t length, const char *needle, size_t needle_length)
+{
+    if (needle_length == 1)
+        return memchr(haystack, needle[0], length);
+    if (length < needle_length)
+        return NULL;
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+    size_t i = 0, positions = length - needle_length + 1;
+    for (; i + 16 <= positions; i += 16)
+    {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(haystack + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(haystack + i + needle_length - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                        _mm_cmpeq_epi8(block_last, last)));
+        while (mask)
+        {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(haystack + i + bit + 1, needle + 1, needle_length - 2) == 0)
+                return haystack + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return find_literal_scalar(haystack + i, length - i, needle, needle_length);
+}
+
+__attribute__((target("avx2"))) const char *find_literal_avx2(const char *haystack, size_t length, const char *needle,
+                                                              size_t needle_length)
+{
+    if (needle_length == 1)
+        return memchr(haystack, needle[0], length);
+    if (length < needle_length)
+        return NULL;
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_length - 1]);
+    size_t i = 0, positions = length - needle_length + 1;
+    for (; i + 32 <= positions; i += 32)
+    {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(haystack + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(haystack + i + needle_length - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                                                              _mm256_cmpeq_epi8(block_last, last)));
+        while (mask)
+        {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(haystack + i + bit + 1, needle + 1, needle_length - 2) == 0)
+                return haystack + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return find_literal_sse2(haystack + i, length - i, needle, needle_length);
+}
+#endif
+
+// picked once by select_filter_kernels for the cpu we run on
+size_t (*count_newlines)(const char *data, size_t length) = count_newlines_scalar;
+const char *(*find_literal)(const char *haystack, size_t length, const char *needle,
+                            size_t needle_length) = find_literal_scalar;
+
+void select_filter_kernels()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2");
+    count_newlines = avx2 ? count_newlines_avx2 : count_newlines_sse2;
+    find_literal = avx2 ? find_literal_avx2 : find_literal_sse2;
+#endif
+}
+
+// in-process filters replace external grep, wc, head and tail when SHELLGIBI_FILTERS is set
+int filters_enabled()
+{
+    char *value = getenv("SHELLGIBI_FILTERS");
+    return value != NULL && value[0] != '\0' && strcmp(value, "0") != 0;
+}
+
+// parses the N of -n N, -nN or -N, returns false if it is not a count
+bool parse_line_count(struct command_t *command, int *index, long *count)
+{
+    char *argument = command->args[*index], *end;
+    if (strcmp(argument, "-n") == 0)
+    {
+        if (*index + 1 >= command->arg_count)
+            return false;
+        argument = command->args[++*index];
+    }
+    else if (strncmp(argument, "-n", 2) == 0)
+        argument += 2;
+    else
+        argument += 1;
+    // strtol would also take +N, which is "from line N" for tail, and leading blanks
+    if (*argument < '0' || *argument > '9')
+        return false;
+    *count = strtol(argument, &end, 10);
+    return *end == '\0';
+}
+
+/**
+ * Builds the in-process version of a pipeline stage
+ * @return the stage, or NULL if the command or one of its options is not covered,
+ *         the external tool is used then
+ */
+struct filter_stage *make_filter_stage(struct command_t *command)
+{
+    if (command->redirects != NULL || command->background || command->substitution_fd_count > 0)
+        return NULL;
+    struct filter_stage stage = {0};
+    if (strcmp(command->name, "grep") == 0)
+    {
+        bool fixed = false;
+        stage.type = FILTER_GREP;
+        for (int i = 0; i < command->arg_count; i++)
+        {
+            char *argument = command->args[i];
+            if (stage.pattern == NULL && argument[0] == '-' && argument[1] != '\0')
+            {
+                for (char *flag = argument + 1; *flag; flag++)
+                {
+                    if (*flag == 'v')
+                        stage.invert = true;
+                    else if (*flag == 'c')
+                        stage.count_only = true;
+                    else if (*flag == 'F')
+                        fixed = true;
+                    else
+                        return NULL;
+                }
+            }
+            else if (stage.pattern == NULL)
+                stage.pattern = argument;
+            else
+                return NULL; // file operands
+        }
+        // without -F only patterns that match themselves as a basic regex are searched as literals
+        if (stage.pattern == NULL || stage.pattern[0] == '\0' ||
+            (!fixed && strpbrk(stage.pattern, ".[]*^$\\") != NULL) || strchr(stage.pattern, '\n') != NULL)
+            return NULL;
+        stage.pattern_length = strlen(stage.pattern);
+    }
+    else if (strcmp(command->name, "wc") == 0)
+    {
+        stage.type = FILTER_WC;
+        if (command->arg_count != 1 || (strcmp(command->args[0], "-l") != 0 && strcmp(command->args[0], "-c") != 0))
+            return NULL;
+        stage.wc_mode = command->args[0][1];
+    }
+    else if (strcmp(command->name, "head") == 0 || strcmp(command->name, "tail") == 0)
+    {
+        stage.type = command->name[0] == 'h' ? FILTER_HEAD : FILTER_TAIL;
+        stage.limit = 10;
+        for (int i = 0; i < command->arg_count; i++)
+            if (command->args[i][0] != '-' || !parse_line_count(command, &i, &stage.limit))
+                return NULL;
+    }
+    else
+        return NULL;
+    stage.trim_at = 4 * FILTER_BLOCK;
+    struct filter_stage *filter = malloc(sizeof(struct filter_stage));
+    *filter = stage;
+    return filter;
+}
+
+void free_filter_chain(struct filter_stage *stage)
+{
+    while (stage)
+    {
+        struct filter_stage *next = stage->next;
+        free(stage->carry);
+        free(stage);
+        stage = next;
+    }
+}
+
+/**
+ * Builds the filter chain for the stages from command on, all of them must be covered
+ * @return the first filter, NULL if the pipeline tail has to run externally
+ */
+struct filter_stage *make_filter_chain(struct command_t *command)
+{
+    if (command == NULL || !filters_enabled())
+        return NULL;
+    struct filter_stage *first = NULL, **link = &first;
+    for (; command; command = command->next)
+    {
+        if ((*link = make_filter_stage(command)) == NULL)
+        {
+            free_filter_chain(first);
+            return NULL;
+        }
+        link = &(*link)->next;
+    }
+    return first;
+}
+
+void write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return;
+        data += written;
+        length -= written;
+    }
+}
+
+bool filter_push(struct filter_chain *chain, struct filter_stage *stage, const char *data, size_t length);
+
+void filter_write(struct filter_chain *chain, const char *data, size_t length)
+{
+    write_all(chain->out_fd, data, length);
+    if (chain->capture)
+        capture_append(data, length);
+}
+
+// hands output of a stage to the next one, or to the output buffer after the last one
+bool filter_emit(struct filter_chain *chain, struct filter_stage *stage, const char *data, size_t length)
+{
+    if (stage->next)
+        return filter_push(chain, stage->next, data, length);
+    if (chain->out_length + length > FILTER_BLOCK)
+    {
+        filter_write(chain, chain->out, chain->out_length);
+        chain->out_length = 0;
+        if (length > FILTER_BLOCK)
+        {
+            filter_write(chain, data, length);
+            return true;
+        }
+    }
+    memcpy(chain->out + chain->out_length, data, length);
+    chain->out_length += length;
+    return true;
+}
+
+void append_carry(struct filter_stage *stage, const char *data, size_t length)
+{
+    if (stage->carry_length + length > stage->carry_capacity)
+    {
+        stage->carry_capacity = (stage->carry_length + length) * 2;
+        stage->carry = realloc(stage->carry, stage->carry_capacity);
+    }
+    memcpy(stage->carry + stage->carry_length, data, length);
+    stage->carry_length += length;
+}
+
+/**
+ * Runs grep over whole lines, the literal is searched across the whole region
+ * rather than line by line, most lines of a log do not match
+ */
+bool grep_lines(struct filter_chain *chain, struct filter_stage *stage, const char *data, size_t length)
+{
+    const char *end = data + length, *unselected = data;
+    while (data < end)
+    {
+        const char *match = find_literal(data, end - data, stage->pattern, stage->pattern_length);
+        if (match == NULL)
+            break;
+        const char *line = memrchr(data, '\n', match - data);
+        line = line ? line + 1 : data;
+        const char *line_end = memchr(match, '\n', end - match);
+        line_end = line_end ? line_end + 1 : end;
+        if (stage->invert)
+        {
+            if (line > unselected && !stage->count_only && !filter_emit(chain, stage, unselected, line - unselected))
+                return false;
+            stage->counter += count_newlines(unselected, line - unselected);
+            unselected = line_end;
+        }
+        else
+        {
+            stage->counter++;
+            if (!stage->count_only && !filter_emit(chain, stage, line, line_end - line))
+                return false;
+        }
+        data = line_end;
+    }
+    if (stage->invert && end > unselected)
+    {
+        stage->counter += count_newlines(unselected, end - unselected);
+        if (!stage->count_only && !filter_emit(chain, stage, unselected, end - unselected))
+            return false;
+    }
+    return true;
+}
+
+// start of the last limit lines buffered by tail, a last line without newline counts too
+const char *tail_start(struct filter_stage *stage)
+{
+    const char *end = stage->carry + stage->carry_length;
+    if (stage->limit == 0 || stage->carry_length == 0)
+        return end;
+    const char *position = end[-1] == '\n' ? end - 1 : end;
+    for (long line = 0; line < stage->limit; line++)
+    {
+        const char *newline = memrchr(stage->carry, '\n', position - stage->carry);
+        if (newline == NULL)
+            return stage->carry;
+        position = newline;
+    }
+    return position + 1;
+}
+
+/**
+ * Feeds a block into a filter stage
+ * @return false once no more input is needed, head has all of its lines
+ */
+bool filter_push(struct filter_chain *chain, struct filter_stage *stage, const char *data, size_t length)
+{
+    if (stage->done)
+        return false;
+    switch (stage->type)
+    {
+    case FILTER_GREP:
+    {
+        // only complete lines are searched, the rest waits in carry for the next block
+        const char *last_newline = memrchr(data, '\n', length);
+        if (last_newline == NULL)
+        {
+            append_carry(stage, data, length);
+            return true;
+        }
+        size_t complete = last_newline + 1 - data;
+        if (stage->carry_length > 0)
+        {
+            const char *first_newline = memchr(data, '\n', length);
+            append_carry(stage, data, first_newline + 1 - data);
+            if (!grep_lines(chain, stage, stage->carry, stage->carry_length))
+                return false;
+            stage->carry_length = 0;
+            complete -= first_newline + 1 - data;
+            length -= first_newline + 1 - data;
+            data = first_newline + 1;
+        }
+        if (!grep_lines(chain, stage, data, complete))
+            return false;
+        append_carry(stage, data + complete, length - complete);
+        return true;
+    }
+    case FILTER_WC:
+        stage->counter += stage->wc_mode == 'l' ? count_newlines(data, length) : length;
+        return true;
+    case FILTER_HEAD:
+    {
+        size_t lines = count_newlines(data, length);
+        if (stage->counter + lines < (unsigned long long)stage->limit)
+        {
+            stage->counter += lines;
+            return filter_emit(chain, stage, data, length);
+        }
+        const char *end = data;
+        while (stage->counter < (unsigned long long)stage->limit)
+        {
+            end = (const char *)memchr(end, '\n', data + length - end) + 1;
+            stage->counter++;
+        }
+        filter_emit(chain, stage, data, end - data);
+        stage->done = true;
+        return false;
+    }
+    case FILTER_TAIL:
+        append_carry(stage, data, length);
+        // keep the buffer bounded, drop everything before the last limit lines now and then
+        if (stage->carry_length > stage->trim_at)
+        {
+            const char *start = tail_start(stage);
+            stage->carry_length -= start - stage->carry;
+            memmove(stage->carry, start, stage->carry_length);
+            stage->trim_at = stage->carry_length * 2 > 4 * FILTER_BLOCK ? stage->carry_length * 2 : 4 * FILTER_BLOCK;
+        }
+        return true;
+    }
+    return true;
+}
+
+// end of input: flushes what a stage held back and passes the end on
+void filter_finish(struct filter_chain *chain, struct filter_stage *stage)
+{
+    char line[32];
+    switch (stage->type)
+    {
+    case FILTER_GREP:
+        if (stage->carry_length > 0 && !stage->done)
+        {
+            append_carry(stage, "\n", 1); // grep terminates the last line
+            grep_lines(chain, stage, stage->carry, stage->carry_length);
+        }
+        if (stage->count_only)
+            filter_emit(chain, stage, line, snprintf(line, sizeof(line), "%llu\n", stage->counter));
+        chain->status = stage->counter > 0 ? 0 : 1;
+        break;
+    case FILTER_WC:
+        filter_emit(chain, stage, line, snprintf(line, sizeof(line), "%llu\n", stage->counter));
+        chain->status = 0;
+        break;
+    case FILTER_HEAD:
+        chain->status = 0;
+        break;
+    case FILTER_TAIL:
+    {
+        const char *start = tail_start(stage);
+        filter_emit(chain, stage, start, stage->carry + stage->carry_length - start);
+        chain->status = 0;
+        break;
+    }
+    }
+    if (stage->next)
+        filter_finish(chain, stage->next);
+}
+
+/**
+ * Pipeline thread: reads the upstream pipe in large blocks and runs it through
+ * the filters. The pipe is closed as soon as head is satisfied, so upstream
+ * gets SIGPIPE on its next write instead of running to the end
+ */
+void *filter_worker(void *argument)
+{
+    struct filter_chain *chain = argument;
+    char *block = malloc(FILTER_BLOCK);
+    chain->out = malloc(FILTER_BLOCK);
+    chain->out_length = 0;
+    ssize_t length;
+    while ((length = read(chain->in_fd, block, FILTER_BLOCK)) != 0)
+    {
+        if (length == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (!filter_push(chain, chain->first, block, length))
+            break;
+    }
+    close(chain->in_fd);
+    filter_finish(chain, chain->first);
+    filter_write(chain, chain->out, chain->out_length);
+    free(chain->out);
+    free(block);
+    return NULL;
+}
+
+// placement of every job started without a pin prefix, set with pin <spec>
+struct placement default_placement = {PLACEMENT_NONE};
+
+/**
+ * Parses a cpu list such as 0-3,8,10-11
+ * @param  list cpu list
+ * @param  cpus filled with the cpus of the list
+ * @return      number of cpus, -1 if list is not a cpu list
+ */
+int parse_cpu_list(const char *list, cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+    const char *p = list;
+    while (*p)
+    {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p || first < 0)
+            return -1;
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+        }
+        if (last >= CPU_SETSIZE)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, cpus);
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p != '\0' && *p != '\n')
+            return -1;
+        else
+            break;
+    }
+    return CPU_COUNT(cpus);
+}
+
+// cpus of a NUMA node from sysfs, all allowed cpus on machines without NUMA information
+int node_cpus(int node, cpu_set_t *cpus)
+{
+    char path[64], list[1024];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        if (node != 0 || sched_getaffinity(0, sizeof(cpu_set_t), cpus) == -1)
+            return -1;
+        return CPU_COUNT(cpus);
+    }
+    ssize_t n = read(fd, list, sizeof(list) - 1);
+    close(fd);
+    list[n > 0 ? n : 0] = '\0';
+    return parse_cpu_list(list, cpus);
+}
+
+/**
+ * Parses the placement of a pin command: a cpu list, node:N for the cpus and
+ * memory of a NUMA node, spread or spread:N for one cpu per stage on a node
+ * (the node the shell runs on by default), or off
+ * @param  spec      placement as written after pin
+ * @param  placement filled with the parsed placement
+ * @return           0, or -1 if spec is not a placement
+ */
+int parse_placement(const char *spec, struct placement *placement)
+{
+    memset(placement, 0, sizeof(struct placement));
+    placement->node = -1;
+    if (strcmp(spec, "off") == 0)
+        return 0;
+    if (strncmp(spec, "spread", 6) == 0)
+    {
+        unsigned int cpu, node = 0;
+        if (spec[6] == ':')
+            node = atoi(spec + 7);
+        else if (spec[6] != '\0')
+            return -1;
+        else
+            syscall(SYS_getcpu, &cpu, &node, NULL);
+        placement->mode = PLACEMENT_SPREAD;
+        placement->node = node;
+        // only cpus this shell may use, the stages inherit the same limit
+        cpu_set_t allowed;
+        if (node_cpus(node, &placement->cpus) <= 0)
+            return -1;
+        if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0)
+            CPU_AND(&placement->cpus, &placement->cpus, &allowed);
+        return CPU_COUNT(&placement->cpus) > 0 ? 0 : -1;
+    }
+    placement->mode = PLACEMENT_CPUS;
+    if (strncmp(spec, "node:", 5) == 0)
+    {
+        placement->node = atoi(spec + 5);
+        return node_cpus(placement->node, &placement->cpus) > 0 ? 0 : -1;
+    }
+    return parse_cpu_list(spec, &placement->cpus) > 0 ? 0 : -1;
+}
+
+// prints a placement the way pin accepts it
+void print_placement(const struct placement *placement)
+{
+    if (placement->mode == PLACEMENT_NONE)
+    {
+        printf("pin: off\n");
+        return;
+    }
+    printf("pin: %scpus ", placement->mode == PLACEMENT_SPREAD ? "spread over " : "");
+    const char *separator = "";
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &placement->cpus))
+            continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &placement->cpus))
+            last++;
+        if (last > cpu)
+            printf("%s%d-%d", separator, cpu, last);
+        else
+            printf("%s%d", separator, cpu);
+        separator = ",";
+        cpu = last;
+    }
+    if (placement->node >= 0)
+        printf(", memory on node %d", placement->node);
+    printf("\n");
+}
+
+/**
+ * Gives every stage of a pipeline its placement. Spread gives each stage a cpu
+ * of its own only when the stages run concurrently, as under monitor; stages
+ * that run one after another may all use the whole set
+ */
+void assign_placement(struct command_t *command, const struct placement *placement, bool concurrent)
+{
+    int cpu = -1;
+    for (; command; command = command->next)
+    {
+        command->placement = *placement;
+        if (placement->mode != PLACEMENT_SPREAD || !concurrent)
+            continue;
+        // the next cpu of the set, wrapping around when there are more stages than cpus
+        do
+            cpu = (cpu + 1) % CPU_SETSIZE;
+        while (!CPU_ISSET(cpu, &placement->cpus));
+        CPU_ZERO(&command->placement.cpus);
+        CPU_SET(cpu, &command->placement.cpus);
+    }
+}
+
+// applies the placement of a stage in the forked child, before exec
+void apply_placement(const struct placement *placement)
+{
+    if (placement->mode == PLACEMENT_NONE)
+        return;
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &placement->cpus) == -1)
+        fprintf(stderr, "-%s: pin: %s\n", sysname, strerror(errno));
+    if (placement->node >= 0)
+    {
+        unsigned long nodes[16] = {0};
+        if (placement->node >= (int)(sizeof(nodes) * 8))
+            return;
+        nodes[placement->node / (8 * sizeof(unsigned long))] |= 1UL << (placement->node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_set_mempolicy, MPOL_BIND, nodes, sizeof(nodes) * 8) == -1)
+            fprintf(stderr, "-%s: pin: node %d: %s\n", sysname, placement->node, strerror(errno));
+    }
+}
+
+/**
+ * Runs the variable builtins that have to change the shell process:
+ * NAME=value..., export NAME[=value]... and unset NAME...
+ * @return true if the command was one of them
+ */
+bool update_variables(struct command_t *command)
+{
+    if (is_assignment(command->name))
+    {
+        // with a command after them the assignments are for that command only, see process_command_child
+        for (int i = 0; i < command->arg_count; i++)
+            if (!is_assignment(command->args[i]))
+                return false;
+        for (int i = -1; i < command->arg_count; i++)
+        {
+            char *word = i == -1 ? command->name : command->args[i];
+            char *equals = strchr(word, '=');
+            *equals = '\0';
+            set_variable(word, equals + 1, false);
+            *equals = '=';
+        }
+        return true;
+    }
+    bool export = strcmp(command->name, "export") == 0;
+    if (!(export && command->arg_count > 0) && strcmp(command->name, "unset") != 0)
+        return false;
+    for (int i = 0; i < command->arg_count; i++)
+    {
+        char *word = command->args[i];
+        char *equals = strchr(word, '=');
+        if (equals)
+            *equals = '\0';
+        if (!is_name(word))
+            fprintf(stderr, "-%s: %s: '%s': not a valid identifier\n", sysname, command->name, word);
+        else if (export)
+            set_variable(word, equals ? equals + 1 : NULL, true);
+        else
+            unset_variable(word);
+        if (equals)
+            *equals = '=';
+    }
+    return true;
+}
+
+int compare_variable_names(const void *a, const void *b)
+{
+    return strcmp((*(struct variable *const *)a)->name, (*(struct variable *const *)b)->name);
+}
+
+// export NAME="value" for every exported variable, sorted by name
+void print_exported_variables()
+{
+    struct variable **exported = malloc(sizeof(struct variable *) * (variable_count + 1));
+    int count = 0;
+    for (int i = 0; i < variable_capacity; i++)
+        if (variable_table[i].name != NULL && variable_table[i].exported)
+            exported[count++] = &variable_table[i];
+    qsort(exported, count, sizeof(struct variable *), compare_variable_names);
+    for (int i = 0; i < count; i++)
+        printf("export %s=\"%s\"\n", exported[i]->name, exported[i]->value);
+    free(exported);
+}
+
+// per-command stats line is printed after every command when SHELLGIBI_STATS is set
+int stats_enabled()
+{
+    char *value = getenv("SHELLGIBI_STATS");
+    return value != NULL && value[0] != '\0' && strcmp(value, "0") != 0;
+}
+
+/**
+ * Prints the collected stats of every stage in a pipeline to stderr
+ * @param command first stage of the pipeline
+ */
+void print_command_stats(struct command_t *command)
+{
+    for (; command; command = command->next)
+    {
+        if (!command->stats.collected)
+            continue;
+        struct rusage *usage = &command->stats.usage;
+        fprintf(stderr, "[%s] pid %d: exit %d, wall %.3fs, user %.3fs, sys %.3fs, maxrss %ldKB, ctxsw %ld/%ld\n",
+                command->name, (int)command->stats.pid,
+                WIFEXITED(command->stats.status) ? WEXITSTATUS(command->stats.status) : 128 + WTERMSIG(command->stats.status),
+                command->stats.wall_seconds,
+                usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6,
+                usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6,
+                usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+    }
+}
+
+void add_job(pid_t pid, const char *name, const char *cgroup)
+{
+    if (job_count == MAX_JOBS)
+        return;
+    job_table[job_count].pid = pid;
+    job_table[job_count].name = shell_strdup(MEMORY_JOBS, name);
+    job_table[job_count].cgroup = cgroup ? shell_strdup(MEMORY_JOBS, cgroup) : NULL;
+    job_count++;
+}
+
+void remove_job(pid_t pid)
+{
+    for (int i = 0; i < job_count; i++)
     {
-        c = getchar();
-        // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
-        if (c == 9) // handle tab
+        if (job_table[i].pid == pid)
         {
-            if (index == 0)
-            {
-                continue;
-            }
-            char *buf_dup = strdup(buf);
-            buf_dup[index] = '\0';
+            if (job_table[i].cgroup)
+                rmdir(job_table[i].cgroup); // fails while other stages of the job still run
+            shell_free(MEMORY_JOBS, job_table[i].cgroup);
+            shell_free(MEMORY_JOBS, job_table[i].name);
+            job_table[i] = job_table[--job_count];
+            return;
+        }
+    }
+}
 
-            struct autocomplete_match *match;
-            int is_filename = should_complete_filename(buf_dup, filename_buf);
+// reaps finished background commands so they don't stay as zombies
+void reap_background_jobs()
+{
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+        remove_job(pid);
+}
 
-            if (is_filename)
+/**
+ * Builds a pipeline from the compiled words of a statement, see copy_tokens
+ * @param command filled in like parse_command does
+ */
+void instantiate_statement(const struct script_node *node, struct command_t *command)
+{
+    struct token *tokens = shell_malloc(MEMORY_COMMAND, sizeof(struct token) * (node->token_count + 1));
+    int token_count = copy_tokens(node->tokens, node->token_count, tokens);
+    build_pipeline(tokens, token_count, command);
+    // the here-documents were read when the statement was compiled
+    int document = 0;
+    for (struct command_t *stage = command; stage; stage = stage->next)
+        for (struct redirect *redirect = stage->redirects; redirect; redirect = redirect->next)
+            if (redirect->type == REDIRECT_HEREDOC && redirect->body == NULL && document < node->here_document_count)
             {
-                match = filename_autocomplete(filename_buf);
-                if (match->match_count == 1)
-                {
-                    // complete the command
-                    int input_filename_len = strlen(filename_buf);
-                    int match_len = strlen(match->matches[0]);
-
-                    if (match_len != input_filename_len)
-                    {
-                        for (int i = input_filename_len; i < match_len; i++)
-                        {
-                            putchar(match->matches[0][i]); // echo the character
-                            buf[index++] = match->matches[0][i];
-                        }
-                    }
-                    c = ' ';
-                }
-                else if (match->match_count > 1)
-                {
-                    printf("\n");
-                    for (int i = 0; i < match->match_count; i++)
-                    {
-                        printf("%s\t", match->matches[i]);
-                    }
-                    printf("\n");
-                    show_prompt();
-                    printf("%s", buf);
-                }
+                redirect->body_length = strlen(node->here_documents[document]);
+                redirect->body = shell_strdup(MEMORY_COMMAND, node->here_documents[document++]);
             }
-            else
-            {
-                // auto complete command
-                buf_dup = strdup(buf);
-                buf_dup[index] = '\0';
-                char *command_name = get_command_name(buf_dup);
-                match = shellgibi_autocomplete(command_name);
-                if (match->match_count == 1)
-                {
-                    // complete the command
-                    int input_command_len = strlen(command_name);
-                    int match_len = strlen(match->matches[0]);
+}
 
-                    if (match_len != input_command_len)
-                    {
-                        for (int i = input_command_len; i < match_len; i++)
-                        {
-                            putchar(match->matches[0][i]); // echo the character
-                            buf[index++] = match->matches[0][i];
-                        }
-                    }
-                    c = ' ';
-                }
-                else if (match->match_count > 1)
-                {
-                    printf("\n");
-                    for (int i = 0; i < match->match_count; i++)
-                    {
-                        printf("%s\t", match->matches[i]);
-                    }
-                    printf("\n");
-                    show_prompt();
-                    printf("%s", buf);
-                }
-            }
-            free_autocomplete_match(match);
-            if (c == 9)
-            {
-                continue;
-            }
-        }
+// runs one compiled command line like a line typed at the prompt
+int run_statement(const struct script_node *node)
+{
+    struct command_t *command = shell_calloc(MEMORY_COMMAND, 1, sizeof(struct command_t));
+    instantiate_statement(node, command);
+    int code = process_command(command, NULL);
+    if (command->timed || stats_enabled())
+        print_command_stats(command);
+    free_command(command);
+    return code;
+}
 
-        if (c == 127) // handle backspace
-        {
-            if (index > 0)
-            {
-                prompt_backspace();
-                index--;
-            }
-            continue;
-        }
-        if (c == 27 && multicode_state == 0) // handle multi-code keys
-        {
-            multicode_state = 1;
-            continue;
-        }
-        if (c == 91 && multicode_state == 1)
+/**
+ * Interpreter loop over compiled statements, conditions test last_exit_status
+ * @return EXIT if exit was run, SUCCESS otherwise
+ */
+int run_script(struct script_node *node)
+{
+    for (; node; node = node->next)
+    {
+        int code = SUCCESS;
+        switch (node->type)
         {
-            multicode_state = 2;
-            continue;
-        }
-        if (c == 65 && multicode_state == 2) // up arrow
+        case SCRIPT_COMMAND:
+            code = run_statement(node);
+            break;
+        case SCRIPT_FOR:
         {
-            int i;
-            while (index > 0)
-            {
-                prompt_backspace();
-                index--;
-            }
-            for (i = 0; oldbuf[i]; ++i)
+            // the list is expanded once, with globs and $(cmd) splitting, as the arguments of "for"
+            struct command_t *words = shell_calloc(MEMORY_COMMAND, 1, sizeof(struct command_t));
+            instantiate_statement(node, words);
+            for (int i = 0; i < words->arg_count && code != EXIT; i++)
             {
-                putchar(oldbuf[i]);
-                buf[i] = oldbuf[i];
+                set_variable(node->variable, words->args[i], false);
+                code = run_script(node->body);
             }
-            index = i;
-            multicode_state = 0;
-            continue;
+            free_command(words);
+            break;
         }
-
-        putchar(c); // echo the character
-        buf[index++] = c;
-        if (index >= sizeof(buf) - 1)
+        case SCRIPT_WHILE:
+            while ((code = run_statement(node->condition)) != EXIT && last_exit_status == 0)
+                if ((code = run_script(node->body)) == EXIT)
+                    break;
             break;
-        if (c == '\n') // enter key
+        case SCRIPT_IF:
+            code = run_statement(node->condition);
+            if (code != EXIT)
+                code = run_script(last_exit_status == 0 ? node->body : node->else_body);
+            break;
+        case SCRIPT_FUNCTION:
+        {
+            // the table takes a reference on the node's body, taken first as it may already hold it
+            struct definition *definition = definition_lookup(node->variable, true);
+            node->function->references++;
+            clear_definition(definition);
+            definition->function = node->function;
             break;
-        if (c == 4) // Ctrl+D
+        }
+        }
+        if (code == EXIT)
             return EXIT;
     }
-    if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
-        index--;
-    buf[index] = '\0'; // null terminate string
+    return SUCCESS;
+}
 
-    strcpy(oldbuf, buf);
+/**
+ * Calls a function in the shell process itself, its arguments are $1 to $9
+ * and their count $#, the caller's are restored afterwards
+ * @return EXIT if the function ran exit, SUCCESS otherwise
+ */
+int run_function(struct definition *function, struct command_t *command)
+{
+    char name[2] = {0};
+    char *saved[10];
+    for (int i = 0; i < 10; i++)
+    {
+        name[0] = i == 0 ? '#' : '0' + i;
+        const char *value = get_variable(name);
+        saved[i] = value ? shell_strdup(MEMORY_VARIABLES, value) : NULL;
+        unset_variable(name);
+        if (i > 0 && i <= command->arg_count)
+            set_variable(name, command->args[i - 1], false);
+    }
+    char count[16];
+    snprintf(count, sizeof(count), "%d", command->arg_count);
+    set_variable("#", count, false);
+    // the body may be unset or redefined while it runs, the call keeps it alive until it returns
+    struct function_body *body = function->function;
+    body->references++;
+    int code = run_script(body->script);
+    release_function_body(body);
+    for (int i = 0; i < 10; i++)
+    {
+        name[0] = i == 0 ? '#' : '0' + i;
+        unset_variable(name);
+        if (saved[i] != NULL)
+            set_variable(name, saved[i], false);
+        shell_free(MEMORY_VARIABLES, saved[i]);
+    }
+    return code;
+}
 
-    parse_command(buf, command);
+// shellgibi <file>: compiles the whole file and runs it, returns the last exit status
+int run_script_file(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, path, strerror(errno));
+        return UNKNOWN;
+    }
+    size_t length = 0, capacity = 4096;
+    char *text = shell_malloc(MEMORY_COMMAND, capacity);
+    size_t read_bytes;
+    while ((read_bytes = fread(text + length, 1, capacity - length - 1, file)) > 0)
+    {
+        length += read_bytes;
+        if (capacity - length - 1 == 0)
+            text = shell_realloc(MEMORY_COMMAND, text, capacity *= 2);
+    }
+    text[length] = '\0';
+    fclose(file);
+    struct script_node *script = compile_script(text);
+    shell_free(MEMORY_COMMAND, text);
+    if (script == NULL && length > 0)
+        return INVALID;
+    run_script(script);
+    free_script(script);
+    return last_exit_status;
+}
 
-    // print_command(command); // DEBUG: uncomment for debugging
+// parses and runs one command line outside the prompt loop, returns its exit status
+int run_command_line(char *line)
+{
+    struct command_t *command = shell_calloc(MEMORY_COMMAND, 1, sizeof(struct command_t));
+    last_exit_status = 0;
+    parse_command(line, command);
+    process_command(command, NULL);
+    record_history(command);
+    if (command->timed || stats_enabled())
+        print_command_stats(command);
+    free_command(command);
+    return last_exit_status;
+}
 
-    // restore the old settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-    return SUCCESS;
+// a request holds the client's cwd and command line, each NUL terminated
+#define SERVER_MESSAGE_SIZE (PATH_MAX + 8192)
+
+/**
+ * Socket of the warm server: SHELLGIBI_SOCKET, $XDG_RUNTIME_DIR/shellgibi.sock,
+ * or a socket in /tmp/shellgibi-<uid>, a directory only the user may enter
+ * @param  address filled with the path of the socket
+ * @return         true if the socket is in the /tmp directory, which the server creates
+ */
+bool server_socket_address(struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    const char *path = getenv("SHELLGIBI_SOCKET");
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (path != NULL && *path)
+        snprintf(address->sun_path, sizeof(address->sun_path), "%s", path);
+    else if (runtime_dir != NULL && runtime_dir[0] == '/')
+        snprintf(address->sun_path, sizeof(address->sun_path), "%s/shellgibi.sock", runtime_dir);
+    else
+    {
+        snprintf(address->sun_path, sizeof(address->sun_path), "/tmp/shellgibi-%d/server.sock", (int)getuid());
+        return true;
+    }
+    return false;
 }
 
-int qstrcmp(const void *a, const void *b)
+/**
+ * Creates the directory holding the socket, or checks that an existing one is a
+ * directory owned by the user that nobody else can enter
+ * @param  socket_path path of the socket, cut at its last slash
+ * @return             0, or -1 after printing the error
+ */
+int make_socket_directory(const char *socket_path)
 {
-    return strcmp(*(const char **)a, *(const char **)b);
+    char directory[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+    snprintf(directory, sizeof(directory), "%.*s", (int)(strrchr(socket_path, '/') - socket_path), socket_path);
+    if (mkdir(directory, 0700) == -1 && errno != EEXIST)
+    {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, directory, strerror(errno));
+        return -1;
+    }
+    struct stat info;
+    if (lstat(directory, &info) == -1 || !S_ISDIR(info.st_mode) || info.st_uid != getuid() ||
+        (info.st_mode & 077) != 0)
+    {
+        fprintf(stderr, "-%s: %s: not a private directory of this user\n", sysname, directory);
+        return -1;
+    }
+    return 0;
 }
 
-void load_all_available_commands()
+// writes to a client that went away fail with EPIPE instead of killing the server.
+// A handler rather than SIG_IGN: exec resets it, an ignored SIGPIPE would survive in the jobs
+void handle_server_sigpipe(int signal)
 {
-    char *path = strdup(getenv("PATH"));
-    int total_number_of_executables = sizeof(shellgibi_builtin_commands) / sizeof(shellgibi_builtin_commands[0]);
-    all_available_commands = malloc(total_number_of_executables * sizeof(char *));
-    memcpy(all_available_commands, shellgibi_builtin_commands, sizeof(shellgibi_builtin_commands));
-    char *file_name_buffer[65536];
+}
 
-    int executables_in_dir;
-    char *path_tokenizer = strtok(path, ":");
-    while (path_tokenizer != NULL)
+/**
+ * Runs one client request: the client's stdin, stdout and stderr arrive with
+ * SCM_RIGHTS and replace the server's own for the duration of the command,
+ * which runs in the client's cwd. The exit status is sent back as an int32
+ * @param connection accepted client socket
+ * @param saved_fds  copies of the server's own stdio, restored afterwards
+ * @param home_fd    directory the server returns to
+ */
+void serve_request(int connection, const int *saved_fds, int home_fd)
+{
+    char message[SERVER_MESSAGE_SIZE];
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {message, sizeof(message) - 1};
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+
+    ssize_t length = recvmsg(connection, &header, MSG_CMSG_CLOEXEC);
+    if (length <= 0)
+        return;
+    message[length] = '\0';
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        return;
+    int fds[3];
+    int fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * (fd_count < 3 ? fd_count : 3));
+    if (fd_count != 3)
     {
-        DIR *directory;
-        struct dirent *directory_entry;
-        executables_in_dir = 0;
-        directory = opendir(path_tokenizer);
-        if (directory)
-        {
-            while ((directory_entry = readdir(directory)) != NULL)
-            {
-                if (directory_entry->d_name[0] == '.')
-                {
-                    continue;
-                }
-                char full_path[strlen(path_tokenizer) + strlen(directory_entry->d_name) + 1];
-                combine_path(full_path, path_tokenizer, directory_entry->d_name);
-                if (access(full_path, X_OK) != 0)
-                    continue;
-                file_name_buffer[executables_in_dir++] = strdup(directory_entry->d_name);
-            }
-            closedir(directory);
+        for (int i = 0; i < fd_count && i < 3; i++)
+            close(fds[i]);
+        return;
+    }
+    char *cwd = message;
+    char *line = message + strlen(message) + 1;
+    if (line > message + length)
+        line = message + length;
+
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < 3; i++)
+    {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    int32_t status;
+    if (chdir(cwd) == -1)
+    {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, cwd, strerror(errno));
+        status = INVALID;
+    }
+    else
+        status = run_command_line(line);
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < 3; i++)
+        dup2(saved_fds[i], i);
+    fchdir(home_fd);
+
+    send(connection, &status, sizeof(status), MSG_NOSIGNAL);
+}
 
-            if (executables_in_dir != 0)
-            {
-                total_number_of_executables += executables_in_dir;
-                all_available_commands = realloc(all_available_commands,
-                                                 total_number_of_executables * sizeof(char *));
-                for (int i = 0; i < executables_in_dir; i++)
-                {
-                    all_available_commands[total_number_of_executables - executables_in_dir + i] = file_name_buffer[i];
-                }
-            }
-        }
-        path_tokenizer = strtok(NULL, ":");
+/**
+ * Keeps the command table, caches and job table warm and serves command
+ * lines from clients over a Unix socket, one at a time
+ * @return exit status of the server
+ */
+int run_server()
+{
+    struct sockaddr_un address;
+    if (server_socket_address(&address) && make_socket_directory(address.sun_path) == -1)
+        return INVALID;
+    struct sigaction sigpipe = {.sa_handler = handle_server_sigpipe, .sa_flags = SA_RESTART};
+    sigaction(SIGPIPE, &sigpipe, NULL);
+    int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listener == -1)
+    {
+        print_error("could not create the server socket.");
+        return INVALID;
+    }
+    // a socket that nobody answers on is left over from an earlier server
+    if (connect(listener, (struct sockaddr *)&address, sizeof(address)) == 0)
+    {
+        print_error("a server is already running on this socket.");
+        return INVALID;
+    }
+    close(listener);
+    unlink(address.sun_path);
+    listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    mode_t old_mask = umask(077); // only the owner may connect
+    int bound = bind(listener, (struct sockaddr *)&address, sizeof(address));
+    umask(old_mask);
+    if (bound == -1 || listen(listener, 16) == -1)
+    {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, address.sun_path, strerror(errno));
+        return INVALID;
     }
 
-    qsort(all_available_commands, total_number_of_executables, sizeof(char *), qstrcmp);
+    int saved_fds[3];
+    for (int i = 0; i < 3; i++)
+        saved_fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+    int home_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    fprintf(stderr, "%s: serving on %s\n", sysname, address.sun_path);
 
-    int unique_number_of_executables = 1;
-    for (int i = 1; i < total_number_of_executables; i++)
+    while (1)
     {
-        if (strcmp(all_available_commands[i], all_available_commands[i - 1]) != 0)
+        int connection = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (connection == -1)
         {
-            all_available_commands[unique_number_of_executables++] = all_available_commands[i];
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
         }
+        reap_background_jobs();
+        struct ucred peer;
+        socklen_t peer_length = sizeof(peer);
+        if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peer, &peer_length) == 0 && peer.uid == getuid())
+            serve_request(connection, saved_fds, home_fd);
+        close(connection);
     }
-    all_available_commands = realloc(all_available_commands, sizeof(char *) * unique_number_of_executables);
-    number_of_available_commands = unique_number_of_executables;
+    close(listener);
+    unlink(address.sun_path);
+    return INVALID;
 }
 
-int process_command(struct command_t *command, int parent_to_child_pipe[2]);
-
-int execute_command(struct command_t *command);
+// state every way of running a line needs, the command index is loaded separately
+void shell_init()
+{
+    trace_init();
+    completion_specs_init();
+    select_filter_kernels();
+    variables_init();
+}
 
-int execv_command(struct command_t *command);
+/**
+ * Sends a command line and this process's stdio to the warm server and waits
+ * for its exit status. Runs the line locally when no server is listening
+ * @param  argc number of words of the command line
+ * @param  argv words of the command line, joined with spaces
+ * @return      exit status of the command
+ */
+int run_client(int argc, char *argv[])
+{
+    char message[SERVER_MESSAGE_SIZE];
+    if (getcwd(message, PATH_MAX) == NULL)
+        strcpy(message, "/");
+    size_t length = strlen(message) + 1;
+    char *line = message + length;
+    for (int i = 0; i < argc; i++)
+    {
+        size_t word_length = strlen(argv[i]);
+        if (length + word_length + 2 > sizeof(message))
+        {
+            print_error("command line is too long.");
+            return INVALID;
+        }
+        memcpy(message + length, argv[i], word_length);
+        length += word_length;
+        message[length++] = i + 1 < argc ? ' ' : '\0';
+    }
+    if (argc == 0)
+        message[length++] = '\0';
 
-int execvp_command(struct command_t *command);
+    struct sockaddr_un address;
+    server_socket_address(&address);
+    int server = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (server != -1 && connect(server, (struct sockaddr *)&address, sizeof(address)) == 0)
+    {
+        // the terminal is only handed to a server of the same user, anyone could have bound the path
+        struct ucred peer;
+        socklen_t peer_length = sizeof(peer);
+        if (getsockopt(server, SOL_SOCKET, SO_PEERCRED, &peer, &peer_length) == -1 || peer.uid != getuid())
+        {
+            fprintf(stderr, "-%s: %s: the server belongs to another user\n", sysname, address.sun_path);
+            close(server);
+            return INVALID;
+        }
+    }
+    else
+    {
+        if (server != -1)
+            close(server);
+        shell_init();
+        int status = run_command_line(line);
+        trace_close();
+        return status;
+    }
 
-int process_command_child(struct command_t *command, const int *child_to_parent_pipe);
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {message, length};
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buf;
+    header.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int32_t status;
+    if (sendmsg(server, &header, MSG_NOSIGNAL) == -1 || recv(server, &status, sizeof(status), 0) != sizeof(status))
+    {
+        print_error("the server closed the connection.");
+        status = INVALID;
+    }
+    close(server);
+    return status;
+}
 
-int main()
+#ifndef SHELLGIBI_NO_MAIN
+int main(int argc, char *argv[])
 {
-
+    // the client only forwards its line, it needs none of the warm state
+    if (argc > 1 && strcmp(argv[1], "--client") == 0)
+        return run_client(argc - 2, argv + 2);
+
+    shell_init();
+    // scripts need no completion index
+    if (argc == 2 && argv[1][0] != '-')
+        return run_script_file(argv[1]);
+    uint64_t trace_start = trace_now();
     load_all_available_commands();
-    // ignore signals from childred to prevent orphan processes
-    signal(SIGCHLD, SIG_IGN);
+    trace_record(TRACE_LOAD_COMMANDS, trace_start);
+
+    if (argc > 1 && strcmp(argv[1], "--server") == 0)
+        return run_server();
+    if (argc > 1)
+    {
+        fprintf(stderr, "usage: %s [--server | --client <command line> | <script>]\n", argv[0]);
+        return INVALID;
+    }
 
     while (1)
     {
-        struct command_t *command = malloc(sizeof(struct command_t));
-        memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+        struct command_t *command = shell_calloc(MEMORY_COMMAND, 1, sizeof(struct command_t));
+
+        reap_background_jobs();
 
         int code;
         code = prompt(command);
 
         if (code == EXIT)
+        {
+            free_command(command);
             break;
+        }
 
+        struct timespec started, finished;
+        clock_gettime(CLOCK_MONOTONIC, &started);
         code = process_command(command, NULL);
         if (code == EXIT)
+        {
+            free_command(command);
             break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        last_command_seconds = elapsed_seconds(&started, &finished);
+        prompt_refresh_vcs();
+        record_history(command);
+
+        if (command->timed || stats_enabled())
+            print_command_stats(command);
 
         free_command(command);
     }
 
-    free(all_available_commands);
+    free_available_commands();
+    remove_cgroup_container();
+    trace_close();
     printf("\n");
     return 0;
 }
+#endif
 
+/**
+ * Ranks the available commands against the input with the fuzzy scorer
+ * @param  input_str typed part of the command name
+ * @return           matches, best first
+ */
 struct autocomplete_match *shellgibi_autocomplete(const char *input_str)
 {
-    int num_matches = 0;
-    char *command;
-    struct autocomplete_match *match = malloc(sizeof(struct autocomplete_match));
-    memset(match, 0, sizeof(struct autocomplete_match)); // set all bytes to 0
+    struct ranked_candidate *candidates = NULL;
+    int count = 0, capacity = 0;
+    uint64_t pattern_mask = fuzzy_char_mask(input_str);
 
     for (int i = 0; i < number_of_available_commands; i++)
     {
-        command = all_available_commands[i];
-        if (strncmp(command, input_str, strlen(input_str)) == 0)
-        {
-            if (num_matches == 0)
-            {
-                match->matches = (char **)malloc(sizeof(char *));
-            }
-            else
-            {
-                match->matches = (char **)realloc(match->matches, sizeof(char *) * (num_matches + 1));
-            }
-            match->matches[num_matches] = (char *)malloc(strlen(command) + 1);
-            strcpy(match->matches[num_matches++], command);
-        }
+        rank_candidate(&candidates, &count, &capacity, input_str, pattern_mask,
+                       all_available_commands[i], all_available_command_masks[i]);
     }
 
-    match->match_count = num_matches;
-    return match;
+    struct autocomplete_match *match = ranked_candidates_to_match(candidates, count);
+    shell_free(MEMORY_COMPLETION, candidates);
+    return match;
+}
+
+struct autocomplete_match *path_autocomplete(const char *input_str, bool directories_only);
+
+struct autocomplete_match *filename_autocomplete(const char *input_str)
+{
+    return path_autocomplete(input_str, false);
+}
+
+struct autocomplete_match *directory_autocomplete(const char *input_str)
+{
+    return path_autocomplete(input_str, true);
 }
 
-struct autocomplete_match *filename_autocomplete(const char *input_str)
+struct autocomplete_match *path_autocomplete(const char *input_str, bool directories_only)
 {
-    int num_matches = 0;
-    struct autocomplete_match *match = malloc(sizeof(struct autocomplete_match));
-    memset(match, 0, sizeof(struct autocomplete_match)); // set all bytes to 0
+    struct ranked_candidate *candidates = NULL;
+    int count = 0, capacity = 0;
+    uint64_t pattern_mask = fuzzy_char_mask(input_str);
+    char **names = NULL;
+    int name_count = 0;
 
     DIR *directory = opendir(".");
     struct dirent *directory_entry;
@@ -660,24 +6336,29 @@ struct autocomplete_match *filename_autocomplete(const char *input_str)
             {
                 continue;
             }
-            if (strncmp(directory_entry->d_name, input_str, strlen(input_str)) == 0)
+            if (directories_only && directory_entry->d_type != DT_DIR && directory_entry->d_type != DT_LNK &&
+                directory_entry->d_type != DT_UNKNOWN)
             {
-                if (num_matches == 0)
-                {
-                    match->matches = (char **)malloc(sizeof(char *));
-                }
-                else
-                {
-                    match->matches = (char **)realloc(match->matches, sizeof(char *) * (num_matches + 1));
-                }
-                match->matches[num_matches] = (char *)malloc(strlen(directory_entry->d_name) + 1);
-                strcpy(match->matches[num_matches++], directory_entry->d_name);
+                continue;
             }
+            uint64_t mask = fuzzy_char_mask(directory_entry->d_name);
+            if ((pattern_mask & ~mask) != 0)
+                continue;
+            // dirent names are only valid until the next readdir
+            if ((name_count & (name_count - 1)) == 0)
+                names = shell_realloc(MEMORY_COMPLETION, names, sizeof(char *) * (name_count ? name_count * 2 : 1));
+            names[name_count] = shell_strdup(MEMORY_COMPLETION, directory_entry->d_name);
+            rank_candidate(&candidates, &count, &capacity, input_str, pattern_mask, names[name_count], mask);
+            name_count++;
         }
         closedir(directory);
     }
 
-    match->match_count = num_matches;
+    struct autocomplete_match *match = ranked_candidates_to_match(candidates, count);
+    shell_free(MEMORY_COMPLETION, candidates);
+    for (int i = 0; i < name_count; i++)
+        shell_free(MEMORY_COMPLETION, names[i]);
+    shell_free(MEMORY_COMPLETION, names);
     return match;
 }
 
@@ -689,6 +6370,13 @@ int process_command(struct command_t *command, int parent_to_child_pipe[2])
         close(parent_to_child_pipe[1]);
     }
 
+    // exports of earlier lines reach environ before anything is started
+    if (parent_to_child_pipe == NULL)
+        refresh_environment();
+
+    if (command->script != NULL)
+        return run_script(command->script);
+
     int r;
     if (strcmp(command->name, "") == 0)
     {
@@ -699,6 +6387,138 @@ int process_command(struct command_t *command, int parent_to_child_pipe[2])
         return SUCCESS;
     }
 
+    // prefixes strip themselves off the line in any order: pin 0 time cmd, limit cpu=50% time cmd
+    struct placement placement = default_placement;
+    while (parent_to_child_pipe == NULL)
+    {
+        // time prefix: run the rest of the line and report stats of every stage
+        if (strcmp(command->name, "time") == 0)
+        {
+            if (command->arg_count == 0)
+            {
+                print_error("time requires a command.");
+                return INVALID;
+            }
+            shell_free(MEMORY_COMMAND, command->name);
+            command->name = command->args[0];
+            memmove(command->args, command->args + 1, sizeof(char *) * --command->arg_count);
+            command->timed = true;
+            continue;
+        }
+
+        // pin prefix: pin <spec> command... places this line, pin <spec> alone every later one
+        if (strcmp(command->name, "pin") == 0)
+        {
+            if (command->arg_count == 0)
+            {
+                print_placement(&default_placement);
+                return SUCCESS;
+            }
+            if (parse_placement(command->args[0], &placement) == -1)
+            {
+                fprintf(stderr, "-%s: pin: invalid placement %s, expected a cpu list, node:N, spread[:N] or off\n",
+                        sysname, command->args[0]);
+                return INVALID;
+            }
+            if (command->arg_count == 1)
+            {
+                default_placement = placement;
+                return SUCCESS;
+            }
+            shell_free(MEMORY_COMMAND, command->name);
+            shell_free(MEMORY_COMMAND, command->args[0]);
+            command->name = command->args[1];
+            memmove(command->args, command->args + 2, sizeof(char *) * (command->arg_count -= 2));
+            continue;
+        }
+
+        // limit prefix: limit cpu=50% mem=512M io=100 command... runs the whole line in a new cgroup
+        if (strcmp(command->name, "limit") == 0)
+        {
+            char cpu_max[64] = "", memory_max[64] = "", io_weight[64] = "";
+            int options = 0;
+            while (options < command->arg_count && strchr(command->args[options], '=') != NULL)
+            {
+                if (parse_limit(command->args[options], cpu_max, memory_max, io_weight, sizeof(cpu_max)) == -1)
+                {
+                    fprintf(stderr, "-%s: limit: invalid limit %s, expected cpu=N%%, mem=N[KMG] or io=N\n", sysname,
+                            command->args[options]);
+                    return INVALID;
+                }
+                options++;
+            }
+            if (options == command->arg_count)
+            {
+                print_error("limit requires a command.");
+                return INVALID;
+            }
+            struct job_cgroup *cgroup = create_job_cgroup(
+                cpu_max[0] ? cpu_max : NULL, memory_max[0] ? memory_max : NULL, io_weight[0] ? io_weight : NULL);
+            if (cgroup == NULL)
+                return INVALID;
+            shell_free(MEMORY_COMMAND, command->name);
+            for (int i = 0; i < options; i++)
+                shell_free(MEMORY_COMMAND, command->args[i]);
+            command->name = command->args[options];
+            memmove(command->args, command->args + options + 1, sizeof(char *) * (command->arg_count -= options + 1));
+            for (struct command_t *stage = command; stage; stage = stage->next)
+            {
+                release_job_cgroup(stage->cgroup); // an outer limit on the same line gives way
+                stage->cgroup = cgroup;
+                cgroup->references++;
+            }
+            release_job_cgroup(cgroup); // the stages hold it now
+            continue;
+        }
+
+        // monitor prefix: monitor [pipe=SIZE] cmd1 | cmd2 runs the stages concurrently and reports every link
+        if (strcmp(command->name, "monitor") == 0)
+        {
+            int pipe_size = 0;
+            if (command->arg_count > 0 && strncmp(command->args[0], "pipe=", 5) == 0)
+            {
+                char *end;
+                pipe_size = strtol(command->args[0] + 5, &end, 10);
+                if (*end == 'K' || *end == 'k')
+                    pipe_size <<= 10, end++;
+                else if (*end == 'M' || *end == 'm')
+                    pipe_size <<= 20, end++;
+                if (*end != '\0' || pipe_size <= 0)
+                {
+                    fprintf(stderr, "-%s: monitor: invalid pipe size %s\n", sysname, command->args[0] + 5);
+                    return INVALID;
+                }
+                shell_free(MEMORY_COMMAND, command->args[0]);
+                memmove(command->args, command->args + 1, sizeof(char *) * --command->arg_count);
+            }
+            if (command->arg_count == 0)
+            {
+                print_error("monitor requires a command.");
+                return INVALID;
+            }
+            shell_free(MEMORY_COMMAND, command->name);
+            command->name = command->args[0];
+            memmove(command->args, command->args + 1, sizeof(char *) * --command->arg_count);
+            assign_placement(command, &placement, true);
+            return run_monitored_pipeline(command, pipe_size);
+        }
+
+        // the stages of the default executor run one after another, spread has no cpu to give them
+        assign_placement(command, &placement, false);
+        break;
+    }
+
+    // shellstats reset clears the histograms of this shell, the dump runs in the child
+    if (strcmp(command->name, "shellstats") == 0 && command->arg_count == 1 && strcmp(command->args[0], "reset") == 0)
+    {
+        memset(trace_histograms, 0, sizeof(trace_histograms));
+        if (parent_to_child_pipe != NULL)
+        {
+            close(parent_to_child_pipe[0]);
+        }
+        return SUCCESS;
+    }
+
     if (strcmp(command->name, "exit") == 0)
     {
         if (parent_to_child_pipe != NULL)
@@ -708,6 +6528,23 @@ int process_command(struct command_t *command, int parent_to_child_pipe[2])
         return EXIT;
     }
 
+    // a function runs in the shell unless it is part of a pipeline or redirected, then it runs in the child
+    struct definition *function = find_function(command->name);
+    if (function != NULL && parent_to_child_pipe == NULL && command->next == NULL && command->redirects == NULL &&
+        !command->background)
+        return run_function(function, command);
+
+    // NAME=value, export NAME[=value], unset NAME, alias NAME=VALUE and unalias NAME change the shell itself,
+    // export and alias alone list
+    if (update_definitions(command) || update_variables(command))
+    {
+        if (parent_to_child_pipe != NULL)
+        {
+            close(parent_to_child_pipe[0]);
+        }
+        return SUCCESS;
+    }
+
     if (strcmp(command->name, "cd") == 0)
     {
         if (command->arg_count > 0)
@@ -715,6 +6552,8 @@ int process_command(struct command_t *command, int parent_to_child_pipe[2])
             r = chdir(command->args[0]);
             if (r == -1)
                 printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+            else
+                prompt_refresh_cwd();
             if (parent_to_child_pipe != NULL)
             {
                 close(parent_to_child_pipe[0]);
@@ -723,32 +6562,32 @@ int process_command(struct command_t *command, int parent_to_child_pipe[2])
         }
     }
 
-    if (strcmp(command->name, "psvis") == 0)
+    // psvis --watch runs in the forked child like the other builtins, snapshots load the module
+    if (strcmp(command->name, "psvis") == 0 && !(command->arg_count > 0 && strcmp(command->args[0], "--watch") == 0))
     {
-        long root_process = strtol(command->args[0], NULL, 10);
-
-        if (command->arg_count != 2)
+        // psvis <pid> <file> [pid|cpu|rss|threads] [top-N]
+        if (command->arg_count < 2 || command->arg_count > 4)
         {
-            print_error("psvis requires two arguments.");
+            print_error("psvis requires two arguments, optionally followed by a sort key and a top-N count.");
             return INVALID;
         }
+        long root_process = strtol(command->args[0], NULL, 10);
 
         pid_t pid_s1 = fork();
 
         if (pid_s1 == 0) //child process
         {
-            char temp1[50], temp2[50];
+            char temp1[50], temp2[50], sort_param[64], top_param[32];
             strcpy(temp1, "PID=");
             sprintf(temp2, "%d", (int)root_process);
             strcat(temp1, temp2);
+            if (command->arg_count > 2)
+                snprintf(sort_param, sizeof(sort_param), "sort=%s", command->args[2]);
+            if (command->arg_count > 3)
+                snprintf(top_param, sizeof(top_param), "top=%d", atoi(command->args[3]));
 
-            command->name = "sudo";
-            command->args = (char **)realloc(
-                command->args, sizeof(char) * (command->arg_count = 3));
-
-            command->args[0] = "insmod";
-            command->args[1] = "psvis.ko";
-            command->args[2] = temp1;
+            const char *module_words[] = {"insmod", "psvis.ko", temp1, sort_param, top_param};
+            set_command_words(command, "sudo", module_words, command->arg_count + 1);
             // loading the module
             return execvp_command(command);
         }
@@ -758,83 +6597,83 @@ int process_command(struct command_t *command, int parent_to_child_pipe[2])
             pid_t pid_s2 = fork();
             if (pid_s2 == 0)
             { // child process
-                command->arg_count = 2;
-                command->args = (char **)malloc(command->arg_count * sizeof(char *));
-                command->name = "sudo";
-                command->args[0] = "rmmod";
-                command->args[1] = "psvis";
+                set_command_words(command, "sudo", (const char *[]){"rmmod", "psvis"}, 2);
                 // removing the module
                 return execvp_command(command);
             }
             else
             {
                 waitpid(pid_s2, NULL, 0); // wait for child process to finish
-                char *fname = malloc(strlen(command->args[1]) + 1);
-                strcpy(fname, command->args[1]);
-                command->args = (char **)realloc(
-                    command->args, sizeof(char) * (command->arg_count = 2));
-                //command->arg_count = 2;
-                char *sudo_name = "sudo";
-                command->name = realloc(command->name, strlen(sudo_name) + 1);
-                strcpy(command->name, sudo_name);
-                //command->name = "sudo";
-                char *sudo_arg0 = "dmesg";
-                char *sudo_arg1 = "-c";
+                char *fname = shell_strdup(MEMORY_COMMAND, command->args[1]);
                 // in order to direct the output to the file
-                command->args[0] = realloc(command->args[0], strlen(sudo_arg0) + 1);
-                strcpy(command->args[0], sudo_arg0);
-                command->args[1] = realloc(command->args[1], strlen(sudo_arg1) + 1);
-                strcpy(command->args[1], sudo_arg1);
-                command->redirects[1] = malloc(strlen(fname) + 1);
-                strcpy(command->redirects[1], fname);
+                set_command_words(command, "sudo", (const char *[]){"dmesg", "-c"}, 2);
+                struct redirect to_file = {
+                    .type = REDIRECT_FILE, .fd = STDOUT_FILENO, .flags = O_WRONLY | O_CREAT | O_TRUNC, .path = fname};
+                add_redirect(command, &to_file);
             }
         }
     }
 
     // Ahmet Uysal Custom Command, prints the number of coronavirus cases in Turkey
+    // the page is fetched and scanned inside the shell, no child process is started
     if (strcmp(command->name, "corona") == 0)
     {
-        struct command_t *grep_for_corona_command = malloc(sizeof(struct command_t));
-        memset(grep_for_corona_command, 0, sizeof(struct command_t)); // set all bytes to 0
-        char temp_filename[16 + 1];
-        tmpnam(temp_filename);
-        char *grep_name = "grep";
-        grep_for_corona_command->name = malloc(strlen(grep_name) + 1);
-        strcpy(grep_for_corona_command->name, grep_name);
-        grep_for_corona_command->arg_count = 3;
-        grep_for_corona_command->args = malloc(grep_for_corona_command->arg_count * sizeof(char *));
-        char *grep_arg0 = "-Po";
-        grep_for_corona_command->args[0] = malloc(strlen(grep_arg0) + 1);
-        strcpy(grep_for_corona_command->args[0], grep_arg0);
-        char *grep_arg1 = "<td[^>]*> Turkey </td>(\\s*)<td[^>]*>\\K[0-9]*(?=</td>)";
-        grep_for_corona_command->args[1] = malloc(strlen(grep_arg1) + 1);
-        strcpy(grep_for_corona_command->args[1], grep_arg1);
-        grep_for_corona_command->args[2] = malloc(strlen(temp_filename) + 1);
-        strcpy(grep_for_corona_command->args[2], temp_filename);
-
-        // free old args
-        for (int i = 0; i < command->arg_count; ++i)
+        const char *url = command->arg_count > 0 ? command->args[0] : getenv("SHELLGIBI_CORONA_URL");
+        if (url == NULL)
+            url = CORONA_DEFAULT_URL;
+        if (parent_to_child_pipe != NULL)
         {
-            free(command->args[i]);
+            close(parent_to_child_pipe[0]);
+        }
+
+        char value[64];
+        // one byte is kept for the newline appended below
+        enum corona_result result = corona_fetch(url, value, sizeof(value) - 1);
+        if (result == CORONA_FAILED)
+        {
+            print_error("corona could not fetch the number of cases.");
+            return INVALID;
+        }
+        strcat(value, "\n");
+        if (command->next)
+        {
+            int argument_transfer_pipe[2];
+            pipe(argument_transfer_pipe);
+            write(argument_transfer_pipe[1], value, strlen(value));
+            close(argument_transfer_pipe[1]);
+            return process_command(command->next, argument_transfer_pipe);
         }
+        FILE *out = stdout;
+        struct redirect *to_file = find_file_redirect(command, STDOUT_FILENO);
+        if (to_file != NULL)
+            out = fopen(to_file->path, (to_file->flags & O_APPEND) ? "a" : "w");
+        if (out == NULL)
+        {
+            printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+            return INVALID;
+        }
+        fputs(value, out);
+        if (out != stdout)
+            fclose(out);
+        else
+            fflush(out);
+        return SUCCESS;
+    }
 
-        char *wget_name = "wget";
-        command->name = realloc(command->name, strlen(wget_name) + 1);
-        strcpy(command->name, "wget");
-        command->arg_count = 4;
-        command->args = realloc(command->args, command->arg_count * sizeof(char *));
-        char *wget_arg0 = "--quiet";
-        command->args[0] = malloc(strlen(wget_arg0) + 1);
-        strcpy(command->args[0], wget_arg0);
-        char *wget_arg1 = "--output-document";
-        command->args[1] = malloc(strlen(wget_arg1) + 1);
-        strcpy(command->args[1], wget_arg1);
-        command->args[2] = malloc(strlen(temp_filename) + 1);
-        strcpy(command->args[2], temp_filename);
-        char *wget_arg3 = "www.worldometers.info/coronavirus/";
-        command->args[3] = malloc(strlen(wget_arg3) + 1);
-        strcpy(command->args[3], wget_arg3);
-        command->next = grep_for_corona_command;
+    if (parent_to_child_pipe == NULL)
+        capture_describe(command);
+
+    // out N | cmd: the next stage reads the memfd of the capture as its stdin, nothing is copied
+    if (strcmp(command->name, "out") == 0 && command->next && command->arg_count == 1)
+    {
+        if (parent_to_child_pipe != NULL)
+        {
+            close(parent_to_child_pipe[0]);
+        }
+        int capture_input[2] = {open_capture(command->args[0]), -1};
+        if (capture_input[0] == -1)
+            return INVALID;
+        return process_command(command->next, capture_input);
     }
 
     int child_to_parent_pipe[2];
@@ -847,7 +6686,15 @@ int process_command(struct command_t *command, int parent_to_child_pipe[2])
         have_child_to_parent_pipe = 1;
     }
 
-    pid_t pid = fork();
+    // the output of the last stage passes through the shell, which keeps a copy in a memfd
+    bool capturing = command->next == NULL && capture_wanted(command) && pipe(child_to_parent_pipe) == 0;
+    if (capturing)
+        have_child_to_parent_pipe = 1;
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    uint64_t spawn_start = trace_now();
+    pid_t pid = command->cgroup ? fork_into_cgroup(command->cgroup) : fork();
     if (pid == 0)
     {
         // child
@@ -855,11 +6702,18 @@ int process_command(struct command_t *command, int parent_to_child_pipe[2])
         {
             dup2(parent_to_child_pipe[0], STDIN_FILENO);
         }
+        if (capturing)
+        {
+            dup2(child_to_parent_pipe[1], STDOUT_FILENO);
+            close(child_to_parent_pipe[1]);
+            close(child_to_parent_pipe[0]);
+        }
         return process_command_child(command, child_to_parent_pipe);
     }
     else
     {
         // parent site
+        trace_record(TRACE_SPAWN, spawn_start);
         if (parent_to_child_pipe != NULL)
         {
             close(parent_to_child_pipe[0]);
@@ -871,12 +6725,59 @@ int process_command(struct command_t *command, int parent_to_child_pipe[2])
             close(child_to_parent_pipe[1]);
         }
 
+        // grep, wc, head and tail after this stage run in a thread while it is running
+        struct filter_stage *filters = make_filter_chain(command->next);
+        if (filters != NULL)
+        {
+            fflush(stdout);
+            struct filter_chain chain = {.first = filters, .in_fd = child_to_parent_pipe[0], .out_fd = STDOUT_FILENO};
+            struct command_t *last = command->next;
+            while (last->next)
+                last = last->next;
+            chain.capture = capture_wanted(last) && capture_begin();
+            pthread_t worker;
+            if (pthread_create(&worker, NULL, filter_worker, &chain) == 0)
+            {
+                wait_for_stage(command, pid, &started);
+                pthread_join(worker, NULL);
+                free_filter_chain(filters);
+                capture_finish();
+                last_exit_status = chain.status;
+                return SUCCESS;
+            }
+            // no thread, the external tools run below and the last one captures its own output
+            free_filter_chain(filters);
+            capture_cancel();
+        }
+
+        if (capturing)
+        {
+            fflush(stdout);
+            capture_begin();
+            char buffer[1 << 16];
+            ssize_t read_chars;
+            while ((read_chars = read(child_to_parent_pipe[0], buffer, sizeof(buffer))) != 0)
+            {
+                if (read_chars == -1)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    break;
+                }
+                write_all(STDOUT_FILENO, buffer, read_chars);
+                capture_append(buffer, read_chars);
+            }
+            close(child_to_parent_pipe[0]);
+        }
+
         if (!command->background || command->next)
         {
             //            printf("Waiting for child process %d\n", pid);
-            waitpid(pid, NULL, 0); // wait for child process to finish
-                                   //            printf("Child process finished %s\n", command->name);
+            wait_for_stage(command, pid, &started); // wait for child process to finish
+                                                    //            printf("Child process finished %s\n", command->name);
         }
+        else
+            add_job(pid, command->name, command->cgroup ? command->cgroup->path : NULL);
 
         if (strcmp(command->name, "myfg") == 0 && command->arg_count == 1)
         {
@@ -885,6 +6786,12 @@ int process_command(struct command_t *command, int parent_to_child_pipe[2])
             int status;
             while (true)
             {
+                // our own background children stay as zombies until reaped
+                if (waitpid(process_pid, NULL, WNOHANG) == process_pid)
+                {
+                    remove_job(process_pid);
+                    break;
+                }
                 status = kill(process_pid, 0);
                 if (status == -1 && errno == ESRCH)
                 {
@@ -894,9 +6801,13 @@ int process_command(struct command_t *command, int parent_to_child_pipe[2])
             }
         }
 
+        if (capturing)
+            capture_finish();
+
         if (command->next)
         {
             // how to transfer pipe data?
+            uint64_t relay_start = trace_now();
             int argument_transfer_pipe[2];
             pipe(argument_transfer_pipe);
             char buffer[BUFSIZ];
@@ -907,6 +6818,7 @@ int process_command(struct command_t *command, int parent_to_child_pipe[2])
             }
             close(child_to_parent_pipe[0]);
             close(argument_transfer_pipe[1]);
+            trace_record(TRACE_RELAY, relay_start);
             return process_command(command->next, argument_transfer_pipe);
         }
 
@@ -916,145 +6828,506 @@ int process_command(struct command_t *command, int parent_to_child_pipe[2])
 
 int process_command_child(struct command_t *command, const int *child_to_parent_pipe)
 {
-    // Handle redirecting
-    int num_redirects_from_stdout = 0;
-    if (command->redirects[1] != NULL)
+    apply_placement(&command->placement);
+
+    // stdout goes to the next stage, stderr stays unless it is redirected too (2>&1)
+    if (command->next)
     {
-        num_redirects_from_stdout++;
+        dup2(child_to_parent_pipe[1], STDOUT_FILENO);
+        close(child_to_parent_pipe[1]);
+        close(child_to_parent_pipe[0]);
     }
-    if (command->redirects[2] != NULL)
+
+    if (apply_redirects(command) == -1)
+        exit(INVALID);
+
+    // NAME=value before a command only goes to the environment of that command
+    while (is_assignment(command->name) && command->arg_count > 0)
     {
-        num_redirects_from_stdout++;
+        char *equals = strchr(command->name, '=');
+        *equals = '\0';
+        setenv(command->name, equals + 1, 1);
+        shell_free(MEMORY_COMMAND, command->name);
+        command->name = command->args[0];
+        memmove(command->args, command->args + 1, sizeof(char *) * --command->arg_count);
     }
-    if (command->next)
+
+    return execute_command(command);
+}
+
+// directly executes the given command
+int execvp_command(struct command_t *command)
+{
+    command->args = (char **)shell_realloc(MEMORY_COMMAND, command->args, sizeof(char *) * (command->arg_count += 2));
+    // shift everything forward by 1
+    for (int i = command->arg_count - 2; i > 0; --i)
+        command->args[i] = command->args[i - 1];
+
+    // set args[0] as a copy of name
+    command->args[0] = shell_strdup(MEMORY_COMMAND, command->name);
+    // set args[arg_count-1] (last) to NULL
+    command->args[command->arg_count - 1] = NULL;
+    execvp(command->name, command->args); // exec+args+path
+    fprintf(stderr, ANSI_COLOR_ERROR "Error: In execvp call to command: %s\n" ANSI_COLOR_RESET, command->name);
+    _exit(1);
+}
+
+// one process of the tree watched by psvis --watch
+struct watch_node
+{
+    pid_t pid; // 0 for an empty slot, -1 for a removed one
+    pid_t ppid;
+    pid_t first_child, next_sibling; // 0 if none, newest child first
+    char name[32];
+};
+
+// pid -> process, open addressing with linear probing. Nodes refer to each
+// other by pid, so the links stay valid when the table is rehashed
+struct watch_tree
+{
+    struct watch_node *slots;
+    int capacity; // power of two
+    int used;     // live and removed slots
+    int count;    // live processes
+    pid_t root;
+    bool root_exited;
+    bool dirty; // changed since the last redraw
+    unsigned long events;
+};
+
+#define WATCH_REDRAW_MS 50
+#define WATCH_LINE_SIZE 256
+
+struct watch_node *watch_find(struct watch_tree *tree, pid_t pid)
+{
+    if (pid <= 0) // 0 and -1 mark free and removed slots
+        return NULL;
+    for (unsigned int i = (unsigned int)pid * 2654435761u;; i++)
     {
-        num_redirects_from_stdout++;
+        struct watch_node *node = &tree->slots[i & (tree->capacity - 1)];
+        if (node->pid == pid)
+            return node;
+        if (node->pid == 0)
+            return NULL;
     }
-    // if stdout is redirected to more than one file/pipe, store it in a temp file and copy later
-    int stdout_redirected_to_multiple_files = num_redirects_from_stdout > 1;
+}
 
-    // <: input is read from a file
-    if (command->redirects[0] != NULL)
+/**
+ * Adds a process under its parent, the parent must already be in the tree
+ * unless pid is the root. Adding a known pid returns the existing node
+ */
+struct watch_node *watch_insert(struct watch_tree *tree, pid_t pid, pid_t ppid, const char *name)
+{
+    struct watch_node *node = watch_find(tree, pid);
+    if (node != NULL)
+        return node;
+    char name_copy[32]; // name may point into the table that is about to be rehashed
+    snprintf(name_copy, sizeof(name_copy), "%s", name);
+    // keep the table at most half full, removed slots included
+    if ((tree->used + 1) * 2 > tree->capacity)
     {
-        freopen(command->redirects[0], "r", stdin);
+        struct watch_node *old_slots = tree->slots;
+        int old_capacity = tree->capacity;
+        if ((tree->count + 1) * 4 > tree->capacity)
+            tree->capacity *= 2;
+        tree->slots = calloc(tree->capacity, sizeof(struct watch_node));
+        tree->used = tree->count;
+        for (int i = 0; i < old_capacity; i++)
+        {
+            if (old_slots[i].pid <= 0)
+                continue;
+            unsigned int j = (unsigned int)old_slots[i].pid * 2654435761u;
+            while (tree->slots[j & (tree->capacity - 1)].pid != 0)
+                j++;
+            tree->slots[j & (tree->capacity - 1)] = old_slots[i];
+        }
+        free(old_slots);
     }
-
-    // >: output is written to a file, in write mode
-    if (!stdout_redirected_to_multiple_files && command->redirects[1] != NULL)
+    unsigned int i = (unsigned int)pid * 2654435761u;
+    while (tree->slots[i & (tree->capacity - 1)].pid > 0)
+        i++;
+    node = &tree->slots[i & (tree->capacity - 1)];
+    if (node->pid == 0)
+        tree->used++;
+    memset(node, 0, sizeof(struct watch_node));
+    node->pid = pid;
+    node->ppid = ppid;
+    memcpy(node->name, name_copy, sizeof(node->name));
+    tree->count++;
+    tree->dirty = true;
+    if (pid != tree->root)
     {
-        freopen(command->redirects[1], "w", stdout);
-        freopen(command->redirects[1], "w", stderr);
+        struct watch_node *parent = watch_find(tree, ppid);
+        node->next_sibling = parent->first_child;
+        parent->first_child = pid;
     }
-    // >>: output is written to a file, in append mode
-    else if (!stdout_redirected_to_multiple_files && command->redirects[2] != NULL)
+    return node;
+}
+
+// drops a process and everything below it, orphans are reparented out of the watched tree
+void watch_remove_subtree(struct watch_tree *tree, struct watch_node *node)
+{
+    pid_t child = node->first_child;
+    while (child != 0)
     {
-        freopen(command->redirects[2], "a", stdout);
-        freopen(command->redirects[2], "a", stderr);
+        struct watch_node *child_node = watch_find(tree, child);
+        child = child_node->next_sibling;
+        watch_remove_subtree(tree, child_node);
     }
-    else if (!stdout_redirected_to_multiple_files && command->next)
+    node->first_child = 0;
+    if (node->pid == tree->root)
+        return;
+    node->pid = -1;
+    tree->count--;
+}
+
+// handles the exit of a process of the tree
+void watch_exit(struct watch_tree *tree, pid_t pid)
+{
+    struct watch_node *node = watch_find(tree, pid);
+    if (node == NULL)
+        return;
+    tree->dirty = true;
+    if (pid == tree->root)
     {
-        dup2(child_to_parent_pipe[1], STDOUT_FILENO);
-        dup2(child_to_parent_pipe[1], STDERR_FILENO);
-        close(child_to_parent_pipe[1]);
-        return execute_command(command);
+        tree->root_exited = true;
+        watch_remove_subtree(tree, node);
+        return;
     }
-    else if (stdout_redirected_to_multiple_files)
+    struct watch_node *parent = watch_find(tree, node->ppid);
+    for (pid_t *link = &parent->first_child; *link != 0; link = &watch_find(tree, *link)->next_sibling)
     {
-        char temp_filename[16 + 1];
-        tmpnam(temp_filename);
-        pid_t pid2 = fork();
-        if (pid2 == 0)
+        if (*link == pid)
         {
-            // grandchild
-            FILE *tmp_file = fopen(temp_filename, "w");
-            dup2(fileno(tmp_file), STDOUT_FILENO);
-            return execute_command(command);
+            *link = node->next_sibling;
+            break;
         }
-        else
-        {
-            // wait for grandchild to finish and copy temp file to redirected files
-            int status;
-            waitpid(pid2, &status, 0);
-            printf("In commmand %s, waiting for child is done\n", command->name);
-            FILE *temp_fp = fopen(temp_filename, "r");
+    }
+    watch_remove_subtree(tree, node);
+}
 
-            FILE *trunc_fp = NULL, *append_fp = NULL;
+// a forked child starts with the name of its parent
+void watch_fork(struct watch_tree *tree, pid_t parent, pid_t child)
+{
+    struct watch_node *parent_node = watch_find(tree, parent);
+    if (parent_node != NULL && !(parent == tree->root && tree->root_exited))
+        watch_insert(tree, child, parent, parent_node->name);
+}
 
-            if (command->redirects[1] != NULL)
-            {
-                trunc_fp = fopen(command->redirects[1], "w");
-            }
+// after an exec the process has a new name, read from /proc unless the event carries it
+void watch_exec(struct watch_tree *tree, pid_t pid, const char *name)
+{
+    struct watch_node *node = watch_find(tree, pid);
+    if (node == NULL)
+        return;
+    char comm[32] = "";
+    if (name == NULL)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/comm", (int)pid);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            return; // already gone, the exit event follows
+        ssize_t n = read(fd, comm, sizeof(comm) - 1);
+        close(fd);
+        comm[n > 0 ? n : 0] = '\0';
+        comm[strcspn(comm, "\n")] = '\0';
+        name = comm;
+    }
+    snprintf(node->name, sizeof(node->name), "%s", name);
+    tree->dirty = true;
+}
 
-            if (command->redirects[2] != NULL)
+// (re)builds the tree below the root from a single pass over /proc
+bool watch_load_snapshot(struct watch_tree *tree)
+{
+    memset(tree->slots, 0, tree->capacity * sizeof(struct watch_node));
+    tree->used = tree->count = 0;
+    tree->root_exited = false;
+    refresh_proc_snapshot(true);
+    bool added = false;
+    for (int i = 0; i < proc_snapshot_count; i++)
+        if (proc_snapshot[i].pid == tree->root)
+            added = watch_insert(tree, tree->root, proc_snapshot[i].ppid, proc_snapshot[i].name) != NULL;
+    if (!added)
+        return false;
+    // pids are not in fork order once they wrap around, repeat until nothing attaches
+    while (added)
+    {
+        added = false;
+        for (int i = 0; i < proc_snapshot_count; i++)
+        {
+            struct proc_snapshot_entry *entry = &proc_snapshot[i];
+            if (watch_find(tree, entry->ppid) != NULL && watch_find(tree, entry->pid) == NULL)
             {
-                append_fp = fopen(command->redirects[2], "a");
+                watch_insert(tree, entry->pid, entry->ppid, entry->name);
+                added = true;
             }
+        }
+    }
+    return true;
+}
 
-            char buffer[BUFSIZ];
-            size_t chars_read = 0;
-            while ((chars_read = read(fileno(temp_fp), &buffer, sizeof(buffer))) > 0)
-            {
-                if (command->redirects[1] != NULL)
-                {
-                    write(fileno(trunc_fp), &buffer, chars_read);
-                }
+// subscribes to the fork, exec and exit events of the proc connector, needs CAP_NET_ADMIN
+int watch_open_connector()
+{
+    int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (fd == -1)
+        return -1;
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = CN_IDX_PROC;
+    int buffer_size = 1 << 20; // room for bursts of short-lived children
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+    char request[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))];
+    memset(request, 0, sizeof(request));
+    struct nlmsghdr *header = (struct nlmsghdr *)request;
+    header->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op));
+    header->nlmsg_type = NLMSG_DONE;
+    struct cn_msg *message = NLMSG_DATA(header);
+    message->id.idx = CN_IDX_PROC;
+    message->id.val = CN_VAL_PROC;
+    message->len = sizeof(enum proc_cn_mcast_op);
+    *(enum proc_cn_mcast_op *)message->data = PROC_CN_MCAST_LISTEN;
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 || send(fd, request, header->nlmsg_len, 0) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-                if (command->redirects[2] != NULL)
-                {
-                    write(fileno(append_fp), &buffer, chars_read);
-                }
+// applies the events waiting on the connector socket, resyncs from /proc if the kernel dropped some
+void watch_read_connector(int fd, struct watch_tree *tree)
+{
+    char buf[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+    ssize_t length = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (length == -1)
+    {
+        if (errno == ENOBUFS)
+            watch_load_snapshot(tree);
+        return;
+    }
+    int remaining = length;
+    for (struct nlmsghdr *header = (struct nlmsghdr *)buf; NLMSG_OK(header, remaining); header = NLMSG_NEXT(header, remaining))
+    {
+        if (header->nlmsg_type == NLMSG_NOOP || header->nlmsg_type == NLMSG_ERROR)
+            continue;
+        struct cn_msg *message = NLMSG_DATA(header);
+        struct proc_event *event = (struct proc_event *)message->data;
+        tree->events++;
+        // only whole processes are shown, thread events are skipped
+        switch (event->what)
+        {
+        case PROC_EVENT_FORK:
+            if (event->event_data.fork.child_pid == event->event_data.fork.child_tgid)
+                watch_fork(tree, event->event_data.fork.parent_tgid, event->event_data.fork.child_tgid);
+            break;
+        case PROC_EVENT_EXEC:
+            watch_exec(tree, event->event_data.exec.process_tgid, NULL);
+            break;
+        case PROC_EVENT_EXIT:
+            if (event->event_data.exit.process_pid == event->event_data.exit.process_tgid)
+                watch_exit(tree, event->event_data.exit.process_tgid);
+            break;
+        default:
+            break;
+        }
+    }
+}
 
-                if (command->next)
-                {
-                    write(child_to_parent_pipe[1], &buffer, sizeof(chars_read));
-                }
-            }
-            fclose(temp_fp);
+/**
+ * Applies events replayed from a file instead of the connector, one per line:
+ * "fork <parent> <child>", "exec <pid> [name]" or "exit <pid>"
+ * @return false at the end of the file
+ */
+bool watch_read_replay(FILE *events, struct watch_tree *tree)
+{
+    char line[256], name[32];
+    int first, second;
+    for (int i = 0; i < 64; i++)
+    {
+        if (fgets(line, sizeof(line), events) == NULL)
+            return false;
+        tree->events++;
+        if (sscanf(line, "fork %d %d", &first, &second) == 2)
+            watch_fork(tree, first, second);
+        else if (sscanf(line, "exec %d %31s", &first, name) == 2)
+            watch_exec(tree, first, name);
+        else if (sscanf(line, "exec %d", &first) == 1)
+            watch_exec(tree, first, NULL);
+        else if (sscanf(line, "exit %d", &first) == 1)
+            watch_exit(tree, first);
+    }
+    return true;
+}
+
+// writes the lines of a node and its children, depth first
+void watch_render_node(struct watch_tree *tree, struct watch_node *node, int depth, char (*frame)[WATCH_LINE_SIZE],
+                       int *line_count, int max_lines, int width)
+{
+    if (*line_count == max_lines)
+        return;
+    snprintf(frame[(*line_count)++], width, "%*s%s%s (%d)%s", depth * 2, "", depth ? "+- " : "", node->name,
+             (int)node->pid, node->pid == tree->root && tree->root_exited ? " exited" : "");
+    for (pid_t child = node->first_child; child != 0;)
+    {
+        struct watch_node *child_node = watch_find(tree, child);
+        watch_render_node(tree, child_node, depth + 1, frame, line_count, max_lines, width);
+        child = child_node->next_sibling;
+    }
+}
+
+/**
+ * Redraws only the rows that changed since the previous frame, with a single write
+ * @param frame          new rows
+ * @param line_count     number of new rows
+ * @param previous       rows on the screen, updated to frame
+ * @param previous_count number of rows on the screen, updated to line_count
+ */
+void watch_draw(char (*frame)[WATCH_LINE_SIZE], int line_count, char (*previous)[WATCH_LINE_SIZE], int *previous_count)
+{
+    int rows = line_count > *previous_count ? line_count : *previous_count;
+    char *out = malloc(rows * (WATCH_LINE_SIZE + 16) + 1);
+    size_t length = 0;
+    for (int i = 0; i < rows; i++)
+    {
+        if (i < line_count && i < *previous_count && strcmp(frame[i], previous[i]) == 0)
+            continue;
+        length += sprintf(out + length, "\033[%d;1H%s\033[K", i + 1, i < line_count ? frame[i] : "");
+    }
+    if (length > 0)
+        write(STDOUT_FILENO, out, length);
+    free(out);
+    memcpy(previous, frame, line_count * sizeof(*frame));
+    *previous_count = line_count;
+}
+
+/**
+ * Shows the process tree below root and keeps it up to date from fork, exec
+ * and exit events of the proc connector, or of the file in
+ * SHELLGIBI_PSVIS_EVENTS. /proc is only read once at the start. Quits on q
+ * @param  root pid at the top of the tree
+ * @return      SUCCESS, or INVALID if there is no event source or no such process
+ */
+int psvis_watch(pid_t root)
+{
+    // subscribe before the snapshot so that nothing between the two is missed
+    const char *replay_path = getenv("SHELLGIBI_PSVIS_EVENTS");
+    FILE *replay = NULL;
+    int source_fd;
+    if (replay_path != NULL && *replay_path)
+    {
+        replay = fopen(replay_path, "r");
+        source_fd = replay ? fileno(replay) : -1;
+    }
+    else
+        source_fd = watch_open_connector();
+    if (source_fd == -1)
+    {
+        print_error("psvis --watch needs the proc connector (CAP_NET_ADMIN) or SHELLGIBI_PSVIS_EVENTS.");
+        return INVALID;
+    }
 
-            if (command->redirects[1] != NULL)
-            {
-                fclose(trunc_fp);
-            }
-            if (command->redirects[2] != NULL)
-            {
-                fclose(append_fp);
-            }
+    struct watch_tree tree;
+    memset(&tree, 0, sizeof(tree));
+    tree.capacity = 1024;
+    tree.slots = calloc(tree.capacity, sizeof(struct watch_node));
+    tree.root = root;
+    if (!watch_load_snapshot(&tree))
+    {
+        fprintf(stderr, "-%s: psvis: process %d not found\n", sysname, (int)root);
+        return INVALID;
+    }
 
-            if (command->next)
+    struct winsize window = {24, 80, 0, 0};
+    ioctl(STDOUT_FILENO, TIOCGWINSZ, &window);
+    int max_lines = window.ws_row > 1 ? window.ws_row : 24;
+    int width = window.ws_col > 1 && window.ws_col < WATCH_LINE_SIZE ? window.ws_col : WATCH_LINE_SIZE;
+    char (*frame)[WATCH_LINE_SIZE] = calloc(max_lines, WATCH_LINE_SIZE);
+    char (*previous)[WATCH_LINE_SIZE] = calloc(max_lines, WATCH_LINE_SIZE);
+    int previous_count = 0;
+
+    struct termios backup_termios, raw_termios;
+    bool terminal = tcgetattr(STDIN_FILENO, &backup_termios) == 0;
+    if (terminal)
+    {
+        raw_termios = backup_termios;
+        raw_termios.c_lflag &= ~(ICANON | ECHO);
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw_termios);
+    }
+    // the alternate screen keeps the scrollback intact, the cursor is hidden while drawing
+    printf("\033[?1049h\033[?25l\033[H\033[2J");
+    fflush(stdout);
+
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {source_fd, POLLIN, 0}};
+    int source_open = 1;
+    struct timespec last_draw = {0, 0}, now;
+    tree.dirty = true;
+    while (1)
+    {
+        // bursts of events are coalesced into one redraw every WATCH_REDRAW_MS
+        int timeout = -1;
+        if (tree.dirty)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double since = elapsed_seconds(&last_draw, &now) * 1000;
+            if (since >= WATCH_REDRAW_MS)
             {
-                close(child_to_parent_pipe[1]);
+                int line_count = 0;
+                watch_render_node(&tree, watch_find(&tree, root), 0, frame + 1, &line_count, max_lines - 1, width);
+                snprintf(frame[0], width, "psvis --watch %d: %d processes, %lu events, q to quit", (int)root, tree.count,
+                         tree.events);
+                watch_draw(frame, line_count + 1, previous, &previous_count);
+                tree.dirty = false;
+                last_draw = now;
             }
-
-            remove(temp_filename);
-            return SUCCESS;
+            else
+                timeout = WATCH_REDRAW_MS - (int)since;
+        }
+        if (poll(fds, 1 + source_open, timeout) == -1 && errno != EINTR)
+            break;
+        if (fds[0].revents)
+        {
+            char key;
+            if (read(STDIN_FILENO, &key, 1) <= 0 || key == 'q')
+                break;
+        }
+        if (source_open && fds[1].revents)
+        {
+            if (replay)
+                source_open = watch_read_replay(replay, &tree);
+            else
+                watch_read_connector(source_fd, &tree);
         }
-        // we don't need to redirect to multiple files
-        // directly run the execute_command
     }
-    return execute_command(command);
-}
-
-// directly executes the given command
-int execvp_command(struct command_t *command)
-{
-    command->args = (char **)realloc(
-        command->args, sizeof(char *) * (command->arg_count += 2));
-    // shift everything forward by 1
-    for (int i = command->arg_count - 2; i > 0; --i)
-        command->args[i] = command->args[i - 1];
 
-    // set args[0] as a copy of name
-    command->args[0] = strdup(command->name);
-    // set args[arg_count-1] (last) to NULL
-    command->args[command->arg_count - 1] = NULL;
-    execvp(command->name, command->args); // exec+args+path
-    fprintf(stderr, ANSI_COLOR_ERROR "Error: In execvp call to command: %s\n" ANSI_COLOR_RESET, command->name);
-    _exit(1);
+    printf("\033[?25h\033[?1049l");
+    fflush(stdout);
+    if (terminal)
+        tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+    if (replay)
+        fclose(replay);
+    else
+        close(source_fd);
+    free(frame);
+    free(previous);
+    free(tree.slots);
+    return SUCCESS;
 }
 
 // responsible for executing both built-in and external commands
 int execute_command(struct command_t *command)
 {
+    // functions come before builtins and the PATH
+    struct definition *function = find_function(command->name);
+    if (function != NULL)
+    {
+        run_function(function, command);
+        exit(last_exit_status);
+    }
 
     if (strcmp(command->name, "myjobs") == 0)
     {
@@ -1064,20 +7337,75 @@ int execute_command(struct command_t *command)
             print_warning("myjobs does not accept any arguments, arguments are omitted");
         }
 
-        char *current_user = getenv("USER");
-        command->name = "ps";
-        // add 4 extra arguments for ps -U current_user -o pid,cmd,s
-        command->args = (char **)realloc(
-            command->args, sizeof(char *) * (command->arg_count = 4));
-
-        command->args[0] = "-U";
-        command->args[1] = current_user;
-        command->args[2] = "-o";
-        command->args[3] = "pid,cmd,s";
+        char current_user[32];
+        if (getenv("USER") != NULL)
+            snprintf(current_user, sizeof(current_user), "%s", getenv("USER"));
+        else
+            snprintf(current_user, sizeof(current_user), "%d", (int)getuid());
+        // ps -U current_user -o pid,cmd,s
+        set_command_words(command, "ps", (const char *[]){"-U", current_user, "-o", "pid,cmd,s"}, 4);
 
         return execvp_command(command);
     }
 
+    if (strcmp(command->name, "psvis") == 0) // only psvis --watch gets here
+    {
+        if (command->arg_count != 2)
+        {
+            print_error("psvis --watch requires only one argument <PID>");
+            exit(INVALID);
+        }
+        exit(psvis_watch(strtol(command->args[1], NULL, 10)));
+    }
+
+    if (strcmp(command->name, "alias") == 0)
+        exit(print_aliases(command));
+
+    // export without arguments, the child holds the shell's variables as they were at fork time
+    if (strcmp(command->name, "export") == 0)
+    {
+        print_exported_variables();
+        exit(SUCCESS);
+    }
+
+    // the job table of the child is the shell's table at fork time
+    if (strcmp(command->name, "jobs") == 0)
+    {
+        print_jobs();
+        exit(SUCCESS);
+    }
+
+    // the forked child holds a copy of the histograms as they were at fork time
+    if (strcmp(command->name, "shellstats") == 0)
+    {
+        print_trace_histograms(stdout);
+        exit(SUCCESS);
+    }
+
+    // the child is a copy of the shell, its counters are the ones of the shell at fork
+    if (strcmp(command->name, "shellmem") == 0)
+    {
+        print_memory_usage(stdout);
+        exit(SUCCESS);
+    }
+
+    // out N writes a saved output again, out alone lists the captures
+    if (strcmp(command->name, "out") == 0)
+    {
+        if (command->arg_count == 0)
+        {
+            print_captures();
+            exit(SUCCESS);
+        }
+        if (command->arg_count > 1)
+        {
+            print_error("out takes the number of one capture, -1 for the last one.");
+            exit(INVALID);
+        }
+        fflush(stdout);
+        exit(write_capture(command->args[0]));
+    }
+
     if (strcmp(command->name, "pause") == 0)
     {
         if (command->arg_count != 1)
@@ -1145,9 +7473,7 @@ int execute_command(struct command_t *command)
 
         fclose(cronjob_file);
 
-        command->name = "crontab";
-        command->args = realloc(command->args, (command->arg_count = 1) * sizeof(char *));
-        command->args[0] = "new-cronjob.txt";
+        set_command_words(command, "crontab", (const char *[]){"new-cronjob.txt"}, 1);
         return execvp_command(command);
     }
 
@@ -1187,8 +7513,7 @@ int execute_command(struct command_t *command)
 
             fclose(cronjob_hw_file);
 
-            command->name = "crontab";
-            command->args[0] = "hw-cronjob.txt";
+            set_command_words(command, "crontab", (const char *[]){"hw-cronjob.txt"}, 1);
             return execvp_command(command);
         }
     }
@@ -1200,22 +7525,21 @@ int execute_command(struct command_t *command)
 int execv_command(struct command_t *command)
 {
     // increase args size by 2
-    command->args = (char **)realloc(
-        command->args, sizeof(char *) * (command->arg_count += 2));
+    command->args = (char **)shell_realloc(MEMORY_COMMAND, command->args, sizeof(char *) * (command->arg_count += 2));
 
     // shift everything forward by 1
     for (int i = command->arg_count - 2; i > 0; --i)
         command->args[i] = command->args[i - 1];
 
     // set args[0] as a copy of name
-    command->args[0] = strdup(command->name);
+    command->args[0] = shell_strdup(MEMORY_COMMAND, command->name);
     // set args[arg_count-1] (last) to NULL
     command->args[command->arg_count - 1] = NULL;
     char *path = getenv("PATH");
     char *path_tokenizer = strtok(path, ":");
     while (path_tokenizer != NULL)
     {
-        char full_path[strlen(path_tokenizer) + strlen(command->name) + 1];
+        char full_path[strlen(path_tokenizer) + strlen(command->name) + 2];
         combine_path(full_path, path_tokenizer, command->name);
         execv(full_path, command->args);
         path_tokenizer = strtok(NULL, ":");
@@ -1226,6 +7550,619 @@ int execv_command(struct command_t *command)
     exit(UNKNOWN);
 }
 
+uint64_t trace_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+int trace_bucket_index(uint64_t value)
+{
+    if (value < TRACE_SUB_BUCKETS)
+        return value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - TRACE_SUB_BUCKET_BITS;
+    return ((msb - TRACE_SUB_BUCKET_BITS + 1) << TRACE_SUB_BUCKET_BITS) + ((value >> shift) & (TRACE_SUB_BUCKETS - 1));
+}
+
+// smallest value that falls into the given bucket
+uint64_t trace_bucket_value(int index)
+{
+    if (index < TRACE_SUB_BUCKETS)
+        return index;
+    int msb = (index >> TRACE_SUB_BUCKET_BITS) + TRACE_SUB_BUCKET_BITS - 1;
+    uint64_t sub_bucket = index & (TRACE_SUB_BUCKETS - 1);
+    return (TRACE_SUB_BUCKETS + sub_bucket) << (msb - TRACE_SUB_BUCKET_BITS);
+}
+
+/**
+ * Opens the Chrome trace-event file named by SHELLGIBI_TRACE, if set.
+ * The file can be loaded in chrome://tracing or ui.perfetto.dev
+ */
+void trace_init()
+{
+    char *trace_path = getenv("SHELLGIBI_TRACE");
+    if (trace_path == NULL || trace_path[0] == '\0')
+        return;
+    trace_fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd == -1)
+    {
+        print_warning("could not open SHELLGIBI_TRACE file, tracing is disabled");
+        return;
+    }
+    write(trace_fd, "[\n", 2);
+}
+
+void trace_close()
+{
+    if (trace_fd == -1)
+        return;
+    write(trace_fd, "\n]\n", 3);
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+/**
+ * Records the duration of a phase that started at start_ns.
+ * Histogram updates are lock-free atomic increments
+ * @param phase    phase that finished
+ * @param start_ns trace_now() value taken when the phase started
+ */
+void trace_record(enum trace_phase phase, uint64_t start_ns)
+{
+    uint64_t end_ns = trace_now();
+    uint64_t duration = end_ns - start_ns;
+    struct latency_histogram *histogram = &trace_histograms[phase];
+
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total_ns, duration, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->buckets[trace_bucket_index(duration)], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (duration > max &&
+           !__atomic_compare_exchange_n(&histogram->max_ns, &max, duration, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    if (trace_fd != -1)
+    {
+        char event[256];
+        int len = snprintf(event, sizeof(event),
+                           "%s{\"name\":\"%s\",\"cat\":\"shellgibi\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                           trace_events_written++ ? ",\n" : "", trace_phase_names[phase],
+                           start_ns / 1e3, duration / 1e3, (int)getpid(), (int)getpid());
+        write(trace_fd, event, len);
+    }
+}
+
+// value below which the given fraction of the samples fall
+uint64_t trace_histogram_percentile(struct latency_histogram *histogram, double fraction)
+{
+    uint64_t target = (uint64_t)(histogram->count * fraction);
+    uint64_t seen = 0;
+    for (int i = 0; i < TRACE_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen > target)
+            return trace_bucket_value(i);
+    }
+    return histogram->max_ns;
+}
+
+void print_trace_histograms(FILE *out)
+{
+    fprintf(out, "%-14s %8s %10s %10s %10s %10s %10s\n", "phase", "count", "mean(us)", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+    for (int phase = 0; phase < TRACE_PHASE_COUNT; phase++)
+    {
+        struct latency_histogram *histogram = &trace_histograms[phase];
+        if (histogram->count == 0)
+        {
+            fprintf(out, "%-14s %8d %10s %10s %10s %10s %10s\n", trace_phase_names[phase], 0, "-", "-", "-", "-", "-");
+            continue;
+        }
+        fprintf(out, "%-14s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", trace_phase_names[phase],
+                (unsigned long long)histogram->count,
+                histogram->total_ns / 1e3 / histogram->count,
+                trace_histogram_percentile(histogram, 0.50) / 1e3,
+                trace_histogram_percentile(histogram, 0.90) / 1e3,
+                trace_histogram_percentile(histogram, 0.99) / 1e3,
+                histogram->max_ns / 1e3);
+    }
+}
+
+// resident set size of the shell in bytes, 0 if /proc is not mounted
+long read_resident_bytes()
+{
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL)
+        return 0;
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// live blocks and bytes of every subsystem, then what malloc and the kernel see
+void print_memory_usage(FILE *out)
+{
+    long total_count = 0, total_bytes = 0;
+    unsigned long total_allocations = 0;
+    fprintf(out, "%-12s %10s %12s %12s %14s\n", "subsystem", "blocks", "bytes", "peak", "allocations");
+    for (int subsystem = 0; subsystem < MEMORY_SUBSYSTEM_COUNT; subsystem++)
+    {
+        struct memory_account *account = &memory_accounts[subsystem];
+        fprintf(out, "%-12s %10ld %12ld %12ld %14lu\n", memory_subsystem_names[subsystem], account->live_count,
+                account->live_bytes, account->peak_bytes, account->allocations);
+        total_count += account->live_count;
+        total_bytes += account->live_bytes;
+        total_allocations += account->allocations;
+    }
+    fprintf(out, "%-12s %10ld %12ld %12s %14lu\n", "total", total_count, total_bytes, "-", total_allocations);
+    struct mallinfo2 info = mallinfo2();
+    fprintf(out, "malloc: %zu bytes in use, %zu free in the arena, %zu mapped\n", info.uordblks, info.fordblks,
+            info.hblkhd);
+    fprintf(out, "resident: %ld bytes\n", read_resident_bytes());
+    if (capture_count > 0)
+        fprintf(out, "captures: %d in memfds, %zu bytes\n", capture_count, capture_total);
+}
+
+// conditional request state of the last corona page, kept for the whole session
+struct http_cache_entry
+{
+    char *url;
+    char *etag;
+    char *last_modified;
+    char value[64];
+};
+
+struct http_cache_entry corona_cache;
+
+// incremental html scanner, finds the cell right after the <td> holding the country
+struct corona_scanner
+{
+    const char *country;
+    bool in_tag;
+    bool in_cell;
+    bool found_country;
+    bool done;
+    char tag[8];
+    int tag_len;
+    char text[128];
+    int text_len;
+    char value[64];
+};
+
+// decodes Transfer-Encoding: chunked bodies as they arrive
+struct chunk_decoder
+{
+    bool chunked;
+    int state; // 0: chunk size line, 1: chunk data, 2: data crlf, 3: last chunk, 4: chunk extension
+    long remaining;
+};
+
+void corona_scanner_cell_end(struct corona_scanner *scanner)
+{
+    char *text = scanner->text;
+    int len = scanner->text_len;
+    while (len > 0 && strchr(" \t\r\n", text[0]) != NULL) // trim left whitespace
+    {
+        text++;
+        len--;
+    }
+    while (len > 0 && strchr(" \t\r\n", text[len - 1]) != NULL)
+        len--; // trim right whitespace
+    text[len] = 0;
+
+    if (scanner->found_country)
+    {
+        // keep the digits, the page may group thousands with commas
+        int j = 0;
+        for (int i = 0; i < len && j < sizeof(scanner->value) - 1; i++)
+            if (text[i] >= '0' && text[i] <= '9')
+                scanner->value[j++] = text[i];
+        scanner->value[j] = 0;
+        scanner->done = true;
+    }
+    else if (strcmp(text, scanner->country) == 0)
+        scanner->found_country = true;
+}
+
+/**
+ * Feeds a piece of the html body to the scanner
+ * @return 1 once the value cell is parsed and the rest of the page can be dropped
+ */
+int corona_scanner_feed(struct corona_scanner *scanner, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len && !scanner->done; i++)
+    {
+        char c = data[i];
+        if (c == '<')
+        {
+            scanner->in_tag = true;
+            scanner->tag_len = 0;
+            continue;
+        }
+        if (scanner->in_tag)
+        {
+            if (c == '>' || c == ' ' || c == '\t' || c == '\n' || c == '\r')
+            {
+                if (scanner->tag_len >= 0)
+                {
+                    scanner->tag[scanner->tag_len] = 0;
+                    if (strcasecmp(scanner->tag, "td") == 0)
+                    {
+                        scanner->in_cell = true;
+                        scanner->text_len = 0;
+                    }
+                    else if (strcasecmp(scanner->tag, "/td") == 0 && scanner->in_cell)
+                    {
+                        scanner->in_cell = false;
+                        corona_scanner_cell_end(scanner);
+                    }
+                    else if (strcasecmp(scanner->tag, "/tr") == 0)
+                        scanner->found_country = false;
+                }
+                scanner->tag_len = -1; // name is over, skip attributes
+                if (c == '>')
+                    scanner->in_tag = false;
+            }
+            else if (scanner->tag_len >= 0 && scanner->tag_len < sizeof(scanner->tag) - 1)
+                scanner->tag[scanner->tag_len++] = c;
+            else
+                scanner->tag_len = -1; // too long to be td
+            continue;
+        }
+        if (scanner->in_cell && scanner->text_len < sizeof(scanner->text) - 1)
+            scanner->text[scanner->text_len++] = c;
+    }
+    return scanner->done;
+}
+
+// passes the payload of a (possibly chunked) body to the scanner
+int chunk_decoder_feed(struct chunk_decoder *decoder, struct corona_scanner *scanner, const char *data, size_t len)
+{
+    if (!decoder->chunked)
+        return corona_scanner_feed(scanner, data, len);
+    size_t i = 0;
+    while (i < len && decoder->state != 3)
+    {
+        if (decoder->state == 0)
+        {
+            char c = data[i++];
+            if (c == '\n')
+                decoder->state = decoder->remaining == 0 ? 3 : 1;
+            else if (c >= '0' && c <= '9')
+                decoder->remaining = decoder->remaining * 16 + (c - '0');
+            else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+                decoder->remaining = decoder->remaining * 16 + ((c | 0x20) - 'a' + 10);
+            else if (c == ';')
+                decoder->state = 4;
+        }
+        else if (decoder->state == 4) // extensions are skipped until the newline
+        {
+            if (data[i++] == '\n')
+                decoder->state = decoder->remaining == 0 ? 3 : 1;
+        }
+        else if (decoder->state == 1)
+        {
+            size_t n = len - i < decoder->remaining ? len - i : decoder->remaining;
+            if (corona_scanner_feed(scanner, data + i, n))
+                return 1;
+            i += n;
+            decoder->remaining -= n;
+            if (decoder->remaining == 0)
+                decoder->state = 2;
+        }
+        else if (data[i++] == '\n') // crlf after the chunk data
+            decoder->state = 0;
+    }
+    return scanner->done;
+}
+
+char *http_header_value(char *headers, const char *name)
+{
+    size_t name_len = strlen(name);
+    for (char *line = strstr(headers, "\r\n"); line != NULL; line = strstr(line, "\r\n"))
+    {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':')
+        {
+            char *value = line + name_len + 1;
+            while (*value == ' ')
+                value++;
+            return strndup(value, strcspn(value, "\r\n"));
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Resolves the Location of a redirect against the url it was received for
+ * @param base     url of the redirected request, with or without http:// or https://
+ * @param location value of the Location header
+ * @return malloc'd absolute url
+ */
+char *resolve_location(const char *base, const char *location)
+{
+    if (strncmp(location, "http://", 7) == 0 || strncmp(location, "https://", 8) == 0)
+        return strdup(location);
+    const char *scheme = strncmp(base, "https://", 8) == 0 ? "https:" : "http:";
+    size_t location_len = strlen(location);
+    if (strncmp(location, "//", 2) == 0) // scheme relative
+    {
+        char *url = malloc(strlen(scheme) + location_len + 1);
+        sprintf(url, "%s%s", scheme, location);
+        return url;
+    }
+
+    if (strncmp(base, "http://", 7) == 0)
+        base += 7;
+    else if (strncmp(base, "https://", 8) == 0)
+        base += 8;
+    size_t host_len = strcspn(base, "/");
+    size_t keep = host_len;
+    if (location[0] != '/')
+    {
+        // relative to the directory of the base path, the query is not part of it
+        size_t path_len = strcspn(base + host_len, "?#");
+        for (size_t i = 0; i < path_len; i++)
+            if (base[host_len + i] == '/')
+                keep = host_len + i + 1;
+    }
+    char *url = malloc(strlen(scheme) + 2 + keep + 1 + location_len + 1);
+    int len = sprintf(url, "%s//%.*s", scheme, (int)keep, base);
+    if (keep == host_len && location[0] != '/')
+        url[len++] = '/';
+    strcpy(url + len, location);
+    return url;
+}
+
+// connection of a request, ssl is NULL for plain http
+struct http_connection
+{
+    int fd;
+    SSL *ssl;
+};
+
+ssize_t http_read(struct http_connection *connection, void *buffer, size_t size)
+{
+    if (connection->ssl == NULL)
+        return read(connection->fd, buffer, size);
+    int n = SSL_read(connection->ssl, buffer, size > INT_MAX ? INT_MAX : size);
+    return n > 0 ? n : (SSL_get_error(connection->ssl, n) == SSL_ERROR_ZERO_RETURN ? 0 : -1);
+}
+
+ssize_t http_write(struct http_connection *connection, const void *data, size_t length)
+{
+    if (connection->ssl == NULL)
+        return send(connection->fd, data, length, MSG_NOSIGNAL);
+    int n = SSL_write(connection->ssl, data, length);
+    return n > 0 ? n : -1;
+}
+
+void http_close(struct http_connection *connection)
+{
+    if (connection->ssl != NULL)
+        SSL_free(connection->ssl); // no close_notify, the response was read or given up on
+    close(connection->fd);
+}
+
+// TLS settings of the session: the system trust store, certificates and host names are verified
+SSL_CTX *tls_context;
+
+/**
+ * Runs the TLS handshake on a connected socket
+ * @param  host name the certificate has to be valid for
+ * @return      the session, NULL if the handshake or the verification failed
+ */
+SSL *tls_connect(int fd, const char *host)
+{
+    if (tls_context == NULL)
+    {
+        tls_context = SSL_CTX_new(TLS_client_method());
+        if (tls_context == NULL)
+            return NULL;
+        SSL_CTX_set_default_verify_paths(tls_context);
+        SSL_CTX_set_verify(tls_context, SSL_VERIFY_PEER, NULL);
+        SSL_CTX_set_min_proto_version(tls_context, TLS1_2_VERSION);
+    }
+    SSL *ssl = SSL_new(tls_context);
+    if (ssl == NULL)
+        return NULL;
+    SSL_set_fd(ssl, fd);
+    SSL_set_tlsext_host_name(ssl, host);
+    SSL_set1_host(ssl, host);
+    if (SSL_connect(ssl) != 1)
+    {
+        SSL_free(ssl);
+        return NULL;
+    }
+    return ssl;
+}
+
+/**
+ * Does one HTTP/1.1 GET, over TLS for https, conditional on the cached
+ * ETag/Last-Modified. Reading stops as soon as the scanner finds the row
+ * @param url        http:// or https:// url of the page
+ * @param value      filled with the number of cases
+ * @param value_size size of value
+ * @param location   set to the malloc'd Location of a 3xx response, NULL otherwise
+ * @return CORONA_FOUND or CORONA_FAILED
+ */
+enum corona_result corona_request(const char *url, char *value, size_t value_size, char **location)
+{
+    *location = NULL;
+    // the validators only apply to the url they were received for
+    int cached = corona_cache.url != NULL && strcmp(corona_cache.url, url) == 0;
+    const char *full_url = url;
+    bool tls = strncmp(url, "https://", 8) == 0;
+    if (tls)
+        url += 8;
+    else if (strncmp(url, "http://", 7) == 0)
+        url += 7;
+
+    char host[256], port[8];
+    strcpy(port, tls ? "443" : "80");
+    const char *path = strchr(url, '/');
+    size_t host_len = path ? path - url : strlen(url);
+    if (path == NULL)
+        path = "/";
+    if (host_len >= sizeof(host))
+        return CORONA_FAILED;
+    memcpy(host, url, host_len);
+    host[host_len] = 0;
+    char *colon = strchr(host, ':');
+    if (colon != NULL)
+    {
+        *colon = 0;
+        snprintf(port, sizeof(port), "%s", colon + 1);
+    }
+
+    struct addrinfo hints, *addresses, *address;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &addresses) != 0)
+        return CORONA_FAILED;
+    int fd = -1;
+    for (address = addresses; address != NULL; address = address->ai_next)
+    {
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (fd == -1)
+            continue;
+        struct timeval timeout = {10, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addresses);
+    if (fd == -1)
+        return CORONA_FAILED;
+    struct http_connection connection = {fd, NULL};
+    if (tls && (connection.ssl = tls_connect(fd, host)) == NULL)
+    {
+        fprintf(stderr, "-%s: corona: TLS handshake with %s failed\n", sysname, host);
+        close(fd);
+        return CORONA_FAILED;
+    }
+
+    char request[2048];
+    int len = snprintf(request, sizeof(request),
+                       "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: %s\r\nAccept-Encoding: identity\r\nConnection: close\r\n",
+                       path, host, sysname);
+    if (cached && corona_cache.etag)
+        len += snprintf(request + len, sizeof(request) - len, "If-None-Match: %s\r\n", corona_cache.etag);
+    if (cached && corona_cache.last_modified)
+        len += snprintf(request + len, sizeof(request) - len, "If-Modified-Since: %s\r\n", corona_cache.last_modified);
+    len += snprintf(request + len, sizeof(request) - len, "\r\n");
+    if (http_write(&connection, request, len) != len)
+    {
+        http_close(&connection);
+        return CORONA_FAILED;
+    }
+
+    // read until the end of the headers, the rest of the buffer is body
+    char buffer[16384 + 1];
+    size_t received = 0;
+    char *body = NULL;
+    ssize_t n;
+    while (body == NULL && received < sizeof(buffer) - 1 &&
+           (n = http_read(&connection, buffer + received, sizeof(buffer) - 1 - received)) > 0)
+    {
+        received += n;
+        buffer[received] = 0;
+        body = strstr(buffer, "\r\n\r\n");
+    }
+    if (body == NULL)
+    {
+        http_close(&connection);
+        return CORONA_FAILED;
+    }
+    *body = 0;
+    body += 4;
+    size_t body_len = buffer + received - body;
+
+    int status = 0;
+    sscanf(buffer, "HTTP/%*d.%*d %d", &status);
+    enum corona_result result = CORONA_FAILED;
+    if (status == 304 && cached && corona_cache.value[0])
+    {
+        snprintf(value, value_size, "%s", corona_cache.value);
+        result = CORONA_FOUND;
+    }
+    else if (status == 301 || status == 302 || status == 307 || status == 308)
+    {
+        *location = http_header_value(buffer, "Location");
+    }
+    else if (status == 200)
+    {
+        struct corona_scanner scanner;
+        memset(&scanner, 0, sizeof(scanner));
+        scanner.country = CORONA_COUNTRY;
+        struct chunk_decoder decoder;
+        memset(&decoder, 0, sizeof(decoder));
+        char *transfer_encoding = http_header_value(buffer, "Transfer-Encoding");
+        decoder.chunked = transfer_encoding != NULL && strcasecmp(transfer_encoding, "chunked") == 0;
+        free(transfer_encoding);
+
+        int done = chunk_decoder_feed(&decoder, &scanner, body, body_len);
+        char *etag = http_header_value(buffer, "ETag");
+        char *last_modified = http_header_value(buffer, "Last-Modified");
+        while (!done && (n = http_read(&connection, buffer, sizeof(buffer))) > 0)
+            done = chunk_decoder_feed(&decoder, &scanner, buffer, n);
+
+        if (done)
+        {
+            free(corona_cache.url);
+            free(corona_cache.etag);
+            free(corona_cache.last_modified);
+            corona_cache.url = strdup(full_url);
+            corona_cache.etag = etag;
+            corona_cache.last_modified = last_modified;
+            snprintf(corona_cache.value, sizeof(corona_cache.value), "%s", scanner.value);
+            snprintf(value, value_size, "%s", scanner.value);
+            result = CORONA_FOUND;
+        }
+        else
+        {
+            free(etag);
+            free(last_modified);
+        }
+    }
+    http_close(&connection);
+    return result;
+}
+
+/**
+ * Fetches the number of cases, following at most CORONA_MAX_REDIRECTS redirects
+ * @param url        http:// or https:// url of the page
+ * @param value      filled with the number of cases
+ * @param value_size size of value
+ * @return CORONA_FOUND or CORONA_FAILED
+ */
+enum corona_result corona_fetch(const char *url, char *value, size_t value_size)
+{
+    char *current = strdup(url);
+    enum corona_result result = CORONA_FAILED;
+    for (int hop = 0; hop <= CORONA_MAX_REDIRECTS; hop++)
+    {
+        char *location;
+        result = corona_request(current, value, value_size, &location);
+        if (location == NULL)
+            break;
+        char *next = resolve_location(current, location);
+        free(location);
+        free(current);
+        current = next;
+        result = CORONA_FAILED; // unless a later hop succeeds
+    }
+    free(current);
+    return result;
+}
+
 void print_warning(char *message)
 {
     fprintf(stderr, ANSI_COLOR_WARNING "Warning: %s" ANSI_COLOR_RESET, message);
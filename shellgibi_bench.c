@@ -0,0 +1,398 @@
+// Micro-benchmarks for the parser, completion and launch paths of shellgibi.
+// Built from the shell sources, prints one JSON object per benchmark to stdout.
+#define SHELLGIBI_NO_MAIN
+#include "shellgibi.c"
+
+#include <sys/stat.h>
+
+int bench_quick = 0;
+char *bench_filter = NULL;
+
+int compare_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int bench_selected(const char *name)
+{
+    return bench_filter == NULL || strstr(name, bench_filter) != NULL;
+}
+
+/**
+ * Prints the result of a benchmark as a single JSON line
+ * @param name       benchmark name
+ * @param param      size parameter of the benchmark (entries, stages, tokens)
+ * @param samples    per-iteration durations in ns, sorted in place
+ * @param iterations number of samples
+ */
+void bench_report(const char *name, long param, uint64_t *samples, int iterations)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < iterations; i++)
+        total += samples[i];
+    qsort(samples, iterations, sizeof(uint64_t), compare_uint64);
+    printf("{\"bench\":\"%s\",\"param\":%ld,\"iterations\":%d,\"mean_ns\":%.1f,"
+           "\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu}\n",
+           name, param, iterations, (double)total / iterations,
+           (unsigned long long)samples[iterations / 2],
+           (unsigned long long)samples[iterations * 9 / 10],
+           (unsigned long long)samples[iterations * 99 / 100],
+           (unsigned long long)samples[iterations - 1]);
+    fflush(stdout);
+}
+
+void bench_parse(const char *name, const char *line, long param, int iterations)
+{
+    if (!bench_selected(name))
+        return;
+    uint64_t *samples = malloc(iterations * sizeof(uint64_t));
+    size_t len = strlen(line);
+    char *buf = malloc(len + 1);
+    for (int i = 0; i < iterations; i++)
+    {
+        memcpy(buf, line, len + 1); // parse_command writes into its input
+        struct command_t *command = shell_calloc(MEMORY_COMMAND, 1, sizeof(struct command_t));
+        uint64_t start = trace_now();
+        parse_command(buf, command);
+        samples[i] = trace_now() - start;
+        free_command(command);
+    }
+    bench_report(name, param, samples, iterations);
+    free(buf);
+    free(samples);
+}
+
+// building a compiled loop statement for one iteration, compare with parse_command/*
+void bench_statement(const char *name, const char *line, long param, int iterations)
+{
+    if (!bench_selected(name))
+        return;
+    uint64_t *samples = malloc(iterations * sizeof(uint64_t));
+    struct script_node *node = compile_script(line);
+    set_variable("i", "42", false);
+    for (int i = 0; i < iterations; i++)
+    {
+        struct command_t *command = shell_calloc(MEMORY_COMMAND, 1, sizeof(struct command_t));
+        uint64_t start = trace_now();
+        instantiate_statement(node, command);
+        samples[i] = trace_now() - start;
+        free_command(command);
+    }
+    bench_report(name, param, samples, iterations);
+    free_script(node);
+    free(samples);
+}
+
+// command line with arg_count arguments, or a pipeline of stages commands
+char *generate_line(int arg_count, int stages)
+{
+    char *line = malloc((arg_count + stages) * 32 + 1);
+    char *end = line;
+    end += sprintf(end, "cmd");
+    for (int i = 0; i < arg_count; i++)
+        end += sprintf(end, " --argument-%d", i);
+    for (int i = 1; i < stages; i++)
+        end += sprintf(end, " | stage%d -x", i);
+    return line;
+}
+
+/**
+ * Creates a directory with entries files named file_<n>
+ * @param entries    number of files
+ * @param executable create the files with the executable bit
+ * @return           malloc'ed path of the directory
+ */
+char *make_synthetic_directory(int entries, int executable)
+{
+    char template[] = "/tmp/shellgibi-bench-XXXXXX";
+    char *directory = strdup(mkdtemp(template));
+    char path[4096];
+    for (int i = 0; i < entries; i++)
+    {
+        snprintf(path, sizeof(path), "%s/file_%d", directory, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, executable ? 0755 : 0644);
+        close(fd);
+    }
+    return directory;
+}
+
+void remove_synthetic_directory(char *directory)
+{
+    DIR *dir = opendir(directory);
+    struct dirent *entry;
+    char path[4096];
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+    rmdir(directory);
+    free(directory);
+}
+
+void bench_completion(int entries, int iterations)
+{
+    const char *prefixes[] = {"f", "file_1", "file_4242", "x"};
+    char name[128];
+    uint64_t *samples = malloc(iterations * sizeof(uint64_t));
+
+    // command completion against a PATH made of one synthetic directory
+    char *old_path = strdup(getenv("PATH"));
+    char *directory = make_synthetic_directory(entries, 1);
+    setenv("PATH", directory, 1);
+    if (bench_selected("load_all_available_commands"))
+    {
+        int load_iterations = iterations < 10 ? iterations : 10;
+        for (int i = 0; i < load_iterations; i++)
+        {
+            uint64_t start = trace_now();
+            load_all_available_commands();
+            samples[i] = trace_now() - start;
+        }
+        bench_report("load_all_available_commands", entries, samples, load_iterations);
+    }
+    else
+        load_all_available_commands();
+
+    for (int p = 0; p < sizeof(prefixes) / sizeof(prefixes[0]); p++)
+    {
+        snprintf(name, sizeof(name), "shellgibi_autocomplete/%s", prefixes[p]);
+        if (!bench_selected(name))
+            continue;
+        for (int i = 0; i < iterations; i++)
+        {
+            uint64_t start = trace_now();
+            struct autocomplete_match *match = shellgibi_autocomplete(prefixes[p]);
+            samples[i] = trace_now() - start;
+            free_autocomplete_match(match);
+        }
+        bench_report(name, entries, samples, iterations);
+    }
+    setenv("PATH", old_path, 1);
+    free(old_path);
+
+    // filename completion runs against the current directory
+    char cwd[4096];
+    getcwd(cwd, sizeof(cwd));
+    chdir(directory);
+    for (int p = 0; p < sizeof(prefixes) / sizeof(prefixes[0]); p++)
+    {
+        snprintf(name, sizeof(name), "filename_autocomplete/%s", prefixes[p]);
+        if (!bench_selected(name))
+            continue;
+        for (int i = 0; i < iterations; i++)
+        {
+            uint64_t start = trace_now();
+            struct autocomplete_match *match = filename_autocomplete(prefixes[p]);
+            samples[i] = trace_now() - start;
+            free_autocomplete_match(match);
+        }
+        bench_report(name, entries, samples, iterations);
+    }
+    chdir(cwd);
+    remove_synthetic_directory(directory);
+    free(samples);
+}
+
+// fork/exec-to-exit latency of a pipeline of stages through process_command
+void bench_launch(const char *name, int stages, int iterations)
+{
+    if (!bench_selected(name))
+        return;
+    uint64_t *samples = malloc(iterations * sizeof(uint64_t));
+    char line[1024] = "true";
+    for (int i = 1; i < stages; i++)
+        strcat(line, " | cat");
+    char buf[1024];
+    for (int i = 0; i < iterations; i++)
+    {
+        strcpy(buf, line);
+        struct command_t *command = shell_calloc(MEMORY_COMMAND, 1, sizeof(struct command_t));
+        parse_command(buf, command);
+        uint64_t start = trace_now();
+        process_command(command, NULL);
+        samples[i] = trace_now() - start;
+        free_command(command);
+    }
+    bench_report(name, stages, samples, iterations);
+    free(samples);
+}
+
+/**
+ * Runs an in-process filter over a synthetic log of size bytes
+ * @param name    benchmark name
+ * @param command_line filter stage, e.g. "grep 4242" or "wc -l"
+ */
+void bench_filter_stage(const char *name, const char *command_line, size_t size, int iterations)
+{
+    if (!bench_selected(name))
+        return;
+    char *log = malloc(size);
+    size_t length = 0;
+    for (long line = 0; length + 64 < size; line++)
+        length += sprintf(log + length, "%ld GET /index.html 200 user-agent\n", line);
+    char buf[256];
+    strcpy(buf, command_line);
+    struct command_t *command = shell_calloc(MEMORY_COMMAND, 1, sizeof(struct command_t));
+    parse_command(buf, command);
+    int null_fd = open("/dev/null", O_WRONLY);
+    uint64_t *samples = malloc(iterations * sizeof(uint64_t));
+    for (int i = 0; i < iterations; i++)
+    {
+        struct filter_chain chain = {.first = make_filter_stage(command), .out_fd = null_fd};
+        chain.out = malloc(FILTER_BLOCK);
+        uint64_t start = trace_now();
+        for (size_t offset = 0; offset < length; offset += FILTER_BLOCK)
+            if (!filter_push(&chain, chain.first, log + offset,
+                             length - offset < FILTER_BLOCK ? length - offset : FILTER_BLOCK))
+                break;
+        filter_finish(&chain, chain.first);
+        write_all(chain.out_fd, chain.out, chain.out_length);
+        samples[i] = trace_now() - start;
+        free(chain.out);
+        free_filter_chain(chain.first);
+    }
+    bench_report(name, length, samples, iterations);
+    close(null_fd);
+    free_command(command);
+    free(samples);
+    free(log);
+}
+
+// one JSON line with the live memory of every subsystem, the arena and the RSS
+void soak_checkpoint(long iteration, uint64_t elapsed_ns)
+{
+    long live_bytes = 0, live_count = 0;
+    for (int i = 0; i < MEMORY_SUBSYSTEM_COUNT; i++)
+    {
+        live_bytes += memory_accounts[i].live_bytes;
+        live_count += memory_accounts[i].live_count;
+    }
+    printf("{\"bench\":\"soak\",\"iteration\":%ld,\"elapsed_ms\":%llu,\"live_bytes\":%ld,\"live_blocks\":%ld",
+           iteration, (unsigned long long)(elapsed_ns / 1000000), live_bytes, live_count);
+    for (int i = 0; i < MEMORY_SUBSYSTEM_COUNT; i++)
+        printf(",\"%s\":%ld", memory_subsystem_names[i], memory_accounts[i].live_bytes);
+    printf(",\"malloc_in_use\":%zu,\"rss\":%ld}\n", mallinfo2().uordblks, read_resident_bytes());
+    fflush(stdout);
+}
+
+/**
+ * A long session in one process: every iteration renders the prompt, parses
+ * and records a line, completes a command and a file name and runs the line
+ * if the shell handles it itself. Every 1000th iteration forks a command.
+ * Some lines carry the iteration number, so the history keeps seeing new words.
+ * Checkpoints are printed ten times, a leak shows up as growing live bytes
+ * @param iterations number of simulated prompts
+ */
+void bench_soak(long iterations)
+{
+    // lines run in the shell process, or only parsed when they would start a program
+    const struct
+    {
+        const char *line;
+        bool run;
+    } lines[] = {
+        {"ls -la *.c | grep -v bench > /dev/null 2>&1", false},
+        {"cat <<<here | wc -l", false},
+        {"SOAK=value", true},
+        {"export SOAK_EXPORTED=$SOAK", true},
+        {"unset SOAK_EXPORTED", true},
+        {"alias soak_alias='echo soak'", true},
+        {"soak_alias argument | head -n 1", false},
+        {"unalias soak_alias", true},
+        {"soak_function() { SOAK_INNER=$1; }", true},
+        {"soak_function argument", true},
+        {"for i in 1 2 3; do SOAK_LOOP=$i; done", true},
+        {"cd .", true},
+        {"grep -n needle_%ld notes_%ld.txt > /dev/null", false},
+        {"SOAK_DISTINCT=value_%ld", true},
+    };
+    int line_count = sizeof(lines) / sizeof(lines[0]);
+    char rendered[4096], buf[1024];
+    variables_init();
+    load_all_available_commands();
+    uint64_t start = trace_now();
+    for (long i = 0; i < iterations; i++)
+    {
+        if (i % (iterations / 10 > 0 ? iterations / 10 : 1) == 0)
+            soak_checkpoint(i, trace_now() - start);
+        render_prompt(rendered, sizeof(rendered));
+
+        struct command_t *command = shell_calloc(MEMORY_COMMAND, 1, sizeof(struct command_t));
+        bool forked = i % 1000 == 999;
+        int line = (i - (i + 1) / 1000) % line_count; // forked iterations do not skip a line
+        snprintf(buf, sizeof(buf), forked ? "true" : lines[line].line, i, i);
+        parse_command(buf, command);
+        if (forked || lines[line].run)
+            process_command(command, NULL);
+        record_history(command);
+        free_command(command);
+
+        free_autocomplete_match(shellgibi_autocomplete("gr"));
+        free_autocomplete_match(filename_autocomplete("shell"));
+    }
+    soak_checkpoint(iterations, trace_now() - start);
+    free_available_commands();
+}
+
+int main(int argc, char *argv[])
+{
+    long soak_iterations = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--quick") == 0)
+            bench_quick = 1;
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+            bench_filter = argv[++i];
+        else if (strcmp(argv[i], "--soak") == 0)
+            soak_iterations = i + 1 < argc && argv[i + 1][0] != '-' ? atol(argv[++i]) : 1000000;
+        else
+        {
+            fprintf(stderr, "usage: %s [--quick] [--filter <substring>] [--soak [iterations]]\n", argv[0]);
+            return INVALID;
+        }
+    }
+    int scale = bench_quick ? 10 : 1;
+    select_filter_kernels();
+
+    // the soak is a run of its own, it is too long to go with the micro-benchmarks
+    if (soak_iterations > 0)
+    {
+        bench_soak(soak_iterations);
+        return 0;
+    }
+
+    char *line = generate_line(200, 1);
+    bench_parse("parse_command/long_line", line, 200, 20000 / scale);
+    free(line);
+    line = generate_line(0, 8);
+    bench_parse("parse_command/pipeline", line, 8, 50000 / scale);
+    free(line);
+    line = generate_line(4, 64);
+    bench_parse("parse_command/long_pipeline", line, 64, 5000 / scale);
+    free(line);
+
+    line = generate_line(200, 1);
+    line = realloc(line, strlen(line) + 8);
+    strcat(line, " $i");
+    bench_parse("parse_command/long_line_variable", line, 200, 20000 / scale);
+    bench_statement("script/long_line_variable", line, 200, 20000 / scale);
+    free(line);
+
+    bench_completion(10000, 200 / scale);
+    if (!bench_quick)
+        bench_completion(100000, 50);
+
+    bench_launch("process_command/simple", 1, 500 / scale);
+    bench_launch("process_command/pipeline", 8, 200 / scale);
+
+    bench_filter_stage("filter/grep", "grep 4242", 64 << 20, 50 / scale);
+    bench_filter_stage("filter/grep_v", "grep -v GET", 64 << 20, 50 / scale);
+    bench_filter_stage("filter/wc_l", "wc -l", 64 << 20, 50 / scale);
+    bench_filter_stage("filter/tail", "tail -n 100", 64 << 20, 50 / scale);
+    return 0;
+}